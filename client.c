@@ -1,13 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include <ctype.h>
 
-#define DEVICE_PATH "/dev/mq"
+#include "libmq.h"
+
 #define CMD_BUF_SIZE 256
-#define READ_BUF_SIZE 512 // Buffer fixo para /read
 
 void limpar_espacos(char *str) {
     char *dst = str;
@@ -35,20 +33,62 @@ void mostrar_prompt() {
     printf("  /unr               - Desregistrar processo (ignora extras)\n");
     printf("  /msg <dest> <msg>  - Enviar mensagem\n");
     printf("  /all <msg>         - Enviar mensagem a todos\n");
-    printf("  /read              - Ler do dispositivo\n");
+    printf("  /sub <topico>      - Assinar um tópico\n");
+    printf("  /uns <topico>      - Cancelar a assinatura de um tópico\n");
+    printf("  /pub <topico> <msg> - Publicar mensagem num tópico\n");
+    printf("  /read              - Ler todas as mensagens disponíveis\n");
     printf("  /exit              - Sair do programa\n");
     printf("--------------------------------------------------\n");
 }
 
+// Separa "arg resto" em input: retorna arg (terminado em '\0') e aponta *resto para o resto
+static char* separar(char *input, char **resto) {
+    char *espaco = strchr(input, ' ');
+
+    *resto = NULL;
+    if (espaco) {
+        *espaco = '\0';
+        *resto = espaco + 1;
+    }
+    return input;
+}
+
+static void mostrar_mensagem(const mq_msg_t *msg, void *ctx) {
+    int *n = ctx;
+    int len = msg->len;
+
+    // Mensagens do protocolo texto chegam com o '\0' que o driver acrescenta
+    if (len > 0 && ((const char *)msg->dados)[len - 1] == '\0')
+        len--;
+    if (msg->remetente[0])
+        printf("Mensagem de %s:\n%.*s\n", msg->remetente, len, (const char *)msg->dados);
+    else
+        printf("Mensagem recebida:\n%.*s\n", len, (const char *)msg->dados);
+    if (msg->len < msg->size)
+        printf("(truncada: %zu de %zu bytes)\n", msg->len, msg->size);
+    (*n)++;
+}
+
+static void relatar(int ret) {
+    if (ret < 0)
+        printf("Erro: %s\n", strerror(-ret));
+}
+
 int main() {
-    int fd = open(DEVICE_PATH, O_RDWR);  // Precisa de leitura e escrita
-    if (fd < 0) {
-        perror("Erro ao abrir o dispositivo");
+    // O driver bloqueia o read até chegar mensagem; no prompt interativo queremos
+    // que /read retorne imediatamente quando a fila estiver vazia.
+    mq_t *mq;
+    int ret = mq_abrir(&mq, MQ_DISPOSITIVO, NULL, MQ_NAO_BLOQUEANTE, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Erro ao abrir o dispositivo: %s\n", strerror(-ret));
         return 1;
     }
+    if (!mq_versao(mq))
+        printf("Driver sem interface binária: usando o protocolo texto.\n");
 
     char input[CMD_BUF_SIZE];
-    char read_buf[READ_BUF_SIZE];
+    char *arg, *resto;
+    int n;
     mostrar_prompt();
 
     while (1) {
@@ -59,30 +99,43 @@ int main() {
         limpar_espacos(input);
 
         if (strncmp(input, "/reg ", 5) == 0) {
-            char *nome = input + 5;
-            char cmd[CMD_BUF_SIZE];
-            snprintf(cmd, sizeof(cmd), "/reg %s", nome);
-            write(fd, cmd, strlen(cmd) + 1);
+            relatar(mq_registrar(mq, input + 5));
 
         } else if (strncmp(input, "/unr", 4) == 0) {
-            write(fd, "/unr", 5);
+            relatar(mq_desregistrar(mq));
 
         } else if (strncmp(input, "/msg ", 5) == 0) {
-            write(fd, input, strlen(input) + 1);
+            arg = separar(input + 5, &resto);
+            if (!resto) {
+                printf("Uso: /msg <dest> <msg>\n");
+                continue;
+            }
+            relatar(mq_enviar(mq, arg, resto, strlen(resto), 0));
 
         } else if (strncmp(input, "/all ", 5) == 0) {
-            write(fd, input, strlen(input) + 1);
+            relatar(mq_enviar_todos(mq, input + 5, strlen(input + 5), 0));
+
+        } else if (strncmp(input, "/sub ", 5) == 0) {
+            relatar(mq_assinar(mq, input + 5));
+
+        } else if (strncmp(input, "/uns ", 5) == 0) {
+            relatar(mq_cancelar_assinatura(mq, input + 5));
+
+        } else if (strncmp(input, "/pub ", 5) == 0) {
+            arg = separar(input + 5, &resto);
+            if (!resto) {
+                printf("Uso: /pub <topico> <msg>\n");
+                continue;
+            }
+            relatar(mq_publicar(mq, arg, resto, strlen(resto), 0));
 
         } else if (strcmp(input, "/read") == 0) {
-            ssize_t bytes = read(fd, read_buf, READ_BUF_SIZE - 1);
-            if (bytes > 0) {
-                read_buf[bytes] = '\0';  // Garantir terminação
-                printf("Mensagem recebida:\n%s\n", read_buf);
-            } else if (bytes == 0) {
+            n = 0;
+            ret = mq_drenar(mq, mostrar_mensagem, &n);
+            if (ret < 0)
+                relatar(ret);
+            else if (n == 0)
                 printf("Nenhuma mensagem disponível no momento.\n");
-            } else {
-                perror("Erro ao ler do dispositivo");
-            }
 
         } else if (strcmp(input, "/exit") == 0) {
             printf("Encerrando...\n");
@@ -93,6 +146,6 @@ int main() {
         }
     }
 
-    close(fd);
+    mq_fechar(mq);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,627 @@
+// libmq: cliente do /dev/mq (ver libmq.h)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "libmq.h"
+
+// Versão da ABI em que cada recurso apareceu (ver MQ_ABI_VERSION)
+#define VERSAO_IDS       2
+#define VERSAO_LOTE      4
+#define VERSAO_TOPICOS   6
+#define VERSAO_PRIO      7
+#define VERSAO_CHAMADAS  8
+#define VERSAO_FILA      10
+
+#define TEXTO_NOME_MAX   7      // O driver lê nomes do protocolo texto com "%7s"
+#define NOME_MAX(mq)     ((mq)->versao ? MQ_NAME_SIZE - 1 : TEXTO_NOME_MAX)
+
+struct mq_cliente {
+    int fd;
+    int versao;                 // ABI do driver, ou 0 no protocolo texto
+    int id;
+    bool nao_bloqueante;
+    bool quadros;               // read() em MQ_MODE_BATCH: o buffer de recepção traz struct mq_frame
+    char nome[MQ_NAME_SIZE];
+    size_t buf_size;
+
+    // Recepção: mensagens lidas do driver e ainda não entregues estão em rx[rx_pos, rx_len)
+    char *rx;
+    size_t rx_len;
+    size_t rx_pos;
+
+    // Envio em lote: comandos binários em lote ou, no protocolo texto, um iovec por comando
+    // montado em tx (um writev é um comando por iovec)
+    struct mq_send_args lote[MQ_LOTE_MAX];
+    struct iovec iov[MQ_LOTE_MAX];
+    int n_lote;
+    char *tx;
+    size_t tx_len;
+};
+
+static int validar_nome(const char *nome, size_t max) {
+    size_t i, n;
+
+    if (!nome)
+        return -EINVAL;
+    n = strlen(nome);
+    if (n == 0)
+        return -EINVAL;
+    if (n > max)
+        return -ENAMETOOLONG;
+    // No protocolo texto um espaço terminaria o nome e o resto viraria payload
+    for (i = 0; i < n; i++)
+        if (isspace((unsigned char)nome[i]))
+            return -EINVAL;
+    return 0;
+}
+
+static int validar_envio(const mq_t *mq, size_t len, int prio) {
+    if (prio < 0 || prio >= MQ_PRIO_LEVELS)
+        return -EINVAL;
+    if (prio && mq->versao < VERSAO_PRIO)
+        return -EOPNOTSUPP;
+    if (len > UINT32_MAX)
+        return -EMSGSIZE;
+    return 0;
+}
+
+// Monta "cmd[ arg][ payload]" no espaço livre de tx (depois dos comandos de um lote pendente).
+// Retorna o tamanho do comando.
+static ssize_t montar_comando(mq_t *mq, const char *cmd, const char *arg, const void *buf, size_t len) {
+    char *p = mq->tx + mq->tx_len;
+    size_t n = strlen(cmd);
+    size_t n_arg = arg ? strlen(arg) : 0;
+    size_t total = n + (arg ? 1 + n_arg : 0) + (buf ? 1 + len : 0);
+
+    if (total > mq->buf_size)
+        return -EMSGSIZE;
+    if (total > mq->buf_size - mq->tx_len)
+        return -ENOBUFS;
+    memcpy(p, cmd, n);
+    if (arg) {
+        p[n++] = ' ';
+        memcpy(p + n, arg, n_arg);
+        n += n_arg;
+    }
+    if (buf) {
+        p[n++] = ' ';
+        memcpy(p + n, buf, len);
+        n += len;
+    }
+    return n;
+}
+
+static int escrever_comando(mq_t *mq, const char *cmd, const char *arg, const void *buf, size_t len) {
+    ssize_t n = montar_comando(mq, cmd, arg, buf, len);
+
+    if (n < 0)
+        return n;
+    return write(mq->fd, mq->tx + mq->tx_len, n) < 0 ? -errno : 0;
+}
+
+int mq_abrir(mq_t **pmq, const char *dispositivo, const char *nome, int flags, size_t buf_size) {
+    mq_t *mq;
+    int ret;
+
+    *pmq = NULL;
+    if (flags & ~(MQ_NAO_BLOQUEANTE | MQ_SO_TEXTO))
+        return -EINVAL;
+    if (!buf_size)
+        buf_size = MQ_BUF_PADRAO;
+    if (buf_size < MQ_FRAME_NEXT(MQ_NAME_SIZE))
+        return -EINVAL;
+
+    mq = calloc(1, sizeof(*mq));
+    if (!mq)
+        return -ENOMEM;
+    mq->id = -1;
+    mq->buf_size = buf_size;
+    mq->nao_bloqueante = flags & MQ_NAO_BLOQUEANTE;
+
+    mq->fd = open(dispositivo ? dispositivo : MQ_DISPOSITIVO,
+                  O_RDWR | O_CLOEXEC | (mq->nao_bloqueante ? O_NONBLOCK : 0));
+    if (mq->fd < 0) {
+        ret = -errno;
+        free(mq);
+        return ret;
+    }
+
+    // Um driver só com o protocolo texto responde ENOTTY
+    if (!(flags & MQ_SO_TEXTO)) {
+        ret = ioctl(mq->fd, MQ_IOC_VERSION);
+        if (ret > 0)
+            mq->versao = ret;
+    }
+    if (mq->versao >= VERSAO_LOTE) {
+        if (ioctl(mq->fd, MQ_IOC_SET_MODE, MQ_MODE_BATCH) < 0) {
+            ret = -errno;
+            goto erro;
+        }
+        mq->quadros = true;
+    }
+
+    ret = -ENOMEM;
+    mq->rx = malloc(buf_size);
+    if (!mq->rx)
+        goto erro;
+    if (!mq->versao) {
+        mq->tx = malloc(buf_size);
+        if (!mq->tx)
+            goto erro;
+    }
+
+    if (nome) {
+        ret = mq_registrar(mq, nome);
+        if (ret < 0)
+            goto erro;
+    }
+    *pmq = mq;
+    return 0;
+
+erro:
+    mq_fechar(mq);
+    return ret;
+}
+
+// Fechar o descritor também remove o registro do endpoint
+void mq_fechar(mq_t *mq) {
+    if (!mq)
+        return;
+    close(mq->fd);
+    free(mq->rx);
+    free(mq->tx);
+    free(mq);
+}
+
+int mq_fd(const mq_t *mq) {
+    return mq->fd;
+}
+
+int mq_versao(const mq_t *mq) {
+    return mq->versao;
+}
+
+int mq_id(const mq_t *mq) {
+    return mq->id;
+}
+
+const char *mq_nome(const mq_t *mq) {
+    return mq->nome;
+}
+
+int mq_registrar(mq_t *mq, const char *nome) {
+    struct mq_reg_args reg;
+    int ret;
+
+    ret = validar_nome(nome, NOME_MAX(mq));
+    if (ret)
+        return ret;
+
+    if (!mq->versao) {
+        ret = escrever_comando(mq, "/reg", nome, NULL, 0);
+        if (ret)
+            return ret;
+    } else {
+        memset(&reg, 0, sizeof(reg));
+        reg.nome = (uintptr_t)nome;
+        reg.nome_len = strlen(nome);
+        ret = ioctl(mq->fd, MQ_IOC_REG, &reg);
+        if (ret < 0)
+            return -errno;
+        if (mq->versao >= VERSAO_IDS)
+            mq->id = ret;
+    }
+    snprintf(mq->nome, sizeof(mq->nome), "%s", nome);
+    return mq->id < 0 ? 0 : mq->id;
+}
+
+int mq_desregistrar(mq_t *mq) {
+    int ret;
+
+    if (!mq->versao)
+        ret = escrever_comando(mq, "/unr", NULL, NULL, 0);
+    else
+        ret = ioctl(mq->fd, MQ_IOC_UNR) < 0 ? -errno : 0;
+    if (ret)
+        return ret;
+    mq->nome[0] = '\0';
+    mq->id = -1;
+    return 0;
+}
+
+int mq_definir_nao_bloqueante(mq_t *mq, bool nao_bloqueante) {
+    int flags = fcntl(mq->fd, F_GETFL);
+
+    if (flags < 0)
+        return -errno;
+    flags = nao_bloqueante ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(mq->fd, F_SETFL, flags) < 0)
+        return -errno;
+    mq->nao_bloqueante = nao_bloqueante;
+    return 0;
+}
+
+int mq_definir_fila(mq_t *mq, uint32_t bytes, uint32_t slots) {
+    struct mq_queue_args args;
+
+    if (mq->versao < VERSAO_FILA)
+        return -EOPNOTSUPP;
+
+    memset(&args, 0, sizeof(args));
+    args.bytes = bytes;
+    args.slots = slots;
+    return ioctl(mq->fd, MQ_IOC_SET_QUEUE, &args) < 0 ? -errno : 0;
+}
+
+//======================================================================================
+// Envio
+
+static void preparar_envio(struct mq_send_args *args, const char *dest, uint32_t dest_id, const void *buf, size_t len, int prio) {
+    memset(args, 0, sizeof(*args));
+    args->dest = (uintptr_t)dest;
+    args->dest_len = dest ? strlen(dest) : 0;
+    args->dest_id = dest_id;
+    args->buf = (uintptr_t)buf;
+    args->len = len;
+    args->flags = prio;
+}
+
+static int enviar_para(mq_t *mq, const char *dest, uint32_t dest_id, const void *buf, size_t len, int prio) {
+    struct mq_send_args args;
+    int ret;
+
+    ret = validar_envio(mq, len, prio);
+    if (ret)
+        return ret;
+    if (!dest && mq->versao < VERSAO_IDS)
+        return -EOPNOTSUPP;
+    if (!mq->versao) {
+        ret = validar_nome(dest, NOME_MAX(mq));
+        return ret ? ret : escrever_comando(mq, "/msg", dest, buf, len);
+    }
+    preparar_envio(&args, dest, dest_id, buf, len, prio);
+    return ioctl(mq->fd, MQ_IOC_SEND, &args) < 0 ? -errno : 0;
+}
+
+int mq_enviar(mq_t *mq, const char *dest, const void *buf, size_t len, int prio) {
+    if (!dest)
+        return -EINVAL;
+    return enviar_para(mq, dest, 0, buf, len, prio);
+}
+
+int mq_enviar_id(mq_t *mq, uint32_t dest_id, const void *buf, size_t len, int prio) {
+    return enviar_para(mq, NULL, dest_id, buf, len, prio);
+}
+
+int mq_enviar_todos(mq_t *mq, const void *buf, size_t len, int prio) {
+    struct mq_all_args args;
+    int ret;
+
+    ret = validar_envio(mq, len, prio);
+    if (ret)
+        return ret;
+    if (!mq->versao)
+        return escrever_comando(mq, "/all", NULL, buf, len);
+
+    memset(&args, 0, sizeof(args));
+    args.buf = (uintptr_t)buf;
+    args.len = len;
+    args.flags = prio;
+    ret = ioctl(mq->fd, MQ_IOC_ALL, &args);
+    return ret < 0 ? -errno : ret;
+}
+
+static int assinatura(mq_t *mq, const char *topico, bool assinar) {
+    struct mq_topic_args args;
+    int ret;
+
+    ret = validar_nome(topico, MQ_TOPIC_SIZE - 1);
+    if (ret)
+        return ret;
+    if (!mq->versao)
+        return escrever_comando(mq, assinar ? "/sub" : "/uns", topico, NULL, 0);
+    if (mq->versao < VERSAO_TOPICOS)
+        return -EOPNOTSUPP;
+
+    memset(&args, 0, sizeof(args));
+    args.nome = (uintptr_t)topico;
+    args.nome_len = strlen(topico);
+    return ioctl(mq->fd, assinar ? MQ_IOC_SUB : MQ_IOC_UNSUB, &args) < 0 ? -errno : 0;
+}
+
+int mq_assinar(mq_t *mq, const char *topico) {
+    return assinatura(mq, topico, true);
+}
+
+int mq_cancelar_assinatura(mq_t *mq, const char *topico) {
+    return assinatura(mq, topico, false);
+}
+
+int mq_publicar(mq_t *mq, const char *topico, const void *buf, size_t len, int prio) {
+    struct mq_pub_args args;
+    int ret;
+
+    ret = validar_envio(mq, len, prio);
+    if (!ret)
+        ret = validar_nome(topico, MQ_TOPIC_SIZE - 1);
+    if (ret)
+        return ret;
+    if (!mq->versao)
+        return escrever_comando(mq, "/pub", topico, buf, len);
+    if (mq->versao < VERSAO_TOPICOS)
+        return -EOPNOTSUPP;
+
+    memset(&args, 0, sizeof(args));
+    args.topico = (uintptr_t)topico;
+    args.topico_len = strlen(topico);
+    args.buf = (uintptr_t)buf;
+    args.len = len;
+    args.flags = prio;
+    ret = ioctl(mq->fd, MQ_IOC_PUB, &args);
+    return ret < 0 ? -errno : ret;
+}
+
+//======================================================================================
+// Lotes
+
+int mq_lote_adicionar(mq_t *mq, const char *dest, uint32_t dest_id, const void *buf, size_t len, int prio) {
+    ssize_t n;
+    int ret;
+
+    ret = validar_envio(mq, len, prio);
+    if (ret)
+        return ret;
+    if (!dest && mq->versao < VERSAO_IDS)
+        return -EOPNOTSUPP;
+    if (mq->n_lote == MQ_LOTE_MAX)
+        return -ENOBUFS;
+
+    if (!mq->versao) {
+        ret = validar_nome(dest, NOME_MAX(mq));
+        if (ret)
+            return ret;
+        n = montar_comando(mq, "/msg", dest, buf, len);
+        if (n < 0)
+            return n;
+        mq->iov[mq->n_lote].iov_base = mq->tx + mq->tx_len;
+        mq->iov[mq->n_lote].iov_len = n;
+        mq->tx_len += n;
+    } else {
+        preparar_envio(&mq->lote[mq->n_lote], dest, dest_id, buf, len, prio);
+    }
+    return ++mq->n_lote;
+}
+
+// Driver sem MQ_IOC_SEND_BATCH: um MQ_IOC_SEND por comando
+static int enviar_um_a_um(mq_t *mq, int n) {
+    int i, entregues = 0, erro = 0;
+
+    for (i = 0; i < n; i++) {
+        if (ioctl(mq->fd, MQ_IOC_SEND, &mq->lote[i]) == 0)
+            entregues++;
+        else if (!erro)
+            erro = -errno;
+    }
+    return entregues ? entregues : erro;
+}
+
+int mq_lote_enviar(mq_t *mq) {
+    struct mq_batch_args args;
+    int n = mq->n_lote;
+    int i, entregues;
+    ssize_t w;
+
+    if (!n)
+        return 0;
+    mq->n_lote = 0;
+    mq->tx_len = 0;
+
+    if (!mq->versao) {
+        // O driver executa os comandos do writev em ordem e para no primeiro que falha
+        w = writev(mq->fd, mq->iov, n);
+        if (w < 0)
+            return -errno;
+        for (i = 0, entregues = 0; i < n && (size_t)w >= mq->iov[i].iov_len; i++, entregues++)
+            w -= mq->iov[i].iov_len;
+        return entregues;
+    }
+    if (mq->versao < VERSAO_LOTE)
+        return enviar_um_a_um(mq, n);
+
+    memset(&args, 0, sizeof(args));
+    args.cmds = (uintptr_t)mq->lote;
+    args.count = n;
+    entregues = ioctl(mq->fd, MQ_IOC_SEND_BATCH, &args);
+    return entregues < 0 ? -errno : entregues;
+}
+
+int mq_lote_pendentes(const mq_t *mq) {
+    return mq->n_lote;
+}
+
+//======================================================================================
+// Recepção
+
+// Enche o buffer de recepção com um read(): em MQ_MODE_BATCH ele traz tantos quadros quantos
+// couberem; sem quadros, uma mensagem.
+static int encher(mq_t *mq) {
+    ssize_t n = read(mq->fd, mq->rx, mq->buf_size);
+
+    if (n < 0)
+        return -errno;
+    mq->rx_len = n;
+    mq->rx_pos = 0;
+    return 0;
+}
+
+// Entrega a próxima mensagem do buffer de recepção, que não pode estar vazio
+static void retirar_do_buffer(mq_t *mq, mq_msg_t *msg) {
+    const struct mq_frame *cab;
+
+    memset(msg, 0, sizeof(*msg));
+    if (!mq->quadros) {
+        msg->dados = mq->rx;
+        msg->len = msg->size = mq->rx_len;
+        mq->rx_pos = mq->rx_len;
+        return;
+    }
+
+    // Quadros começam alinhados a MQ_FRAME_ALIGN a partir do início do buffer
+    cab = (const struct mq_frame *)(mq->rx + mq->rx_pos);
+    msg->dados = cab + 1;
+    msg->len = cab->len;
+    msg->size = cab->size;
+    msg->seq = cab->seq;
+    msg->corr = cab->corr;
+    msg->prio = cab->prio;
+    memcpy(msg->remetente, cab->sender, MQ_NAME_SIZE);
+    msg->remetente[MQ_NAME_SIZE - 1] = '\0';
+    mq->rx_pos += MQ_FRAME_NEXT(cab->len);
+}
+
+static bool buffer_vazio(const mq_t *mq) {
+    return mq->rx_pos + (mq->quadros ? sizeof(struct mq_frame) : 1) > mq->rx_len;
+}
+
+int mq_proxima(mq_t *mq, mq_msg_t *msg) {
+    int ret;
+
+    if (buffer_vazio(mq)) {
+        ret = encher(mq);
+        if (ret)
+            return ret;
+        if (buffer_vazio(mq))
+            return -EAGAIN;
+    }
+    retirar_do_buffer(mq, msg);
+    return 0;
+}
+
+ssize_t mq_receber(mq_t *mq, void *buf, size_t len, mq_msg_t *msg) {
+    struct mq_recv_args args;
+    mq_msg_t local;
+    ssize_t n;
+
+    if (!msg)
+        msg = &local;
+
+    // Mensagens já lidas para o buffer vêm antes das que ainda estão na fila
+    if (!buffer_vazio(mq)) {
+        retirar_do_buffer(mq, msg);
+        n = msg->len < len ? msg->len : len;
+        memcpy(buf, msg->dados, n);
+        msg->dados = buf;
+        msg->len = n;
+        return n;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->dados = buf;
+    if (!mq->versao) {
+        n = read(mq->fd, buf, len);
+        if (n < 0)
+            return -errno;
+        msg->len = msg->size = n;
+        return n;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.buf = (uintptr_t)buf;
+    args.len = len < UINT32_MAX ? len : UINT32_MAX;
+    n = ioctl(mq->fd, MQ_IOC_RECV, &args);
+    if (n < 0)
+        return -errno;
+    msg->len = n;
+    msg->size = args.size;
+    msg->corr = args.corr;
+    msg->prio = args.prio;
+    memcpy(msg->remetente, args.sender, MQ_NAME_SIZE);
+    msg->remetente[MQ_NAME_SIZE - 1] = '\0';
+    return n;
+}
+
+int mq_drenar(mq_t *mq, mq_tratador_t tratador, void *ctx) {
+    struct pollfd pfd = { .fd = mq->fd, .events = POLLIN };
+    mq_msg_t msg;
+    int n = 0, ret;
+
+    for (;;) {
+        if (buffer_vazio(mq)) {
+            // Com o descritor bloqueante, só lê se a fila já tem mensagem
+            if (!mq->nao_bloqueante && poll(&pfd, 1, 0) <= 0)
+                break;
+            ret = encher(mq);
+            if (ret == -EAGAIN)
+                break;
+            if (ret)
+                return n ? n : ret;
+            if (buffer_vazio(mq))
+                break;
+        }
+        retirar_do_buffer(mq, &msg);
+        tratador(&msg, ctx);
+        n++;
+    }
+    return n;
+}
+
+//======================================================================================
+// Chamadas
+
+int mq_chamar(mq_t *mq, const char *dest, const void *buf, size_t len, void *resp, size_t resp_len,
+              size_t *resp_size, unsigned int timeout_ms, int prio) {
+    struct mq_call_args args;
+    int ret;
+
+    ret = validar_envio(mq, len, prio);
+    if (ret)
+        return ret;
+    if (!dest)
+        return -EINVAL;
+    if (mq->versao < VERSAO_CHAMADAS)
+        return -EOPNOTSUPP;
+
+    memset(&args, 0, sizeof(args));
+    args.dest = (uintptr_t)dest;
+    args.dest_len = strlen(dest);
+    args.buf = (uintptr_t)buf;
+    args.len = len;
+    args.reply = (uintptr_t)resp;
+    args.reply_len = resp_len < UINT32_MAX ? resp_len : UINT32_MAX;
+    args.timeout_ms = timeout_ms;
+    args.flags = prio;
+    ret = ioctl(mq->fd, MQ_IOC_CALL, &args);
+    if (ret < 0)
+        return -errno;
+    if (resp_size)
+        *resp_size = args.reply_size;
+    return ret;
+}
+
+int mq_responder(mq_t *mq, const char *dest, uint32_t corr, const void *buf, size_t len) {
+    struct mq_reply_args args;
+
+    if (!dest)
+        return -EINVAL;
+    if (len > UINT32_MAX)
+        return -EMSGSIZE;
+    if (mq->versao < VERSAO_CHAMADAS)
+        return -EOPNOTSUPP;
+
+    memset(&args, 0, sizeof(args));
+    args.dest = (uintptr_t)dest;
+    args.dest_len = strlen(dest);
+    args.buf = (uintptr_t)buf;
+    args.len = len;
+    args.corr = corr;
+    return ioctl(mq->fd, MQ_IOC_REPLY, &args) < 0 ? -errno : 0;
+}
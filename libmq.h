@@ -0,0 +1,114 @@
+/*
+ * libmq: biblioteca de cliente do /dev/mq para o espaço do usuário.
+ *
+ * Um mq_t é dono de um descritor do /dev/mq e do registro do endpoint nele. A biblioteca usa
+ * a interface binária (mq_ioctl.h) quando o driver a oferece: envios com MQ_IOC_SEND, lotes
+ * com MQ_IOC_SEND_BATCH e leitura em MQ_MODE_BATCH, que drena várias mensagens por read(). Com
+ * um driver sem ioctl (ou com MQ_SO_TEXTO) ela cai para o protocolo texto (/reg, /msg, ...),
+ * com a mesma API; o que só existe na interface binária retorna -EOPNOTSUPP.
+ *
+ * Nenhuma operação aloca memória depois de mq_abrir: os buffers de recepção e de montagem dos
+ * comandos texto são do mq_t. Funções que retornam int retornam 0 (ou a contagem descrita)
+ * em caso de sucesso e -errno em caso de erro. Com MQ_NAO_BLOQUEANTE, o que teria de esperar
+ * retorna -EAGAIN, e mq_fd() pode ser posto num poll/epoll (POLLIN quando há mensagem).
+ *
+ * Um mq_t não é thread-safe: use um por thread (cada um é um endpoint próprio).
+ */
+#ifndef LIBMQ_H
+#define LIBMQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "mq_ioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQ_DISPOSITIVO "/dev/mq"
+#define MQ_BUF_PADRAO  65536    // Buffer de recepção (e de comandos texto) se mq_abrir recebe 0
+#define MQ_LOTE_MAX    64       // Envios acumulados até mq_lote_enviar
+
+// Flags de mq_abrir
+#define MQ_NAO_BLOQUEANTE 0x1   // Abre com O_NONBLOCK
+#define MQ_SO_TEXTO       0x2   // Usa o protocolo texto mesmo se o driver tiver ioctl
+
+typedef struct mq_cliente mq_t;
+
+// Mensagem recebida. dados aponta para o buffer do mq_t (mq_proxima, mq_drenar) ou do chamador
+// (mq_receber) e vale até a próxima operação de recepção. No protocolo texto o remetente não é
+// conhecido (remetente vazio) e seq, corr e prio são 0.
+typedef struct mq_msg {
+    const void *dados;
+    size_t len;                 // Bytes em dados
+    size_t size;                // Tamanho real da mensagem (len < size: truncada)
+    uint32_t seq;               // Número de sequência na faixa (só em mq_proxima e mq_drenar)
+    uint32_t corr;              // Id de uma chamada a responder com mq_responder, senão 0
+    uint8_t prio;
+    char remetente[MQ_NAME_SIZE];
+} mq_msg_t;
+
+typedef void (*mq_tratador_t)(const mq_msg_t *msg, void *ctx);
+
+// Abre dispositivo (NULL: MQ_DISPOSITIVO) e, se nome não é NULL, registra o endpoint.
+// buf_size é o tamanho do buffer de recepção (0: MQ_BUF_PADRAO); no protocolo texto ele
+// também limita o tamanho de um comando enviado.
+int mq_abrir(mq_t **mq, const char *dispositivo, const char *nome, int flags, size_t buf_size);
+void mq_fechar(mq_t *mq);
+
+int mq_fd(const mq_t *mq);
+int mq_versao(const mq_t *mq);          // MQ_ABI_VERSION do driver, ou 0 no protocolo texto
+int mq_id(const mq_t *mq);              // Id do endpoint, ou -1 (não registrado ou texto)
+const char *mq_nome(const mq_t *mq);    // Nome registrado, ou "" se não registrado
+
+// Registra o endpoint como nome (até MQ_NAME_SIZE - 1 caracteres; 7 no protocolo texto).
+// Retorna o id do endpoint, ou 0 no protocolo texto.
+int mq_registrar(mq_t *mq, const char *nome);
+int mq_desregistrar(mq_t *mq);
+int mq_definir_nao_bloqueante(mq_t *mq, bool nao_bloqueante);
+
+// Tamanho da fila do endpoint em bytes e slots do anel do modo mmap (MQ_IOC_SET_QUEUE; 0 mantém
+// o atual). Antes de mq_registrar vale para o registro; depois, troca a fila sem perder
+// mensagens (-ENOSPC se as pendentes não cabem). Só na interface binária.
+int mq_definir_fila(mq_t *mq, uint32_t bytes, uint32_t slots);
+
+// Envios. prio vai de 0 a MQ_PRIO_LEVELS - 1 (só 0 no protocolo texto).
+// mq_enviar_todos e mq_publicar retornam o número de destinatários (0 no protocolo texto).
+int mq_enviar(mq_t *mq, const char *dest, const void *buf, size_t len, int prio);
+int mq_enviar_id(mq_t *mq, uint32_t dest_id, const void *buf, size_t len, int prio);
+int mq_enviar_todos(mq_t *mq, const void *buf, size_t len, int prio);
+int mq_assinar(mq_t *mq, const char *topico);
+int mq_cancelar_assinatura(mq_t *mq, const char *topico);
+int mq_publicar(mq_t *mq, const char *topico, const void *buf, size_t len, int prio);
+
+// Lotes: acumula até MQ_LOTE_MAX envios (para dest, ou dest_id se dest é NULL) e os entrega
+// numa única syscall em mq_lote_enviar. Na interface binária buf não é copiado e precisa
+// continuar válido até lá. mq_lote_adicionar retorna quantos envios estão pendentes, ou
+// -ENOBUFS com o lote cheio; mq_lote_enviar retorna quantos foram entregues (o lote é
+// esvaziado mesmo que alguns falhem) ou o erro, se nenhum foi.
+int mq_lote_adicionar(mq_t *mq, const char *dest, uint32_t dest_id, const void *buf, size_t len, int prio);
+int mq_lote_enviar(mq_t *mq);
+int mq_lote_pendentes(const mq_t *mq);
+
+// Recepção. mq_proxima entrega a próxima mensagem do buffer do mq_t, enchendo-o com um read()
+// (que traz tantas mensagens quantas couberem) quando ele se esgota. mq_receber copia a
+// próxima mensagem para buf e retorna os bytes copiados. mq_drenar chama tratador para cada
+// mensagem disponível, sem bloquear, e retorna quantas foram tratadas.
+int mq_proxima(mq_t *mq, mq_msg_t *msg);
+ssize_t mq_receber(mq_t *mq, void *buf, size_t len, mq_msg_t *msg);
+int mq_drenar(mq_t *mq, mq_tratador_t tratador, void *ctx);
+
+// Chamadas (MQ_IOC_CALL/MQ_IOC_REPLY). mq_chamar retorna os bytes da resposta copiados para
+// resp e, se resp_size não é NULL, o tamanho real dela.
+int mq_chamar(mq_t *mq, const char *dest, const void *buf, size_t len, void *resp, size_t resp_len,
+              size_t *resp_size, unsigned int timeout_ms, int prio);
+int mq_responder(mq_t *mq, const char *dest, uint32_t corr, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBMQ_H
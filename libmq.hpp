@@ -0,0 +1,163 @@
+/*
+ * libmq para C++ (C++17): mq::Endpoint é dono de um mq_t (libmq.h), com RAII e sem cópia.
+ *
+ * Erros viram std::system_error, exceto o que teria de esperar num endpoint não bloqueante
+ * (EAGAIN): os envios retornam false e as recepções std::nullopt, para uso num laço de eventos
+ * com fd(). mq::Mensagem é uma visão do buffer do endpoint e vale até a próxima recepção.
+ */
+#ifndef LIBMQ_HPP
+#define LIBMQ_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "libmq.h"
+
+namespace mq {
+
+class Mensagem {
+public:
+    Mensagem() = default;
+    explicit Mensagem(const mq_msg_t &msg) : msg_(msg) {}
+
+    std::string_view dados() const { return { static_cast<const char *>(msg_.dados), msg_.len }; }
+    std::string_view remetente() const { return msg_.remetente; }
+    std::size_t tamanho() const { return msg_.size; }
+    bool truncada() const { return msg_.len < msg_.size; }
+    std::uint32_t seq() const { return msg_.seq; }
+    std::uint32_t corr() const { return msg_.corr; }
+    int prio() const { return msg_.prio; }
+    const mq_msg_t &c() const { return msg_; }
+
+private:
+    mq_msg_t msg_ {};
+};
+
+class Endpoint {
+public:
+    explicit Endpoint(const char *nome = nullptr, int flags = 0, const char *dispositivo = nullptr,
+                      std::size_t buf_size = 0) {
+        verificar(mq_abrir(&mq_, dispositivo, nome, flags, buf_size), "mq_abrir");
+    }
+    ~Endpoint() { mq_fechar(mq_); }
+
+    Endpoint(const Endpoint &) = delete;
+    Endpoint &operator=(const Endpoint &) = delete;
+    Endpoint(Endpoint &&outro) noexcept : mq_(std::exchange(outro.mq_, nullptr)) {}
+    Endpoint &operator=(Endpoint &&outro) noexcept {
+        if (this != &outro) {
+            mq_fechar(mq_);
+            mq_ = std::exchange(outro.mq_, nullptr);
+        }
+        return *this;
+    }
+
+    int fd() const { return mq_fd(mq_); }
+    int versao() const { return mq_versao(mq_); }
+    int id() const { return mq_id(mq_); }
+    std::string_view nome() const { return mq_nome(mq_); }
+    mq_t *c() { return mq_; }
+
+    int registrar(const char *nome) { return verificar(mq_registrar(mq_, nome), "mq_registrar"); }
+    void desregistrar() { verificar(mq_desregistrar(mq_), "mq_desregistrar"); }
+    void definir_nao_bloqueante(bool nao_bloqueante) {
+        verificar(mq_definir_nao_bloqueante(mq_, nao_bloqueante), "mq_definir_nao_bloqueante");
+    }
+    void definir_fila(std::uint32_t bytes, std::uint32_t slots = 0) {
+        verificar(mq_definir_fila(mq_, bytes, slots), "mq_definir_fila");
+    }
+
+    bool enviar(const char *dest, std::string_view dados, int prio = 0) {
+        return enviado(mq_enviar(mq_, dest, dados.data(), dados.size(), prio), "mq_enviar");
+    }
+    bool enviar(std::uint32_t dest_id, std::string_view dados, int prio = 0) {
+        return enviado(mq_enviar_id(mq_, dest_id, dados.data(), dados.size(), prio), "mq_enviar_id");
+    }
+    std::optional<int> enviar_todos(std::string_view dados, int prio = 0) {
+        return contagem(mq_enviar_todos(mq_, dados.data(), dados.size(), prio), "mq_enviar_todos");
+    }
+    void assinar(const char *topico) { verificar(mq_assinar(mq_, topico), "mq_assinar"); }
+    void cancelar_assinatura(const char *topico) {
+        verificar(mq_cancelar_assinatura(mq_, topico), "mq_cancelar_assinatura");
+    }
+    std::optional<int> publicar(const char *topico, std::string_view dados, int prio = 0) {
+        return contagem(mq_publicar(mq_, topico, dados.data(), dados.size(), prio), "mq_publicar");
+    }
+
+    // Acrescenta ao lote, enviando-o antes se está cheio. dados precisa continuar válido até
+    // enviar_lote(). Retorna quantos envios ficaram pendentes.
+    int adicionar(const char *dest, std::string_view dados, int prio = 0) {
+        return adicionar(dest, 0, dados, prio);
+    }
+    int adicionar(std::uint32_t dest_id, std::string_view dados, int prio = 0) {
+        return adicionar(nullptr, dest_id, dados, prio);
+    }
+    std::optional<int> enviar_lote() { return contagem(mq_lote_enviar(mq_), "mq_lote_enviar"); }
+    int pendentes() const { return mq_lote_pendentes(mq_); }
+
+    std::optional<Mensagem> proxima() {
+        mq_msg_t msg;
+        int ret = mq_proxima(mq_, &msg);
+        if (ret == -EAGAIN)
+            return std::nullopt;
+        verificar(ret, "mq_proxima");
+        return Mensagem(msg);
+    }
+
+    // Chama f(const Mensagem &) para cada mensagem disponível, sem bloquear. f não pode lançar
+    // exceções: ela é chamada de dentro de mq_drenar, que é C.
+    template <typename F>
+    int drenar(F &&f) {
+        auto tratador = [](const mq_msg_t *msg, void *ctx) { (*static_cast<std::remove_reference_t<F> *>(ctx))(Mensagem(*msg)); };
+        return verificar(mq_drenar(mq_, tratador, &f), "mq_drenar");
+    }
+
+    // Retorna os bytes da resposta copiados para resp, ou std::nullopt se teria de esperar
+    std::optional<std::size_t> chamar(const char *dest, std::string_view dados, void *resp, std::size_t resp_len,
+                                      unsigned int timeout_ms = 0, int prio = 0) {
+        return contagem(mq_chamar(mq_, dest, dados.data(), dados.size(), resp, resp_len, nullptr, timeout_ms, prio),
+                        "mq_chamar");
+    }
+    void responder(const Mensagem &pedido, std::string_view dados) {
+        verificar(mq_responder(mq_, pedido.c().remetente, pedido.corr(), dados.data(), dados.size()), "mq_responder");
+    }
+
+private:
+    static int verificar(int ret, const char *onde) {
+        if (ret < 0)
+            throw std::system_error(-ret, std::generic_category(), onde);
+        return ret;
+    }
+    static bool enviado(int ret, const char *onde) {
+        if (ret == -EAGAIN)
+            return false;
+        verificar(ret, onde);
+        return true;
+    }
+    static std::optional<int> contagem(int ret, const char *onde) {
+        if (ret == -EAGAIN)
+            return std::nullopt;
+        return verificar(ret, onde);
+    }
+
+    int adicionar(const char *dest, std::uint32_t dest_id, std::string_view dados, int prio) {
+        int ret = mq_lote_adicionar(mq_, dest, dest_id, dados.data(), dados.size(), prio);
+        if (ret == -ENOBUFS && pendentes()) {
+            verificar(mq_lote_enviar(mq_), "mq_lote_enviar");
+            ret = mq_lote_adicionar(mq_, dest, dest_id, dados.data(), dados.size(), prio);
+        }
+        return verificar(ret, "mq_lote_adicionar");
+    }
+
+    mq_t *mq_ = nullptr;
+};
+
+} // namespace mq
+
+#endif // LIBMQ_HPP
@@ -0,0 +1,418 @@
+// Benchmark do /dev/mq: N produtores e M consumidores (threads, cada uma com seu descritor
+// registrado) trocando mensagens com /msg ou /all. Cada payload começa com o instante do
+// envio (CLOCK_MONOTONIC, em hexadecimal), de onde o consumidor tira a latência.
+//
+// O tamanho das filas vem dos parâmetros do módulo (QUEUE_BYTES etc.), ou de -q para as dos
+// consumidores (MQ_IOC_SET_QUEUE), até o teto QUEUE_BYTES_MAX.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "mq_ioctl.h"
+
+#define DEVICE_PATH "/dev/mq"
+#define PARAMETROS "/sys/module/mq_driver/parameters/"
+#define TS_DIGITOS 16               // Instante do envio no início do payload (%016llx)
+#define AMOSTRAS_MAX (1 << 22)      // Latências guardadas por consumidor
+#define OCIOSO_MS 200               // Consumidor sai se a fila fica vazia por isto após o fim dos envios
+#define LOTE_BUF_SIZE 65536         // Buffer de read() no modo lote
+
+typedef struct config {
+    int produtores;
+    int consumidores;
+    int mensagens;      // Por produtor
+    int tamanho;        // Bytes de payload
+    int fanout;         // /msg: consumidores distintos por produtor (rodízio)
+    int politica;       // MQ_OVERFLOW_* das filas dos consumidores
+    int fila;           // Bytes das filas dos consumidores; 0: padrão do módulo
+    bool todos;         // /all em vez de /msg
+    bool binario;       // ioctl (MQ_IOC_SEND/MQ_IOC_ALL) em vez do protocolo texto
+    bool lote;          // Consumidores leem com MQ_MODE_BATCH
+} config_t;
+
+typedef struct produtor {
+    pthread_t thread;
+    int fd;
+    int indice;
+    uint64_t enviadas;
+    uint64_t falhas;
+} produtor_t;
+
+typedef struct consumidor {
+    pthread_t thread;
+    int fd;
+    int indice;
+    uint32_t id;
+    char nome[MQ_NAME_SIZE];
+    uint64_t recebidas;
+    uint64_t bytes;
+    uint64_t ultima;    // Instante da última mensagem recebida
+    uint64_t *latencias;
+    size_t amostras;
+    size_t capacidade;
+} consumidor_t;
+
+static config_t cfg = {
+    .produtores = 1,
+    .consumidores = 1,
+    .mensagens = 100000,
+    .tamanho = 64,
+    .fanout = 1,
+    .politica = -1,     // -1: mantém o padrão do módulo (OVERFLOW_POLICY)
+};
+
+static consumidor_t *consumidores;
+static pthread_barrier_t largada;
+static atomic_int produtores_ativos;
+
+static uint64_t agora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void uso(const char *prog) {
+    fprintf(stderr,
+        "Uso: %s [opções]\n"
+        "  -p N      produtores (padrão 1)\n"
+        "  -c M      consumidores (padrão 1)\n"
+        "  -n K      mensagens por produtor (padrão 100000)\n"
+        "  -s BYTES  tamanho do payload, mínimo %d (padrão 64)\n"
+        "  -m MODO   msg ou all (padrão msg)\n"
+        "  -f F      /msg: cada produtor alterna entre F consumidores (padrão 1)\n"
+        "  -o POL    política das filas dos consumidores: 0 sobrescrever, 1 recusar, 2 bloquear\n"
+        "  -q BYTES  tamanho das filas dos consumidores (padrão: o do módulo)\n"
+        "  -i        usa a interface ioctl em vez do protocolo texto\n"
+        "  -b        consumidores leem em lote (MQ_MODE_BATCH)\n",
+        prog, TS_DIGITOS);
+}
+
+// Abre um descritor e o registra como "nome". Retorna o fd, ou -1.
+static int abrir_endpoint(const char *nome, int flags, uint32_t *id) {
+    struct mq_reg_args reg;
+    int fd, ret;
+
+    fd = open(DEVICE_PATH, O_RDWR | flags);
+    if (fd < 0) {
+        perror("Erro ao abrir o dispositivo");
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.nome = (uintptr_t)nome;
+    reg.nome_len = strlen(nome);
+    ret = ioctl(fd, MQ_IOC_REG, &reg);
+    if (ret < 0) {
+        fprintf(stderr, "Erro ao registrar \"%s\": %s\n", nome, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (id)
+        *id = ret;
+    return fd;
+}
+
+static void* produzir(void *arg) {
+    produtor_t *p = arg;
+    char prefixo[32];
+    char *buf, *dados;
+    size_t cabecalho;
+    int i, dest;
+    long ret;
+
+    // Espaço para o maior cabeçalho texto ("/msg nome ") antes do payload
+    buf = malloc(sizeof(prefixo) + cfg.tamanho + 1);
+    if (!buf) {
+        atomic_fetch_sub(&produtores_ativos, 1);
+        pthread_barrier_wait(&largada);
+        return NULL;
+    }
+    memset(buf, 'x', sizeof(prefixo) + cfg.tamanho + 1);
+
+    pthread_barrier_wait(&largada);
+    for (i = 0; i < cfg.mensagens; i++) {
+        dest = (p->indice + i % cfg.fanout) % cfg.consumidores;
+        if (cfg.binario)
+            cabecalho = 0;
+        else if (cfg.todos)
+            cabecalho = snprintf(prefixo, sizeof(prefixo), "/all ");
+        else
+            cabecalho = snprintf(prefixo, sizeof(prefixo), "/msg %s ", consumidores[dest].nome);
+
+        // O cabeçalho fica encostado no payload, que sempre começa em buf + sizeof(prefixo)
+        dados = buf + sizeof(prefixo);
+        memcpy(dados - cabecalho, prefixo, cabecalho);
+        snprintf(dados, TS_DIGITOS + 1, "%016llx", (unsigned long long)agora_ns());
+        dados[TS_DIGITOS] = 'x';
+
+        if (cfg.binario && cfg.todos) {
+            struct mq_all_args all = { .buf = (uintptr_t)dados, .len = cfg.tamanho };
+            ret = ioctl(p->fd, MQ_IOC_ALL, &all);
+        } else if (cfg.binario) {
+            struct mq_send_args send = { .buf = (uintptr_t)dados, .len = cfg.tamanho,
+                                         .dest_id = consumidores[dest].id };
+            ret = ioctl(p->fd, MQ_IOC_SEND, &send);
+        } else {
+            ret = write(p->fd, dados - cabecalho, cabecalho + cfg.tamanho);
+        }
+        if (ret < 0)
+            p->falhas++;
+        else
+            p->enviadas++;
+    }
+
+    free(buf);
+    atomic_fetch_sub(&produtores_ativos, 1);
+    return NULL;
+}
+
+// Contabiliza uma mensagem recebida no instante agora
+static void registrar_recebida(consumidor_t *c, const char *dados, size_t len, uint64_t agora) {
+    char ts[TS_DIGITOS + 1];
+    uint64_t enviada;
+
+    c->recebidas++;
+    c->bytes += cfg.tamanho;
+    c->ultima = agora;
+    if (len < TS_DIGITOS || c->amostras == c->capacidade)
+        return;
+    memcpy(ts, dados, TS_DIGITOS);
+    ts[TS_DIGITOS] = '\0';
+    enviada = strtoull(ts, NULL, 16);
+    if (enviada && enviada <= agora)
+        c->latencias[c->amostras++] = agora - enviada;
+}
+
+static void* consumir(void *arg) {
+    consumidor_t *c = arg;
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    size_t tam = cfg.lote ? LOTE_BUF_SIZE : (size_t)cfg.tamanho + 1;
+    char *buf = malloc(tam);
+    uint64_t agora;
+    ssize_t n;
+    size_t off;
+
+    pthread_barrier_wait(&largada);
+    if (!buf)
+        return NULL;
+    for (;;) {
+        if (poll(&pfd, 1, OCIOSO_MS) == 0) {
+            if (atomic_load(&produtores_ativos) == 0)
+                break;
+            continue;
+        }
+        n = read(c->fd, buf, tam);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            perror("Erro ao ler do dispositivo");
+            break;
+        }
+        agora = agora_ns();
+        if (!cfg.lote) {
+            registrar_recebida(c, buf, n, agora);
+            continue;
+        }
+        for (off = 0; off + sizeof(struct mq_frame) <= (size_t)n; ) {
+            struct mq_frame *quadro = (struct mq_frame *)(buf + off);
+            registrar_recebida(c, buf + off + sizeof(*quadro), quadro->len, agora);
+            off += MQ_FRAME_NEXT(quadro->len);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int comparar_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentil(const uint64_t *v, size_t n, double p) {
+    if (n == 0)
+        return 0;
+    return v[(size_t)(p * (n - 1))] / 1000.0;
+}
+
+// Mostra um parâmetro do módulo, se disponível
+static void mostrar_parametro(const char *nome) {
+    char caminho[128], valor[32];
+    FILE *f;
+
+    snprintf(caminho, sizeof(caminho), PARAMETROS "%s", nome);
+    f = fopen(caminho, "r");
+    if (!f)
+        return;
+    if (fgets(valor, sizeof(valor), f)) {
+        valor[strcspn(valor, "\n")] = '\0';
+        printf(" %s=%s", nome, valor);
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    produtor_t *produtores;
+    uint64_t enviadas = 0, falhas = 0, recebidas = 0, bytes = 0, esperadas, perdidas, fim = 0;
+    uint64_t *latencias;
+    size_t amostras = 0;
+    uint64_t inicio;
+    double duracao;
+    char nome[MQ_NAME_SIZE];
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "p:c:n:s:m:f:o:q:ibh")) != -1) {
+        switch (opt) {
+        case 'p': cfg.produtores = atoi(optarg); break;
+        case 'c': cfg.consumidores = atoi(optarg); break;
+        case 'n': cfg.mensagens = atoi(optarg); break;
+        case 's': cfg.tamanho = atoi(optarg); break;
+        case 'm': cfg.todos = strcmp(optarg, "all") == 0; break;
+        case 'f': cfg.fanout = atoi(optarg); break;
+        case 'o': cfg.politica = atoi(optarg); break;
+        case 'q': cfg.fila = atoi(optarg); break;
+        case 'i': cfg.binario = true; break;
+        case 'b': cfg.lote = true; break;
+        default: uso(argv[0]); return 1;
+        }
+    }
+    if (cfg.produtores < 1 || cfg.produtores > 999 || cfg.consumidores < 1 || cfg.consumidores > 999 ||
+        cfg.mensagens < 1 || cfg.tamanho < TS_DIGITOS || cfg.fanout < 1) {
+        uso(argv[0]);
+        return 1;
+    }
+    if (cfg.fanout > cfg.consumidores)
+        cfg.fanout = cfg.consumidores;
+
+    produtores = calloc(cfg.produtores, sizeof(produtor_t));
+    consumidores = calloc(cfg.consumidores, sizeof(consumidor_t));
+    if (!produtores || !consumidores) {
+        perror("calloc");
+        return 1;
+    }
+
+    // Todos os endpoints são registrados antes da largada, para que o /all alcance todos
+    for (i = 0; i < cfg.consumidores; i++) {
+        consumidor_t *c = &consumidores[i];
+
+        c->indice = i;
+        snprintf(c->nome, sizeof(c->nome), "c%hu", (unsigned short)i);
+        c->fd = abrir_endpoint(c->nome, O_NONBLOCK, &c->id);
+        if (c->fd < 0)
+            return 1;
+        if (cfg.politica >= 0 && ioctl(c->fd, MQ_IOC_SET_OVERFLOW, cfg.politica) < 0) {
+            perror("MQ_IOC_SET_OVERFLOW");
+            return 1;
+        }
+        if (cfg.fila > 0) {
+            struct mq_queue_args fila = { .bytes = cfg.fila };
+
+            if (ioctl(c->fd, MQ_IOC_SET_QUEUE, &fila) < 0) {
+                perror("MQ_IOC_SET_QUEUE");
+                return 1;
+            }
+        }
+        if (cfg.lote && ioctl(c->fd, MQ_IOC_SET_MODE, MQ_MODE_BATCH) < 0) {
+            perror("MQ_IOC_SET_MODE");
+            return 1;
+        }
+        // Um consumidor recebe no máximo uma cópia de cada mensagem enviada
+        c->capacidade = (size_t)cfg.produtores * cfg.mensagens;
+        if (c->capacidade > AMOSTRAS_MAX)
+            c->capacidade = AMOSTRAS_MAX;
+        c->latencias = malloc(c->capacidade * sizeof(uint64_t));
+        if (!c->latencias) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    for (i = 0; i < cfg.produtores; i++) {
+        produtores[i].indice = i;
+        snprintf(nome, sizeof(nome), "p%hu", (unsigned short)i);
+        produtores[i].fd = abrir_endpoint(nome, 0, NULL);
+        if (produtores[i].fd < 0)
+            return 1;
+        // Com /all os produtores também recebem: suas filas nunca bloqueiam os demais
+        ioctl(produtores[i].fd, MQ_IOC_SET_OVERFLOW, MQ_OVERFLOW_OVERWRITE);
+    }
+
+    atomic_store(&produtores_ativos, cfg.produtores);
+    pthread_barrier_init(&largada, NULL, cfg.produtores + cfg.consumidores + 1);
+    for (i = 0; i < cfg.consumidores; i++)
+        pthread_create(&consumidores[i].thread, NULL, consumir, &consumidores[i]);
+    for (i = 0; i < cfg.produtores; i++)
+        pthread_create(&produtores[i].thread, NULL, produzir, &produtores[i]);
+    inicio = agora_ns();
+    pthread_barrier_wait(&largada);
+
+    for (i = 0; i < cfg.produtores; i++) {
+        pthread_join(produtores[i].thread, NULL);
+        enviadas += produtores[i].enviadas;
+        falhas += produtores[i].falhas;
+    }
+    for (i = 0; i < cfg.consumidores; i++) {
+        pthread_join(consumidores[i].thread, NULL);
+        recebidas += consumidores[i].recebidas;
+        bytes += consumidores[i].bytes;
+        amostras += consumidores[i].amostras;
+        if (consumidores[i].ultima > fim)
+            fim = consumidores[i].ultima;
+    }
+
+    latencias = malloc((amostras ? amostras : 1) * sizeof(uint64_t));
+    if (!latencias) {
+        perror("malloc");
+        return 1;
+    }
+    amostras = 0;
+    for (i = 0; i < cfg.consumidores; i++) {
+        memcpy(latencias + amostras, consumidores[i].latencias, consumidores[i].amostras * sizeof(uint64_t));
+        amostras += consumidores[i].amostras;
+    }
+    qsort(latencias, amostras, sizeof(uint64_t), comparar_u64);
+
+    // Cada envio bem-sucedido deveria chegar a 1 consumidor (/msg) ou a todos (/all)
+    esperadas = cfg.todos ? enviadas * cfg.consumidores : enviadas;
+    perdidas = esperadas > recebidas ? esperadas - recebidas : 0;
+    duracao = fim > inicio ? (fim - inicio) / 1e9 : 0;
+
+    printf("modo=%s interface=%s produtores=%d consumidores=%d tamanho=%d fanout=%d",
+           cfg.todos ? "all" : "msg", cfg.binario ? "ioctl" : "texto", cfg.produtores,
+           cfg.consumidores, cfg.tamanho, cfg.todos ? cfg.consumidores : cfg.fanout);
+    if (cfg.fila > 0)
+        printf(" fila=%d", cfg.fila);
+    else
+        mostrar_parametro("QUEUE_BYTES");
+    mostrar_parametro("OVERFLOW_POLICY");
+    printf("%s\n", cfg.lote ? " leitura=lote" : "");
+    printf("enviadas      %llu (falhas %llu)\n", (unsigned long long)enviadas, (unsigned long long)falhas);
+    printf("recebidas     %llu de %llu esperadas\n", (unsigned long long)recebidas, (unsigned long long)esperadas);
+    printf("perdidas      %llu (%.3f%%)\n", (unsigned long long)perdidas,
+           esperadas ? 100.0 * perdidas / esperadas : 0.0);
+    printf("duração       %.3f s\n", duracao);
+    if (duracao > 0)
+        printf("vazão         %.0f msgs/s, %.2f MB/s\n", recebidas / duracao, bytes / duracao / 1e6);
+    printf("latência (us) p50 %.1f  p99 %.1f  p999 %.1f  max %.1f  (%zu amostras)\n",
+           percentil(latencias, amostras, 0.50), percentil(latencias, amostras, 0.99),
+           percentil(latencias, amostras, 0.999), percentil(latencias, amostras, 1.0), amostras);
+
+    for (i = 0; i < cfg.produtores; i++)
+        close(produtores[i].fd);
+    for (i = 0; i < cfg.consumidores; i++) {
+        close(consumidores[i].fd);
+        free(consumidores[i].latencias);
+    }
+    free(latencias);
+    free(produtores);
+    free(consumidores);
+    return 0;
+}
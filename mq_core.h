@@ -0,0 +1,912 @@
+/*
+ * Núcleo do /dev/mq: a fila de cada endpoint (anel de bytes com registros), o registro de
+ * endpoints (lista e índices por nome e por id) e o índice de assinaturas de tópicos.
+ *
+ * No kernel é incluído por mq_driver.c, que acrescenta políticas de fila cheia, espera,
+ * estatísticas e cópias de/para o usuário. Fora do kernel, mq_shim.h fornece locks,
+ * alocação e índices equivalentes, e o mesmo código roda nos microbenchmarks e testes de
+ * estresse de mq_core_bench.c, sem carregar o módulo.
+ */
+#ifndef MQ_CORE_H
+#define MQ_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/rhashtable.h>
+#include <linux/xarray.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#else
+#include "mq_shim.h"
+#endif
+
+#include "mq_ioctl.h"
+
+#define NAME_SIZE MQ_NAME_SIZE
+#define TOPICO_SIZE MQ_TOPIC_SIZE
+#define ASSINATURAS_MAX 64      // Tópicos assinados por endpoint
+
+// Registro de uma mensagem no anel de bytes da fila: cabeçalho seguido do payload, com o
+// total alinhado a 8 bytes (REGISTRO_TAMANHO). Um registro pode dar a volta no fim do anel,
+// mas flags, alinhado a 4 bytes, nunca é dividido.
+typedef struct registro {
+    u64 ts;                   // ktime_get_ns() da reserva (latência até a leitura)
+    u32 size;                 // Bytes de payload
+    u32 seq;                  // Número de sequência na faixa
+    u32 corr;                 // Id de correlação de uma chamada (MQ_IOC_CALL), senão 0
+    u32 flags;                // REGISTRO_*; gravado por último, com release (faixa_publicar)
+    char sender[NAME_SIZE];
+} registro_t;
+
+#define REGISTRO_PUBLICADO  0x1 // Cabeçalho e payload completos; sem ele o leitor espera
+#define REGISTRO_DESCARTADO 0x2 // A cópia do payload falhou; leitores o pulam
+#define REGISTRO_REFERENCIA 0x4 // O payload é um registro_referencia_t
+#define REGISTRO_TAMANHO(size) ALIGN(sizeof(registro_t) + (size), 8)
+
+// Payload de um registro REGISTRO_REFERENCIA: a mensagem está num buffer do módulo, com uma
+// referência deste registro, compartilhado entre as filas que a receberam (/all, /pub). size
+// é cobrado do limite da fila além do registro, como se o payload estivesse no anel.
+typedef struct registro_referencia {
+    void *payload;
+    u32 size;
+} registro_referencia_t;
+
+#define FILA_CONSUMIDOR 0       // Bit de message_queue_t.consumidor
+#define FILA_FAIXAS MQ_PRIO_LEVELS
+#define FAIXA_FRACAO 4          // Faixas acima da 0 têm 1/FAIXA_FRACAO dos bytes da fila
+
+// Faixa de prioridade: anel de bytes com registros registro_t, com vários remetentes e um
+// consumidor, sem lock. As posições são contadores livres de 32 bits (o índice no anel é
+// pos & mascara), com cauda <= lidos <= cabeca.
+// Um remetente reserva o registro avançando cabeca (e seq) por cmpxchg, copia o payload fora
+// de qualquer lock e o publica gravando as flags do cabeçalho com release. O consumidor só
+// lê registros publicados e zera o espaço que libera, então um registro reservado e ainda não
+// escrito sempre aparece sem REGISTRO_PUBLICADO. cauda e lidos só mudam nas mãos do dono do
+// bit FILA_CONSUMIDOR da fila: o leitor, ou quem descarta ou migra registros.
+typedef struct faixa {
+    char *dados;         // Anel de bytes (kvzalloc), tamanho potência de 2
+    u32 mascara;         // Tamanho do anel - 1
+
+    // Remetentes: (seq << 32) | cabeca, avançados juntos por cmpxchg
+    atomic64_t reserva ____cacheline_aligned_in_smp;
+
+    // Consumidor, em outra linha de cache
+    u32 cauda ____cacheline_aligned_in_smp; // Registro mais antigo ainda no anel
+    u32 lidos;           // Fim dos registros reservados pelo leitor ([cauda, lidos) em cópia)
+} faixa_t;
+
+// Fila de mensagens de um endpoint: uma faixa por prioridade (MQ_PRIO_*), com o total de
+// bytes de todas limitado a limite. O leitor sempre retira da faixa mais prioritária que
+// tem mensagem, achada pelo bitmap ativas; com a fila cheia, MQ_OVERFLOW_OVERWRITE descarta
+// primeiro das faixas menos prioritárias. Se o consumidor está ocupado, o remetente passa do
+// limite e conta o descarte em descartes_pendentes, que quem soltar o consumidor aplica.
+typedef struct message_queue {
+    struct mq_anel *anel; // Se não NULL, as mensagens vão para o anel compartilhado
+    struct message_queue *substituta; // Se não NULL, a fila está sendo (ou foi) trocada por esta
+    bool migrando;       // Uma migração (para anel ou substituta) copia as mensagens fora de cb->lock
+    struct kref ref;     // Do registro do endpoint e de cada cópia que pode dormir
+    struct rcu_head rcu; // Liberação adiada até o fim dos remetentes que a acharam por RCU
+    u32 limite;          // Bytes somados de todas as faixas (tamanho da faixa 0)
+
+    // Remetentes e consumidor
+    atomic_t ocupado ____cacheline_aligned_in_smp; // Bytes reservados e ainda não liberados
+    atomic_t descartes_pendentes[FILA_FAIXAS]; // Descartes adiados, pela faixa do remetente
+    unsigned long ativas;     // Bit p: a faixa p pode ter registros (só o consumidor o limpa)
+    unsigned long consumidor; // FILA_CONSUMIDOR: dono de cauda e lidos de todas as faixas
+
+    faixa_t faixas[FILA_FAIXAS];
+} message_queue_t;
+
+// Contadores de um endpoint, atualizados sem lock por remetentes e leitor (zerados a cada /reg)
+typedef struct stats_endpoint {
+    atomic64_t enfileiradas;
+    atomic64_t retiradas;
+    atomic64_t sobrescritas;
+    atomic64_t recusadas;
+    atomic64_t bloqueios;
+    atomic64_t bytes_enfileirados;
+    atomic64_t bytes_retirados;
+    atomic64_t esperas_ativas;         // Leituras que giraram antes de dormir (MQ_IOC_SET_BUSY_POLL)
+    atomic64_t esperas_ativas_sucesso; // Das quais a mensagem chegou sem dormir
+    atomic_t pico;            // Maior ocupação da fila em bytes (high-water mark)
+} stats_endpoint_t;
+//=================================================================================================
+typedef struct control_block {
+    struct mq_instancia *inst;        // Instância (minor) em que o descritor foi aberto
+    pid_t pid;                         // PID do processo que registrou o descritor
+    u32 id;                            // Identificador do endpoint (chave de inst->control_blocks.por_id)
+    char nome[NAME_SIZE];             // Nome do processo ou identificador (chave de .por_nome)
+    struct rhash_head no_nome;        // Nó na tabela hash por nome
+    message_queue_t *queue;           // Fila de mensagens (publicada por RCU); NULL se o descritor não está registrado
+    spinlock_t lock;                  // Serializa registro, remoção, política, descartes e o anel compartilhado
+    wait_queue_head_t leitores;       // Leitores bloqueados aguardando mensagem (read/poll)
+    wait_queue_head_t escritores;     // Remetentes aguardando espaço (MQ_OVERFLOW_BLOCK)
+    int politica;                     // Política de fila cheia (MQ_OVERFLOW_*), escrita sob lock
+    int prioridade;                   // Prioridade dos write() texto (MQ_IOC_SET_PRIO)
+    struct mutex leitura;             // Serializa leituras do anel compartilhado
+    bool modo_anel;                   // Fila em modo mmap (queue->anel ativo)
+    u32 modo;                         // Bits MQ_MODE_* do descritor (MQ_IOC_SET_MODE)
+    stats_endpoint_t stats;           // Contadores do endpoint
+    struct list_head no_lista;        // Nó na lista de registrados (percorrida sob RCU)
+    struct rcu_head rcu;              // Liberação adiada até o fim dos leitores RCU
+    struct kref ref;                  // Do descritor e de remetentes dormindo na fila cheia
+    struct list_head assinaturas;     // assinatura_t.no_endpoint, sob inst->topicos.lock
+    int n_assinaturas;                // Tamanho de assinaturas
+    struct chamada *chamada;          // Chamada (MQ_IOC_CALL) à espera de resposta, sob lock
+    struct list_head recebimentos;    // MQ_IOC_RECV do io_uring à espera de mensagem (recebimento_t), sob lock
+    wait_queue_head_t respostas;      // O chamador aguardando a resposta
+    u32 ultima_corr;                  // Último id de correlação usado pelo descritor
+    u32 espera_ativa_us;              // Orçamento de espera ativa das leituras (MQ_IOC_SET_BUSY_POLL)
+    u64 ultima_chegada;               // ts do último registro lido, sob leitura
+    u64 intervalo_medio;              // Média móvel do intervalo entre chegadas (ns), sob leitura
+    struct mutex configuracao;        // Serializa o registro e MQ_IOC_SET_QUEUE (que podem dormir)
+    u32 fila_bytes;                   // Tamanho pedido para a fila (MQ_IOC_SET_QUEUE), sob configuracao; 0: padrão da instância
+    u32 anel_slots;                   // Slots pedidos para o anel compartilhado; 0: padrão da instância
+} control_block_t;
+
+// Estrutura que representa o registro de control_blocks de uma instância: a lista é usada
+// para percorrer todos (/all) e os índices por nome e por id dão busca O(1) a /msg.
+// Leitores (envio, /all) percorrem lista e índices sob rcu_read_lock(), sem o lock do registro;
+// o lock só serializa inserção/remoção, e os control_blocks são liberados com kfree_rcu.
+typedef struct control_block_list {
+    struct list_head lista; // Lista de control_blocks registrados
+    int count;              // Número total de elementos na lista
+    int limite;             // Máximo de registrados (MAX_DEVICES no módulo)
+    struct rhashtable por_nome; // Índice por nome (redimensionável)
+    struct xarray por_id;   // Índice por id do endpoint (ids alocados no registro)
+    spinlock_t lock;        // Exclusão mútua para inserção/remoção de control_blocks
+} control_block_list_t;
+
+// O nome é guardado com zeros até NAME_SIZE, então pode ser usado como chave de tamanho fixo
+static const struct rhashtable_params params_por_nome = {
+    .key_len = NAME_SIZE,
+    .key_offset = offsetof(control_block_t, nome),
+    .head_offset = offsetof(control_block_t, no_nome),
+    .automatic_shrinking = true,
+};
+
+// Tópico de publish/subscribe: existe enquanto tiver assinantes e guarda a lista deles, de
+// modo que uma publicação só visita os endpoints interessados.
+typedef struct topico {
+    char nome[TOPICO_SIZE];           // Chave de topicos.por_nome da instância, completada com zeros
+    struct rhash_head no_nome;        // Nó na tabela hash por nome
+    struct list_head assinantes;      // assinatura_t.no_topico (percorrida sob RCU)
+    int count;                        // Número de assinantes
+    struct list_head no_lista;        // Nó na lista de tópicos (debugfs)
+    struct rcu_head rcu;
+} topico_t;
+
+// Assinatura de um endpoint a um tópico, ligada às listas dos dois
+typedef struct assinatura {
+    struct list_head no_topico;       // Nó em topico_t.assinantes
+    struct list_head no_endpoint;     // Nó em control_block_t.assinaturas
+    control_block_t *cb;
+    topico_t *topico;
+    struct rcu_head rcu;
+} assinatura_t;
+
+// Índice de tópicos. Publicações buscam o tópico e percorrem seus assinantes sob
+// rcu_read_lock(); o lock só serializa assinaturas e cancelamentos, e tópicos e assinaturas
+// são liberados com kfree_rcu.
+typedef struct tabela_topicos {
+    struct list_head lista; // Lista de tópicos com assinantes
+    int count;              // Número de tópicos
+    struct rhashtable por_nome; // Índice por nome do tópico
+    spinlock_t lock;        // Exclusão mútua para assinaturas e cancelamentos
+} tabela_topicos_t;
+
+static const struct rhashtable_params params_topicos = {
+    .key_len = TOPICO_SIZE,
+    .key_offset = offsetof(topico_t, nome),
+    .head_offset = offsetof(topico_t, no_nome),
+    .automatic_shrinking = true,
+};
+
+// Instância do /dev/mq (um minor): registro, tópicos, limite e padrões próprios. Endpoints
+// só enxergam os da própria instância, então aplicações em instâncias diferentes não
+// disputam locks nem o limite de registrados. Padrões e tetos do tamanho das filas podem
+// mudar a qualquer momento (sysfs) e são lidos com READ_ONCE.
+typedef struct mq_instancia {
+    control_block_list_t control_blocks;
+    tabela_topicos_t topicos;
+    u32 fila_bytes;         // Tamanho padrão das filas registradas (QUEUE_BYTES)
+    u32 fila_bytes_max;     // Maior fila que um endpoint pode pedir (QUEUE_BYTES_MAX)
+    u32 anel_slots;         // Slots padrão do anel compartilhado (QUEUE_LEN)
+    u32 anel_slots_max;     // Maior anel que um endpoint pode pedir
+    int politica;           // Política de fila cheia dos descritores abertos (OVERFLOW_POLICY)
+} mq_instancia_t;
+
+// Prepara inst vazia, com até limite registrados e filas de fila_bytes (também o teto, até
+// o chamador definir outro)
+static inline int iniciar_instancia(mq_instancia_t *inst, int limite, u32 fila_bytes, int politica) {
+    int ret;
+
+    INIT_LIST_HEAD(&inst->control_blocks.lista);
+    inst->control_blocks.count = 0;
+    inst->control_blocks.limite = limite;
+    spin_lock_init(&inst->control_blocks.lock);
+    INIT_LIST_HEAD(&inst->topicos.lista);
+    inst->topicos.count = 0;
+    spin_lock_init(&inst->topicos.lock);
+    inst->fila_bytes = fila_bytes;
+    inst->fila_bytes_max = fila_bytes;
+    inst->anel_slots = 0;
+    inst->anel_slots_max = 0;
+    inst->politica = politica;
+
+    ret = rhashtable_init(&inst->control_blocks.por_nome, &params_por_nome);
+    if (ret)
+        return ret;
+    ret = rhashtable_init(&inst->topicos.por_nome, &params_topicos);
+    if (ret) {
+        rhashtable_destroy(&inst->control_blocks.por_nome);
+        return ret;
+    }
+    xa_init_flags(&inst->control_blocks.por_id, XA_FLAGS_ALLOC1);
+    return 0;
+}
+
+// Libera os índices de inst, que já não tem registrados nem tópicos
+static inline void destruir_instancia(mq_instancia_t *inst) {
+    rhashtable_destroy(&inst->topicos.por_nome);
+    rhashtable_destroy(&inst->control_blocks.por_nome);
+    xa_destroy(&inst->control_blocks.por_id);
+}
+//=================================================================================================
+// Copia nome para dst, chave de tamanho fixo dos índices por nome: até tamanho - 1
+// caracteres, completados com zeros
+static inline void copiar_chave(char *dst, const char *nome, size_t tamanho) {
+    size_t i;
+
+    for (i = 0; i < tamanho - 1 && nome[i]; i++)
+        dst[i] = nome[i];
+    memset(dst + i, 0, tamanho - i);
+}
+
+// Função para buscar um control_block registrado em inst por nome (O(1) pela tabela hash).
+// Deve ser chamada dentro de rcu_read_lock(); o resultado vale até rcu_read_unlock().
+static inline control_block_t* buscar_control_block_por_nome(mq_instancia_t *inst, const char *nome) {
+    char chave[NAME_SIZE];
+
+    // A chave tem tamanho fixo: completa o nome com zeros como em control_block_t.nome
+    copiar_chave(chave, nome, NAME_SIZE);
+    return rhashtable_lookup(&inst->control_blocks.por_nome, chave, params_por_nome);
+}
+
+// Função para buscar um control_block registrado em inst pelo id do endpoint.
+// Deve ser chamada dentro de rcu_read_lock(); o resultado vale até rcu_read_unlock().
+static inline control_block_t* buscar_control_block_por_id(mq_instancia_t *inst, u32 id) {
+    return xa_load(&inst->control_blocks.por_id, id);
+}
+
+// Função para inserir um control_block no registro da sua instância, associando nome e fila.
+// Verifica sob o lock do registro se o descritor ou o nome já estão registrados e o limite de registrados.
+static inline int inserir_control_block(control_block_t *novo, pid_t pid, const char *nome, message_queue_t *fila) {
+    control_block_list_t *tabela = &novo->inst->control_blocks;
+    int ret;
+    spin_lock(&tabela->lock);
+    if (novo->queue) {
+        spin_unlock(&tabela->lock);
+        printk(KERN_WARNING "WRITE: descritor já registrado como \"%s\"\n", novo->nome);
+        return -EEXIST;
+    }
+    if (tabela->count >= tabela->limite) {
+        spin_unlock(&tabela->lock);
+        printk(KERN_WARNING "MAX_DEVICES atingido. Processo PID %d não registrado\n", pid);
+        return -ENOSPC;
+    }
+
+    // A inserção no índice por nome também detecta nome repetido
+    copiar_chave(novo->nome, nome, NAME_SIZE);
+    ret = rhashtable_lookup_insert_fast(&tabela->por_nome, &novo->no_nome, params_por_nome);
+    if (ret) {
+        spin_unlock(&tabela->lock);
+        if (ret == -EEXIST)
+            printk(KERN_WARNING "WRITE: nome \"%s\" já registrado\n", nome);
+        return ret;
+    }
+    ret = xa_alloc(&tabela->por_id, &novo->id, novo, xa_limit_32b, GFP_ATOMIC);
+    if (ret) {
+        rhashtable_remove_fast(&tabela->por_nome, &novo->no_nome, params_por_nome);
+        spin_unlock(&tabela->lock);
+        return ret;
+    }
+
+    spin_lock(&novo->lock);
+    novo->pid = pid;
+    memset(&novo->stats, 0, sizeof(novo->stats));
+    rcu_assign_pointer(novo->queue, fila);
+    spin_unlock(&novo->lock);
+
+    list_add_tail_rcu(&novo->no_lista, &tabela->lista);
+    tabela->count++;
+    spin_unlock(&tabela->lock);
+    return 0;
+}
+
+// Função para remover um control_block do registro da sua instância e de seus índices.
+// Deve ser chamada com cb->inst->control_blocks.lock adquirido.
+static inline void remover_control_block(control_block_t *cb) {
+    control_block_list_t *tabela = &cb->inst->control_blocks;
+
+    rhashtable_remove_fast(&tabela->por_nome, &cb->no_nome, params_por_nome);
+    xa_erase(&tabela->por_id, cb->id);
+    list_del_rcu(&cb->no_lista);
+    tabela->count--;
+}
+
+//=================================================================================================
+// Tópicos
+
+// Função para buscar um tópico com assinantes de inst pelo nome.
+// Deve ser chamada dentro de rcu_read_lock(); o resultado vale até rcu_read_unlock().
+static inline topico_t* buscar_topico(mq_instancia_t *inst, const char *nome) {
+    char chave[TOPICO_SIZE];
+
+    copiar_chave(chave, nome, TOPICO_SIZE);
+    return rhashtable_lookup(&inst->topicos.por_nome, chave, params_topicos);
+}
+
+// Assinatura de cb ao tópico t, ou NULL. Deve ser chamada com cb->inst->topicos.lock adquirido.
+static inline assinatura_t* buscar_assinatura(control_block_t *cb, topico_t *t) {
+    assinatura_t *a;
+
+    list_for_each_entry(a, &cb->assinaturas, no_endpoint)
+        if (a->topico == t)
+            return a;
+    return NULL;
+}
+
+// Inscreve cb, registrado, no tópico nome da sua instância, criando o tópico se for o
+// primeiro assinante.
+// *novo_topico e *nova são alocados pelo chamador fora do lock; os que forem usados passam
+// para o índice e são zerados, e os demais ficam para o chamador liberar.
+// Retorna -ENOENT se cb não está registrado, -EEXIST se já assina o tópico e -ENOSPC se
+// atingiu ASSINATURAS_MAX.
+static inline int assinar_topico(control_block_t *cb, const char *nome, topico_t **novo_topico, assinatura_t **nova) {
+    tabela_topicos_t *topicos = &cb->inst->topicos;
+    assinatura_t *a = *nova;
+    topico_t *t;
+    int ret;
+
+    spin_lock(&topicos->lock);
+    // remover_processo zera queue antes de cancelar as assinaturas: nenhuma sobra depois dele
+    if (!READ_ONCE(cb->queue)) {
+        spin_unlock(&topicos->lock);
+        return -ENOENT;
+    }
+    rcu_read_lock();
+    t = buscar_topico(cb->inst, nome);
+    rcu_read_unlock();
+    if (t && buscar_assinatura(cb, t)) {
+        spin_unlock(&topicos->lock);
+        return -EEXIST;
+    }
+    if (cb->n_assinaturas >= ASSINATURAS_MAX) {
+        spin_unlock(&topicos->lock);
+        return -ENOSPC;
+    }
+
+    if (!t) {
+        t = *novo_topico;
+        copiar_chave(t->nome, nome, TOPICO_SIZE);
+        INIT_LIST_HEAD(&t->assinantes);
+        t->count = 0;
+        ret = rhashtable_lookup_insert_fast(&topicos->por_nome, &t->no_nome, params_topicos);
+        if (ret) {
+            spin_unlock(&topicos->lock);
+            return ret;
+        }
+        list_add_tail_rcu(&t->no_lista, &topicos->lista);
+        topicos->count++;
+        *novo_topico = NULL;
+    }
+
+    a->cb = cb;
+    a->topico = t;
+    list_add_tail_rcu(&a->no_topico, &t->assinantes);
+    list_add_tail(&a->no_endpoint, &cb->assinaturas);
+    t->count++;
+    cb->n_assinaturas++;
+    *nova = NULL;
+    spin_unlock(&topicos->lock);
+    return 0;
+}
+
+// Desfaz a assinatura a e remove o tópico se ela era a última.
+// Deve ser chamada com o lock de tópicos da instância adquirido.
+static inline void remover_assinatura(assinatura_t *a) {
+    tabela_topicos_t *topicos = &a->cb->inst->topicos;
+    topico_t *t = a->topico;
+
+    list_del_rcu(&a->no_topico);
+    list_del(&a->no_endpoint);
+    a->cb->n_assinaturas--;
+    if (--t->count == 0) {
+        rhashtable_remove_fast(&topicos->por_nome, &t->no_nome, params_topicos);
+        list_del_rcu(&t->no_lista);
+        topicos->count--;
+        kfree_rcu(t, rcu);
+    }
+    kfree_rcu(a, rcu);
+}
+
+// Cancela a assinatura de cb ao tópico nome. Retorna -ENOENT se cb não o assina.
+static inline int cancelar_assinatura(control_block_t *cb, const char *nome) {
+    tabela_topicos_t *topicos = &cb->inst->topicos;
+    assinatura_t *a = NULL;
+    topico_t *t;
+
+    spin_lock(&topicos->lock);
+    rcu_read_lock();
+    t = buscar_topico(cb->inst, nome);
+    rcu_read_unlock();
+    if (t)
+        a = buscar_assinatura(cb, t);
+    if (!a) {
+        spin_unlock(&topicos->lock);
+        return -ENOENT;
+    }
+    remover_assinatura(a);
+    spin_unlock(&topicos->lock);
+    return 0;
+}
+
+// Cancela todas as assinaturas de cb (ao desregistrar ou fechar o descritor)
+static inline void cancelar_assinaturas(control_block_t *cb) {
+    tabela_topicos_t *topicos = &cb->inst->topicos;
+
+    spin_lock(&topicos->lock);
+    while (!list_empty(&cb->assinaturas))
+        remover_assinatura(list_first_entry(&cb->assinaturas, assinatura_t, no_endpoint));
+    spin_unlock(&topicos->lock);
+}
+
+//=================================================================================================
+// Fila
+
+// Libera os anéis das faixas de q (os que chegaram a ser alocados)
+static inline void fila_destruir(message_queue_t *q) {
+    int p;
+
+    for (p = 0; p < FILA_FAIXAS; p++)
+        kvfree(q->faixas[p].dados);
+}
+
+// Prepara q, já alocada, com faixas vazias: a faixa 0 com bytes (potência de 2) e as demais
+// com bytes / FAIXA_FRACAO, todas somando no máximo bytes ocupados. Retorna -ENOMEM se
+// algum anel não pôde ser alocado.
+static inline int fila_iniciar(message_queue_t *q, u32 bytes) {
+    faixa_t *f;
+    u32 tamanho;
+    int p;
+
+    memset(q->faixas, 0, sizeof(q->faixas));
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        f = &q->faixas[p];
+        tamanho = p == 0 ? bytes : bytes / FAIXA_FRACAO;
+        f->dados = kvzalloc(tamanho, GFP_KERNEL); // zerado: nenhum registro publicado
+        if (!f->dados) {
+            fila_destruir(q);
+            return -ENOMEM;
+        }
+        f->mascara = tamanho - 1;
+        atomic64_set(&f->reserva, 0);
+    }
+    q->limite = bytes;
+    q->anel = NULL;
+    q->substituta = NULL;
+    q->migrando = false;
+    atomic_set(&q->ocupado, 0);
+    for (p = 0; p < FILA_FAIXAS; p++)
+        atomic_set(&q->descartes_pendentes[p], 0);
+    q->ativas = 0;
+    q->consumidor = 0;
+    kref_init(&q->ref);
+    return 0;
+}
+
+static inline u32 faixa_cabeca(faixa_t *f) {
+    return (u32)atomic64_read(&f->reserva);
+}
+
+// Bytes reservados e ainda não liberados em q, somando as faixas. Sem lock, o valor pode já
+// estar superado. Só passa de q->limite com descartes pendentes (fila_reservar com exceder).
+static inline u32 fila_ocupado(message_queue_t *q) {
+    return atomic_read(&q->ocupado);
+}
+
+static inline u32 fila_livre(message_queue_t *q) {
+    u32 ocupado = fila_ocupado(q);
+
+    return ocupado < q->limite ? q->limite - ocupado : 0;
+}
+
+// Indica se algum remetente adiou um descarte em q (ver fila_reservar)
+static inline bool fila_descartes_pendentes(message_queue_t *q) {
+    int p;
+
+    for (p = 0; p < FILA_FAIXAS; p++)
+        if (atomic_read(&q->descartes_pendentes[p]))
+            return true;
+    return false;
+}
+
+// Maior payload que cabe na faixa prio de q vazia
+static inline size_t fila_max(message_queue_t *q, int prio) {
+    return q->faixas[prio].mascara + 1 - sizeof(registro_t);
+}
+
+// Cópias entre o anel de bytes de f, a partir de pos, e um buffer. Um trecho que passa do
+// fim do anel continua no início.
+static inline void faixa_ler(faixa_t *f, u32 pos, void *dst, size_t n) {
+    u32 ini = pos & f->mascara;
+    size_t parte = min_t(size_t, n, f->mascara + 1 - ini);
+
+    memcpy(dst, f->dados + ini, parte);
+    memcpy((char *)dst + parte, f->dados, n - parte);
+}
+
+static inline void faixa_escrever(faixa_t *f, u32 pos, const void *src, size_t n) {
+    u32 ini = pos & f->mascara;
+    size_t parte = min_t(size_t, n, f->mascara + 1 - ini);
+
+    memcpy(f->dados + ini, src, parte);
+    memcpy(f->dados, (const char *)src + parte, n - parte);
+}
+
+// Copia n bytes do anel de de, a partir de pos, para o anel de para, a partir de destino
+static inline void faixa_copiar(faixa_t *de, u32 pos, faixa_t *para, u32 destino, size_t n) {
+    u32 ini;
+    size_t parte;
+
+    while (n) {
+        ini = pos & de->mascara;
+        parte = min_t(size_t, n, de->mascara + 1 - ini);
+        faixa_escrever(para, destino, de->dados + ini, parte);
+        pos += parte;
+        destino += parte;
+        n -= parte;
+    }
+}
+
+static inline void faixa_zerar(faixa_t *f, u32 pos, size_t n) {
+    u32 ini = pos & f->mascara;
+    size_t parte = min_t(size_t, n, f->mascara + 1 - ini);
+
+    memset(f->dados + ini, 0, parte);
+    memset(f->dados, 0, n - parte);
+}
+
+// Flags do registro em pos, lidas e escritas atomicamente
+static inline u32* faixa_estado(faixa_t *f, u32 pos) {
+    return (u32 *)(f->dados + ((pos + offsetof(registro_t, flags)) & f->mascara));
+}
+
+// Reserva na faixa prio de q um registro para size bytes de payload e grava seu cabeçalho,
+// ainda não publicado. Sem lock: primeiro o espaço no limite da fila, depois cabeca da faixa
+// (e seq), ambos por cmpxchg. extra são bytes cobrados do limite além do registro (o payload
+// de um registro REGISTRO_REFERENCIA), e também precisam caber na faixa. Com exceder, o
+// limite da fila não vale, só o espaço da faixa: MQ_OVERFLOW_OVERWRITE com o consumidor
+// ocupado, e o chamador conta o descarte que deve em descartes_pendentes. Retorna -EMSGSIZE
+// se o registro não cabe na faixa, -ENOSPC se a fila está cheia ou -ENOBUFS se só a faixa
+// está (a política de fila cheia fica com o chamador); *pos recebe a posição do registro,
+// publicado depois com faixa_publicar.
+static inline int fila_reservar(message_queue_t *q, int prio, size_t size, u32 extra, bool exceder, const char *sender, u32 corr, u32 *pos) {
+    faixa_t *f = &q->faixas[prio];
+    u32 necessario = REGISTRO_TAMANHO(size);
+    int ocupado = atomic_read(&q->ocupado);
+    registro_t reg;
+    u64 r, novo;
+    u32 cauda;
+
+    if (necessario > f->mascara + 1 || REGISTRO_TAMANHO(extra) > f->mascara + 1)
+        return -EMSGSIZE;
+    do {
+        if (!exceder && (u32)ocupado + necessario + extra > q->limite)
+            return -ENOSPC;
+    } while (!atomic_try_cmpxchg(&q->ocupado, &ocupado, ocupado + necessario + extra));
+
+    do {
+        // cauda antes de cabeca, e com acquire: o espaço liberado já foi zerado
+        cauda = smp_load_acquire(&f->cauda);
+        r = atomic64_read(&f->reserva);
+        if (f->mascara + 1 - ((u32)r - cauda) < necessario) {
+            atomic_sub(necessario + extra, &q->ocupado);
+            return -ENOBUFS;
+        }
+        novo = (u64)((u32)(r >> 32) + 1) << 32 | (u32)((u32)r + necessario);
+    } while (atomic64_cmpxchg(&f->reserva, r, novo) != (s64)r);
+
+    // Depois do cmpxchg, totalmente ordenado: ou o leitor que limpa o bit enxerga a reserva,
+    // ou este remetente enxerga o bit limpo e o marca de novo (fila_escolher)
+    if (!test_bit(prio, &q->ativas))
+        set_bit(prio, &q->ativas);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ts = ktime_get_ns();
+    reg.size = size;
+    reg.seq = r >> 32;
+    reg.corr = corr;
+    memcpy(reg.sender, sender, NAME_SIZE);
+    *pos = (u32)r;
+    // As flags continuam zeradas: só faixa_publicar as escreve
+    faixa_escrever(f, *pos, &reg, offsetof(registro_t, flags));
+    faixa_escrever(f, *pos + offsetof(registro_t, sender), reg.sender, NAME_SIZE);
+    return 0;
+}
+
+// Publica o registro reservado em pos, com flags 0, REGISTRO_DESCARTADO ou REGISTRO_REFERENCIA
+// (um registro descartado nunca segura referência: quem o descarta devolve extra). O que o remetente
+// gravou antes fica visível a quem lê as flags com acquire (faixa_ler_registro).
+static inline void faixa_publicar(faixa_t *f, u32 pos, u32 flags) {
+    smp_store_release(faixa_estado(f, pos), REGISTRO_PUBLICADO | flags);
+}
+
+// Copia para reg o cabeçalho do registro em pos. Retorna false se ainda não foi publicado.
+static inline bool faixa_ler_registro(faixa_t *f, u32 pos, registro_t *reg) {
+    if (!(smp_load_acquire(faixa_estado(f, pos)) & REGISTRO_PUBLICADO))
+        return false;
+    faixa_ler(f, pos, reg, sizeof(*reg));
+    return true;
+}
+
+// Pega o lado do consumidor de q. O leitor pode segurá-lo durante cópias que dormem; os demais
+// (descarte e migração para o anel) só tentam, e desistem se ele estiver ocupado.
+static inline bool fila_tentar_consumir(message_queue_t *q) {
+    return !test_and_set_bit_lock(FILA_CONSUMIDOR, &q->consumidor);
+}
+
+static inline void fila_consumir(message_queue_t *q) {
+    while (!fila_tentar_consumir(q))
+        cpu_relax();
+}
+
+static inline void fila_soltar(message_queue_t *q) {
+    clear_bit_unlock(FILA_CONSUMIDOR, &q->consumidor);
+}
+
+// Devolve aos remetentes o espaço de [cauda, fim) da faixa prio, zerado antes. Só pelo dono
+// do consumidor.
+static inline void fila_liberar(message_queue_t *q, int prio, u32 fim) {
+    faixa_t *f = &q->faixas[prio];
+    u32 bytes = fim - f->cauda;
+
+    faixa_zerar(f, f->cauda, bytes);
+    WRITE_ONCE(f->lidos, fim);
+    smp_store_release(&f->cauda, fim);
+    // O espaço só volta ao limite da fila depois de voltar à faixa: quem o reservar no
+    // limite o encontra livre na faixa (fila_reservar)
+    smp_mb__before_atomic();
+    atomic_sub(bytes, &q->ocupado);
+}
+
+// Lê para ref a referência do registro reg, em pos na faixa f. Retorna false se reg não é
+// REGISTRO_REFERENCIA.
+static inline bool registro_referencia(faixa_t *f, u32 pos, const registro_t *reg, registro_referencia_t *ref) {
+    if (!(reg->flags & REGISTRO_REFERENCIA))
+        return false;
+    faixa_ler(f, pos + sizeof(registro_t), ref, sizeof(*ref));
+    return true;
+}
+
+// Bytes de payload da mensagem do registro reg, em pos na faixa f
+static inline u32 registro_size(faixa_t *f, u32 pos, const registro_t *reg) {
+    registro_referencia_t ref;
+
+    return registro_referencia(f, pos, reg, &ref) ? ref.size : reg->size;
+}
+
+// Descarta o registro mais antigo da faixa prio, copiando seu cabeçalho para reg e, se ele é
+// REGISTRO_REFERENCIA, a referência para ref (que o chamador solta; senão ref->payload fica
+// NULL). Um registro ainda não publicado não pode ser descartado: retorna false (também com
+// a faixa vazia). Só pelo dono do consumidor.
+static inline bool fila_descartar(message_queue_t *q, int prio, registro_t *reg, registro_referencia_t *ref) {
+    faixa_t *f = &q->faixas[prio];
+
+    ref->payload = NULL;
+    if (f->cauda == faixa_cabeca(f) || !faixa_ler_registro(f, f->cauda, reg))
+        return false;
+    registro_referencia(f, f->cauda, reg, ref);
+    fila_liberar(q, prio, f->cauda + REGISTRO_TAMANHO(reg->size));
+    if (ref->payload)
+        atomic_sub(ref->size, &q->ocupado);
+    return true;
+}
+
+// Libera os registros de cópias que falharam no início de cada faixa de q. Só pelo dono do
+// consumidor.
+static inline void fila_recolher(message_queue_t *q) {
+    registro_t reg;
+    faixa_t *f;
+    u32 pos, cabeca;
+    int p;
+
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        f = &q->faixas[p];
+        pos = f->cauda;
+        cabeca = faixa_cabeca(f);
+        while (pos != cabeca && faixa_ler_registro(f, pos, &reg) && (reg.flags & REGISTRO_DESCARTADO))
+            pos += REGISTRO_TAMANHO(reg.size);
+        if (pos != f->cauda)
+            fila_liberar(q, p, pos);
+    }
+}
+
+// Indica se há mensagem publicada em f depois das que o leitor já reservou. Não altera a
+// faixa e pode ser chamada por qualquer um: o consumidor pode liberar e os remetentes reusar
+// o espaço durante o percurso, que por isso é limitado a [cauda, cabeca) (a resposta então
+// é só uma dica, revalidada pelo leitor).
+static inline bool faixa_tem_mensagem(faixa_t *f) {
+    u32 cauda = smp_load_acquire(&f->cauda);
+    u32 pos = READ_ONCE(f->lidos);
+    u32 cabeca = faixa_cabeca(f);
+    registro_t reg;
+
+    while (pos - cauda < cabeca - cauda) {
+        if (!faixa_ler_registro(f, pos, &reg))
+            return false;
+        if (!(reg.flags & REGISTRO_DESCARTADO))
+            return true;
+        pos += REGISTRO_TAMANHO(reg.size);
+    }
+    return false;
+}
+
+// Indica se alguma faixa de q tem mensagem (ver faixa_tem_mensagem). Só visita as faixas
+// marcadas em ativas.
+static inline bool fila_tem_mensagem(message_queue_t *q) {
+    unsigned long ativas = READ_ONCE(q->ativas);
+    int p;
+
+    while (ativas) {
+        p = __fls(ativas);
+        if (faixa_tem_mensagem(&q->faixas[p]))
+            return true;
+        ativas &= ~(1UL << p);
+    }
+    return false;
+}
+
+// Devolve a faixa mais prioritária de q com um registro publicado em cauda (talvez só
+// descartado), ou -1. O bitmap ativas dá a candidata em O(1); faixas vazias têm o bit
+// limpo aqui, e uma faixa cujo primeiro registro ainda está sendo escrito cede a vez às
+// menos prioritárias. Só pelo dono do consumidor.
+static inline int fila_escolher(message_queue_t *q) {
+    unsigned long ativas = READ_ONCE(q->ativas);
+    registro_t reg;
+    faixa_t *f;
+    int p;
+
+    while (ativas) {
+        p = __fls(ativas);
+        ativas &= ~(1UL << p);
+        f = &q->faixas[p];
+        if (f->cauda == faixa_cabeca(f)) {
+            // Pareia com a barreira do cmpxchg em fila_reservar
+            clear_bit(p, &q->ativas);
+            smp_mb__after_atomic();
+            if (f->cauda == faixa_cabeca(f))
+                continue;
+            set_bit(p, &q->ativas);
+        }
+        if (faixa_ler_registro(f, f->cauda, &reg))
+            return p;
+    }
+    return -1;
+}
+
+// Reserva para leitura os registros publicados a partir da cauda da faixa prio: a primeira
+// mensagem ou, com quadros, também as seguintes cujos quadros (struct mq_frame + payload)
+// caibam em espaco, junto com os registros descartados entre elas. *fim recebe o fim da
+// reserva, que o leitor libera com fila_liberar depois de copiar. Só pelo dono do consumidor.
+// Retorna o número de mensagens reservadas (0 se só havia registros descartados).
+static inline int reservar_leitura(message_queue_t *q, int prio, size_t espaco, bool quadros, u32 *fim) {
+    faixa_t *f = &q->faixas[prio];
+    registro_t reg;
+    u32 pos = f->cauda, cabeca = faixa_cabeca(f);
+    int n = 0;
+
+    while (pos != cabeca && faixa_ler_registro(f, pos, &reg)) {
+        if (!(reg.flags & REGISTRO_DESCARTADO)) {
+            size_t quadro = MQ_FRAME_NEXT(registro_size(f, pos, &reg));
+
+            if (n > 0 && (!quadros || quadro > espaco))
+                break;
+            espaco -= min(quadro, espaco);
+            n++;
+        }
+        pos += REGISTRO_TAMANHO(reg.size);
+    }
+    WRITE_ONCE(f->lidos, pos);
+    *fim = pos;
+    return n;
+}
+
+// Indica se um registro de size bytes, mais extra cobrados do limite (ver fila_reservar),
+// cabe agora na faixa prio de q. Sem lock, é só uma dica (condição de espera de remetentes
+// bloqueados), revalidada por fila_reservar.
+static inline bool fila_cabe(message_queue_t *q, int prio, size_t size, u32 extra) {
+    faixa_t *f = &q->faixas[prio];
+    u32 necessario = REGISTRO_TAMANHO(size);
+    u32 cauda = smp_load_acquire(&f->cauda);
+
+    return fila_livre(q) >= necessario + extra && f->mascara + 1 - (faixa_cabeca(f) - cauda) >= necessario;
+}
+
+// Copia para nova, vazia, as mensagens ainda não retiradas de q, faixa a faixa, na mesma
+// ordem e com os mesmos cabeçalhos (seq e ts incluídos), e esvazia q; cada faixa de nova
+// continua a sequência da de q. Registros descartados ficam para trás, e as referências dos
+// registros REGISTRO_REFERENCIA passam para nova com eles. Só pelo dono do
+// consumidor de q, com os remetentes já avisados da troca (q->substituta): quem reservar
+// depois de cabeca ser lida aqui desiste do registro. Retorna -EAGAIN se um registro ainda
+// está sendo escrito, ou -ENOSPC se as mensagens de uma faixa não cabem na faixa de nova;
+// nos dois casos nada muda.
+static inline int fila_migrar(message_queue_t *q, message_queue_t *nova) {
+    u64 reserva[FILA_FAIXAS];
+    registro_referencia_t ref;
+    registro_t reg;
+    faixa_t *f, *g;
+    u32 pos, cabeca, destino, usado, total = 0;
+    int p;
+
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        f = &q->faixas[p];
+        reserva[p] = atomic64_read(&f->reserva);
+        cabeca = (u32)reserva[p];
+        usado = 0;
+        for (pos = f->cauda; pos != cabeca; pos += REGISTRO_TAMANHO(reg.size)) {
+            if (!faixa_ler_registro(f, pos, &reg))
+                return -EAGAIN;
+            if (reg.flags & REGISTRO_DESCARTADO)
+                continue;
+            usado += REGISTRO_TAMANHO(reg.size);
+            if (registro_referencia(f, pos, &reg, &ref))
+                total += ref.size;
+        }
+        if (usado > nova->faixas[p].mascara + 1)
+            return -ENOSPC;
+        total += usado;
+    }
+    if (total > nova->limite)
+        return -ENOSPC;
+
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        f = &q->faixas[p];
+        g = &nova->faixas[p];
+        cabeca = (u32)reserva[p];
+        destino = 0;
+        for (pos = f->cauda; pos != cabeca; pos += REGISTRO_TAMANHO(reg.size)) {
+            faixa_ler(f, pos, &reg, sizeof(reg));
+            if (reg.flags & REGISTRO_DESCARTADO)
+                continue;
+            faixa_copiar(f, pos, g, destino, REGISTRO_TAMANHO(reg.size));
+            destino += REGISTRO_TAMANHO(reg.size);
+        }
+        atomic64_set(&g->reserva, (reserva[p] & ~0xffffffffULL) | destino);
+        if (destino)
+            set_bit(p, &nova->ativas);
+        fila_liberar(q, p, cabeca);
+    }
+    atomic_set(&nova->ocupado, total);
+    return 0;
+}
+
+// Número de sequência para uma mensagem que não passa pelas faixas (modo mmap)
+static inline u32 fila_proxima_seq(message_queue_t *q) {
+    return (u32)(atomic64_fetch_add(1ULL << 32, &q->faixas[0].reserva) >> 32);
+}
+
+#endif // MQ_CORE_H
@@ -0,0 +1,560 @@
+// Microbenchmarks e teste de estresse do núcleo do /dev/mq (mq_core.h) em espaço do usuário:
+// o mesmo código da fila e do registro que roda no módulo, compilado sobre mq_shim.h.
+//
+//   fila       custo de enfileirar + retirar numa thread, por tamanho de mensagem
+//   busca      custo da busca por nome e por id conforme o número de endpoints
+//   tópicos    custo de achar os destinatários de uma publicação (busca do tópico e percurso
+//              dos assinantes) comparado ao percurso de todos os registrados feito por /all
+//   prioridades  custo de enfileirar e retirar uma mensagem urgente conforme quantas
+//              mensagens normais estão à frente dela na fila
+//   redimensionar  custo de migrar uma fila cheia para uma maior e de volta (MQ_IOC_SET_QUEUE),
+//              conferindo ordem, sequência e conteúdo das mensagens migradas
+//   contenção  T produtores e um consumidor na mesma fila; o consumidor confere ordem e
+//              conteúdo de cada mensagem (sai com status 1 se algo estiver errado). Com -l,
+//              os produtores se revezam no lock do endpoint, para comparar com o caminho sem lock
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "mq_core.h"
+
+#define PADRAO_BYTES 16384      // QUEUE_BYTES padrão do módulo
+#define ENDPOINTS_MAX 65536     // MAX_DEVICES_LIMITE do módulo
+#define VOLTAS_GIRANDO 128      // Tentativas com cpu_relax() antes de ceder a CPU
+
+static int OPERACOES = 1000000;
+static int THREADS = 4;
+static u32 FILA_BYTES = PADRAO_BYTES;
+static int TAMANHO = 64;        // Payload do teste de contenção
+static bool COM_LOCK = false;   // Enfileirar sob cb->lock (-l)
+
+static message_queue_t* fila_de(u32 bytes) {
+    message_queue_t *q = kmalloc(sizeof(message_queue_t), GFP_KERNEL);
+
+    if (!q || fila_iniciar(q, bytes)) {
+        fprintf(stderr, "Sem memória para a fila\n");
+        exit(1);
+    }
+    return q;
+}
+
+static message_queue_t* nova_fila(void) {
+    return fila_de(FILA_BYTES);
+}
+
+static void liberar_fila(message_queue_t *q) {
+    fila_destruir(q);
+    kfree(q);
+}
+
+// Como enfileirar_na_fila no módulo: reserva sem lock na faixa prio, copia o payload e
+// publica. Retorna -ENOSPC ou -ENOBUFS com a fila ou a faixa cheia.
+static int enfileirar(control_block_t *cb, int prio, const char *sender, const void *dados, size_t size) {
+    message_queue_t *q = cb->queue;
+    u32 pos;
+    int ret;
+
+    if (COM_LOCK)
+        spin_lock(&cb->lock);
+    ret = fila_reservar(q, prio, size, 0, false, sender, 0, &pos);
+    if (ret == 0) {
+        faixa_escrever(&q->faixas[prio], pos + sizeof(registro_t), dados, size);
+        faixa_publicar(&q->faixas[prio], pos, 0);
+    }
+    if (COM_LOCK)
+        spin_unlock(&cb->lock);
+    return ret;
+}
+
+// Como ler_fila no módulo: reserva a próxima mensagem da faixa mais prioritária, a copia e
+// libera seu espaço como dono do consumidor. Retorna os bytes copiados, ou -EAGAIN com a
+// fila vazia; *prio recebe a faixa. Nada aqui marca registros como descartados, então o
+// registro em cauda é sempre a mensagem reservada.
+static int retirar(control_block_t *cb, void *buf, size_t len, registro_t *reg, int *prio) {
+    message_queue_t *q = cb->queue;
+    faixa_t *f;
+    u32 pos, fim;
+    size_t n;
+    int p;
+
+    if (!fila_tem_mensagem(q))
+        return -EAGAIN;
+    fila_consumir(q);
+    p = fila_escolher(q);
+    if (p < 0) {
+        fila_soltar(q);
+        return -EAGAIN;
+    }
+    f = &q->faixas[p];
+    pos = f->cauda;
+    reservar_leitura(q, p, len, false, &fim);
+
+    faixa_ler(f, pos, reg, sizeof(*reg));
+    n = min_t(size_t, len, reg->size);
+    faixa_ler(f, pos + sizeof(registro_t), buf, n);
+
+    fila_liberar(q, p, fim);
+    fila_soltar(q);
+    if (prio)
+        *prio = p;
+    return n;
+}
+
+// Espera curta por fila cheia ou vazia: gira um pouco e depois cede a CPU, para que o outro
+// lado avance mesmo com menos CPUs que threads (onde o módulo dormiria na wait queue)
+static void esperar_vez(int *voltas) {
+    if (++*voltas < VOLTAS_GIRANDO) {
+        cpu_relax();
+        return;
+    }
+    *voltas = 0;
+    sched_yield();
+}
+
+static mq_instancia_t instancia;
+
+static control_block_t* novo_endpoint(const char *nome) {
+    control_block_t *cb = kzalloc(sizeof(control_block_t), GFP_KERNEL);
+
+    if (!cb) {
+        fprintf(stderr, "Sem memória para o endpoint\n");
+        exit(1);
+    }
+    cb->inst = &instancia;
+    spin_lock_init(&cb->lock);
+    INIT_LIST_HEAD(&cb->assinaturas);
+    snprintf(cb->nome, NAME_SIZE, "%s", nome);
+    return cb;
+}
+
+//=================================================================================================
+// fila: enfileirar + retirar alternados, e em rajadas que enchem a fila e a esvaziam
+
+static void teste_fila(void) {
+    static const int tamanhos[] = { 16, 64, 256, 1024, 4096 };
+    control_block_t *cb = novo_endpoint("fila");
+    char *buf = malloc(4096);
+    registro_t reg;
+    u64 ini, alternado, rajada;
+    int t, i, n;
+
+    cb->queue = nova_fila();
+    memset(buf, 'x', 4096);
+    printf("fila (%u bytes)\n  %-8s %14s %14s\n", FILA_BYTES, "tamanho", "alternado ns", "rajada ns");
+    for (t = 0; t < (int)(sizeof(tamanhos) / sizeof(tamanhos[0])); t++) {
+        if (REGISTRO_TAMANHO(tamanhos[t]) > FILA_BYTES)
+            break;
+
+        ini = ktime_get_ns();
+        for (i = 0; i < OPERACOES; i++) {
+            enfileirar(cb, 0, cb->nome, buf, tamanhos[t]);
+            retirar(cb, buf, 4096, &reg, NULL);
+        }
+        alternado = ktime_get_ns() - ini;
+
+        ini = ktime_get_ns();
+        for (i = 0; i < OPERACOES; ) {
+            for (n = 0; i < OPERACOES && enfileirar(cb, 0, cb->nome, buf, tamanhos[t]) == 0; n++, i++)
+                ;
+            while (n-- > 0)
+                retirar(cb, buf, 4096, &reg, NULL);
+        }
+        rajada = ktime_get_ns() - ini;
+
+        printf("  %-8d %14.1f %14.1f\n", tamanhos[t], (double)alternado / OPERACOES, (double)rajada / OPERACOES);
+    }
+    liberar_fila(cb->queue);
+    kfree(cb);
+    free(buf);
+}
+
+//=================================================================================================
+// busca: registra N endpoints e mede buscas aleatórias por nome e por id
+
+static void teste_busca(void) {
+    control_block_t **cbs = calloc(ENDPOINTS_MAX, sizeof(control_block_t *));
+    message_queue_t *fila = nova_fila(); // compartilhada: a busca não toca a fila
+    char nome[NAME_SIZE];
+    volatile control_block_t *achado;
+    u64 ini, por_nome, por_id;
+    int n, i, k;
+
+    printf("busca\n  %-10s %12s %12s\n", "endpoints", "nome ns", "id ns");
+    for (n = 16; n <= ENDPOINTS_MAX; n *= 4) {
+        for (i = 0; i < n; i++) {
+            snprintf(nome, sizeof(nome), "e%hu", (unsigned short)i);
+            cbs[i] = novo_endpoint(nome);
+            if (inserir_control_block(cbs[i], i, nome, fila)) {
+                fprintf(stderr, "Falha ao registrar \"%s\"\n", nome);
+                exit(1);
+            }
+        }
+
+        srand(n);
+        ini = ktime_get_ns();
+        for (i = 0; i < OPERACOES; i++) {
+            k = rand() % n;
+            achado = buscar_control_block_por_nome(&instancia, cbs[k]->nome);
+        }
+        por_nome = ktime_get_ns() - ini;
+
+        srand(n);
+        ini = ktime_get_ns();
+        for (i = 0; i < OPERACOES; i++) {
+            k = rand() % n;
+            achado = buscar_control_block_por_id(&instancia, cbs[k]->id);
+        }
+        por_id = ktime_get_ns() - ini;
+        (void)achado;
+
+        printf("  %-10d %12.1f %12.1f\n", n, (double)por_nome / OPERACOES, (double)por_id / OPERACOES);
+
+        spin_lock(&instancia.control_blocks.lock);
+        for (i = 0; i < n; i++)
+            remover_control_block(cbs[i]);
+        spin_unlock(&instancia.control_blocks.lock);
+        for (i = 0; i < n; i++)
+            kfree(cbs[i]);
+    }
+    liberar_fila(fila);
+    free(cbs);
+}
+
+//=================================================================================================
+// tópicos: N registrados, dos quais S assinam o tópico; mede o percurso de uma publicação
+
+#define TOPICOS_REGISTRADOS 4096
+
+static void teste_topicos(void) {
+    control_block_t **cbs = calloc(TOPICOS_REGISTRADOS, sizeof(control_block_t *));
+    message_queue_t *fila = nova_fila(); // compartilhada: o percurso não toca a fila
+    char nome[NAME_SIZE];
+    control_block_t *curr;
+    topico_t *t, *novo_topico;
+    assinatura_t *a, *nova;
+    u64 ini, todos, assinantes, visitados;
+    int s, i, k;
+
+    for (i = 0; i < TOPICOS_REGISTRADOS; i++) {
+        snprintf(nome, sizeof(nome), "t%d", i);
+        cbs[i] = novo_endpoint(nome);
+        if (inserir_control_block(cbs[i], i, nome, fila)) {
+            fprintf(stderr, "Falha ao registrar \"%s\"\n", nome);
+            exit(1);
+        }
+    }
+
+    printf("tópicos (%d registrados)\n  %-10s %12s %12s\n", TOPICOS_REGISTRADOS, "assinantes", "/all ns", "/pub ns");
+    for (s = 1; s <= TOPICOS_REGISTRADOS; s *= 16) {
+        for (i = 0; i < s; i++) {
+            novo_topico = kmalloc(sizeof(topico_t), GFP_KERNEL);
+            nova = kmalloc(sizeof(assinatura_t), GFP_KERNEL);
+            if (assinar_topico(cbs[i * (TOPICOS_REGISTRADOS / s)], "bench", &novo_topico, &nova)) {
+                fprintf(stderr, "Falha ao assinar o tópico\n");
+                exit(1);
+            }
+            kfree(novo_topico);
+            kfree(nova);
+        }
+
+        visitados = 0;
+        ini = ktime_get_ns();
+        for (k = 0; k < OPERACOES / 64; k++)
+            list_for_each_entry_rcu(curr, &instancia.control_blocks.lista, no_lista)
+                visitados += READ_ONCE(curr->queue) != NULL;
+        todos = ktime_get_ns() - ini;
+
+        ini = ktime_get_ns();
+        for (k = 0; k < OPERACOES / 64; k++) {
+            t = buscar_topico(&instancia, "bench");
+            list_for_each_entry_rcu(a, &t->assinantes, no_topico)
+                visitados += READ_ONCE(a->cb->queue) != NULL;
+        }
+        assinantes = ktime_get_ns() - ini;
+
+        printf("  %-10d %12.1f %12.1f\n", s, (double)todos / (OPERACOES / 64),
+               (double)assinantes / (OPERACOES / 64));
+        for (i = 0; i < s; i++)
+            cancelar_assinaturas(cbs[i * (TOPICOS_REGISTRADOS / s)]);
+        if (visitados == 0)
+            printf("  (nenhum destinatário)\n");
+    }
+
+    spin_lock(&instancia.control_blocks.lock);
+    for (i = 0; i < TOPICOS_REGISTRADOS; i++)
+        remover_control_block(cbs[i]);
+    spin_unlock(&instancia.control_blocks.lock);
+    for (i = 0; i < TOPICOS_REGISTRADOS; i++)
+        kfree(cbs[i]);
+    liberar_fila(fila);
+    free(cbs);
+}
+
+//=================================================================================================
+// prioridades: com N mensagens normais na faixa 0, mede enfileirar + retirar uma urgente
+// (faixa MQ_PRIO_LEVELS - 1), que deve sair antes de todas as normais
+
+static int teste_prioridades(void) {
+    static const int enfileiradas[] = { 0, 16, 64, 128 };
+    control_block_t *cb = novo_endpoint("prio");
+    char buf[64];
+    registro_t reg;
+    u64 ini, urgente;
+    int t, i, n, prio, erros = 0;
+
+    cb->queue = nova_fila();
+    memset(buf, 'x', sizeof(buf));
+    printf("prioridades (%u bytes, mensagens de %zu bytes)\n  %-12s %12s\n", FILA_BYTES, sizeof(buf), "à frente", "urgente ns");
+    for (t = 0; t < (int)(sizeof(enfileiradas) / sizeof(enfileiradas[0])); t++) {
+        for (n = 0; n < enfileiradas[t] && enfileirar(cb, 0, cb->nome, buf, sizeof(buf)) == 0; n++)
+            ;
+        // A faixa urgente precisa de espaço no orçamento comum da fila
+        if (n > 0 && fila_livre(cb->queue) < REGISTRO_TAMANHO(sizeof(buf))) {
+            retirar(cb, buf, sizeof(buf), &reg, NULL);
+            n--;
+        }
+
+        ini = ktime_get_ns();
+        for (i = 0; i < OPERACOES; i++) {
+            enfileirar(cb, MQ_PRIO_LEVELS - 1, cb->nome, buf, sizeof(buf));
+            if (retirar(cb, buf, sizeof(buf), &reg, &prio) < 0 || prio != MQ_PRIO_LEVELS - 1)
+                erros++;
+        }
+        urgente = ktime_get_ns() - ini;
+
+        printf("  %-12d %12.1f\n", n, (double)urgente / OPERACOES);
+        while (n-- > 0)
+            if (retirar(cb, buf, sizeof(buf), &reg, &prio) < 0 || prio != 0)
+                erros++;
+    }
+    if (erros)
+        printf("  ERRO: %d mensagens urgentes fora de ordem\n", erros);
+    liberar_fila(cb->queue);
+    kfree(cb);
+    return erros != 0;
+}
+
+//=================================================================================================
+// redimensionar: enche as faixas de uma fila (com o anel já dando a volta), migra para uma
+// com o dobro e de volta, e confere que as mensagens saem na ordem, com a sequência e o
+// conteúdo originais. Encolher abaixo do ocupado deve falhar sem mudar nada.
+
+// Troca a fila de cb por uma de bytes, como redimensionar_fila no módulo
+static int trocar_fila(control_block_t *cb, u32 bytes) {
+    message_queue_t *q = cb->queue, *nova = fila_de(bytes);
+    int ret;
+
+    fila_consumir(q);
+    WRITE_ONCE(q->substituta, nova);
+    smp_mb();
+    ret = fila_migrar(q, nova);
+    if (ret)
+        WRITE_ONCE(q->substituta, NULL);
+    fila_soltar(q);
+    if (ret) {
+        liberar_fila(nova);
+        return ret;
+    }
+    cb->queue = nova;
+    liberar_fila(q);
+    return 0;
+}
+
+static int teste_redimensionar(void) {
+    control_block_t *cb = novo_endpoint("redim");
+    u32 enviadas[MQ_PRIO_LEVELS] = { 0 }, lidas[MQ_PRIO_LEVELS] = { 0 };
+    char buf[64], esperado[64];
+    registro_t reg;
+    u64 ini, migracao = 0;
+    int i, p, prio, voltas, erros = 0;
+
+    cb->queue = nova_fila();
+    voltas = OPERACOES / 1000 > 0 ? OPERACOES / 1000 : 1;
+    printf("redimensionar (%u <-> %u bytes, mensagens de %zu bytes)\n", FILA_BYTES, 2 * FILA_BYTES, sizeof(buf));
+    for (i = 0; i < voltas; i++) {
+        // Posições diferentes a cada volta: os registros dão a volta no fim do anel
+        for (p = 0; p < MQ_PRIO_LEVELS; p++) {
+            while (true) {
+                memset(buf, 'a' + (enviadas[p] + p) % 26, sizeof(buf));
+                if (enfileirar(cb, p, cb->nome, buf, sizeof(buf)) != 0)
+                    break;
+                enviadas[p]++;
+            }
+        }
+        if (trocar_fila(cb, FILA_BYTES / 2) != -ENOSPC)
+            erros++;
+
+        ini = ktime_get_ns();
+        if (trocar_fila(cb, 2 * FILA_BYTES) || trocar_fila(cb, FILA_BYTES))
+            erros++;
+        migracao += ktime_get_ns() - ini;
+
+        // Só metade sai: o resto é migrado de novo na volta seguinte
+        while (fila_ocupado(cb->queue) > cb->queue->limite / 2 && retirar(cb, buf, sizeof(buf), &reg, &prio) > 0) {
+            memset(esperado, 'a' + (lidas[prio] + prio) % 26, sizeof(esperado));
+            if (reg.seq != lidas[prio] || memcmp(buf, esperado, sizeof(buf)) != 0)
+                erros++;
+            lidas[prio]++;
+        }
+    }
+    while (retirar(cb, buf, sizeof(buf), &reg, &prio) > 0) {
+        if (reg.seq != lidas[prio])
+            erros++;
+        lidas[prio]++;
+    }
+    for (p = 0; p < MQ_PRIO_LEVELS; p++)
+        if (lidas[p] != enviadas[p])
+            erros++;
+
+    printf("  %-12s %12.1f\n", "migração ns", (double)migracao / (2 * voltas));
+    if (erros)
+        printf("  ERRO: %d mensagens perdidas, fora de ordem ou alteradas na migração\n", erros);
+    liberar_fila(cb->queue);
+    kfree(cb);
+    return erros != 0;
+}
+
+//=================================================================================================
+// contenção: T produtores numa fila, um consumidor que confere cada mensagem
+
+typedef struct conteudo {
+    u32 produtor;
+    u32 reservado;
+    u64 numero;     // Sequência do produtor
+    // Bytes seguintes: (numero + i) & 0xff
+} conteudo_t;
+
+typedef struct produtor {
+    pthread_t thread;
+    control_block_t *destino;
+    u32 indice;
+    int mensagens;
+} produtor_t;
+
+static void preencher(char *buf, u32 produtor, u64 numero) {
+    conteudo_t *c = (conteudo_t *)buf;
+    int i;
+
+    c->produtor = produtor;
+    c->reservado = 0;
+    c->numero = numero;
+    for (i = sizeof(conteudo_t); i < TAMANHO; i++)
+        buf[i] = (numero + i) & 0xff;
+}
+
+static void* produzir(void *arg) {
+    produtor_t *p = arg;
+    char *buf = malloc(TAMANHO);
+    char nome[NAME_SIZE];
+    int voltas = 0;
+    u64 i;
+
+    snprintf(nome, sizeof(nome), "p%u", p->indice);
+    for (i = 0; i < (u64)p->mensagens; i++) {
+        preencher(buf, p->indice, i);
+        // Fila cheia: espera como um remetente sob MQ_OVERFLOW_BLOCK
+        while (enfileirar(p->destino, 0, nome, buf, TAMANHO) < 0)
+            esperar_vez(&voltas);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Confere uma mensagem recebida contra a próxima esperada do seu produtor
+static int conferir(const char *buf, int n, const registro_t *reg, u64 *proximo, int produtores) {
+    const conteudo_t *c = (const conteudo_t *)buf;
+    int i;
+
+    if (n != TAMANHO || reg->size != (u32)TAMANHO || c->produtor >= (u32)produtores)
+        return 1;
+    if (c->numero != proximo[c->produtor]++)
+        return 1;
+    for (i = sizeof(conteudo_t); i < TAMANHO; i++)
+        if ((u8)buf[i] != ((c->numero + i) & 0xff))
+            return 1;
+    return 0;
+}
+
+static int teste_contencao(void) {
+    control_block_t *cb = novo_endpoint("destino");
+    produtor_t *produtores = calloc(THREADS, sizeof(produtor_t));
+    u64 *proximo = calloc(THREADS, sizeof(u64));
+    char *buf = malloc(TAMANHO);
+    registro_t reg;
+    u64 ini, total, recebidas, erros_total = 0;
+    double s;
+    int t, i, n, erros, voltas = 0;
+
+    cb->queue = nova_fila();
+    printf("contenção (%d bytes, %u bytes de fila, %s)\n  %-10s %14s %10s %8s\n", TAMANHO, FILA_BYTES,
+           COM_LOCK ? "com lock" : "sem lock", "produtores", "msgs/s", "MB/s", "erros");
+    // 1, 2, 4... produtores, terminando exatamente em THREADS
+    for (t = 1; t <= THREADS; t = (t < THREADS && t * 2 > THREADS) ? THREADS : t * 2) {
+        total = (u64)(OPERACOES / t) * t;
+        memset(proximo, 0, THREADS * sizeof(u64));
+        erros = 0;
+
+        ini = ktime_get_ns();
+        for (i = 0; i < t; i++) {
+            produtores[i].destino = cb;
+            produtores[i].indice = i;
+            produtores[i].mensagens = OPERACOES / t;
+            pthread_create(&produtores[i].thread, NULL, produzir, &produtores[i]);
+        }
+        for (recebidas = 0; recebidas < total; ) {
+            n = retirar(cb, buf, TAMANHO, &reg, NULL);
+            if (n == -EAGAIN) {
+                esperar_vez(&voltas);
+                continue;
+            }
+            erros += conferir(buf, n, &reg, proximo, t);
+            recebidas++;
+        }
+        for (i = 0; i < t; i++)
+            pthread_join(produtores[i].thread, NULL);
+        s = (ktime_get_ns() - ini) / 1e9;
+
+        printf("  %-10d %14.0f %10.1f %8d\n", t, total / s, total * TAMANHO / s / 1e6, erros);
+        erros_total += erros;
+    }
+    liberar_fila(cb->queue);
+    kfree(cb);
+    free(produtores);
+    free(proximo);
+    free(buf);
+    return erros_total != 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    THREADS = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) - 1 : 1;
+    while ((opt = getopt(argc, argv, "n:t:b:s:lh")) != -1) {
+        switch (opt) {
+        case 'n': OPERACOES = atoi(optarg); break;
+        case 't': THREADS = atoi(optarg); break;
+        case 'b': FILA_BYTES = strtoul(optarg, NULL, 0); break;
+        case 's': TAMANHO = atoi(optarg); break;
+        case 'l': COM_LOCK = true; break;
+        default:
+            fprintf(stderr, "Uso: %s [-n operações] [-t produtores] [-b bytes da fila] [-s tamanho] [-l]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (OPERACOES < 1 || THREADS < 1 || FILA_BYTES < 1024 || (FILA_BYTES & (FILA_BYTES - 1)) ||
+        TAMANHO < (int)sizeof(conteudo_t) || REGISTRO_TAMANHO(TAMANHO) > FILA_BYTES) {
+        fprintf(stderr, "Parâmetros inválidos (fila: potência de 2 >= 1024; tamanho >= %zu)\n", sizeof(conteudo_t));
+        return 1;
+    }
+
+    if (iniciar_instancia(&instancia, ENDPOINTS_MAX, FILA_BYTES, MQ_OVERFLOW_OVERWRITE))
+        return 1;
+
+    teste_fila();
+    teste_busca();
+    teste_topicos();
+    if (teste_prioridades() || teste_redimensionar())
+        return 1;
+    return teste_contencao();
+}
@@ -8,90 +8,247 @@
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
 #include <linux/moduleparam.h>
 #include <linux/string.h>
 #include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/rhashtable.h>
+#include <linux/xarray.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/io_uring.h>
+
+#include "mq_ioctl.h"
+#include "mq_core.h"
+#define CREATE_TRACE_POINTS
+#include "mq_trace.h"
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Bruno/Thiago/Emanuel");
-MODULE_DESCRIPTION("Driver de mensageria simples com comandos /reg, /unr, /msg, /all");
+MODULE_DESCRIPTION("Driver de mensageria simples com comandos /reg, /unr, /msg, /all, /sub, /uns, /pub");
 MODULE_VERSION("0.1.0");
 
-#define NAME_SIZE 9
+#define RETIRAR_ANEL 1   // esperar_fila: a fila está em modo mmap
+#define RETIRAR_SUBSTITUIDA 2 // esperar_fila: a fila foi trocada por outra (MQ_IOC_SET_QUEUE)
+#define ENFILEIRAR_ANEL 1 // reservar_registro, enfileirar_do_usuario: a fila está em modo mmap
+#define ENFILEIRAR_SUBSTITUIDA 2 // reservar_registro: a fila está sendo trocada por outra
+#define ENFILEIRAR_DESCARTADA 3 // reservar_registro: sobrescrita, a própria mensagem foi descartada
+#define MSG_INLINE_SIZE 64 // Payloads até este tamanho não alocam memória
+#define CMD_CABECALHO 48   // Comando e destino (ou tópico) de um write texto; o payload não passa pela pilha
+#define QUEUE_BYTES_LIMITE (64 << 20) // Teto aceito para os parâmetros QUEUE_BYTES e QUEUE_BYTES_MAX
+#define FILA_BYTES_MIN 1024 // Menor fila de um endpoint
+#define ANEL_SLOTS_MIN 2   // Menor anel compartilhado de um endpoint
+#define ANEL_SLOTS_LIMITE 4096 // Teto aceito para QUEUE_LEN e para os slots pedidos por um endpoint
+#define REDIMENSIONAR_TENTATIVAS 20 // Tentativas de trocar uma fila com leituras ou cópias em andamento
+#define LOTE_MAX 16        // Comandos de MQ_IOC_SEND_BATCH copiados do usuário por trecho
+#define LATENCIA_FAIXAS 32 // Faixas log2 (ns) do histograma de latência; a última acumula o resto
 
 #define DEVICE_NAME "mq"
+#define MAX_DEVICES_LIMITE 65536   // Teto aceito para o parâmetro MAX_DEVICES
+#define INSTANCES_LIMITE 64        // Teto aceito para o parâmetro INSTANCES
 #define CLASS_NAME  "mq_class"
 
 static int majorNumber;
-static int MAX_DEVICES = 8;
-static int QUEUE_LEN = 8;
+static int INSTANCES = 1;          // Minors: /dev/mq, ou /dev/mq0 a /dev/mqN-1 se mais de um
+// MAX_DEVICES, QUEUE_BYTES, QUEUE_BYTES_MAX e OVERFLOW_POLICY aceitam um valor por instância
+// (separados por vírgula); instâncias além dos valores dados usam o último deles. Os padrões
+// e tetos das filas podem ser mudados depois no sysfs de cada dispositivo.
+static int MAX_DEVICES[INSTANCES_LIMITE] = { 8 };
+static int n_max_devices = 1;
+static int QUEUE_LEN = 8;          // Slots padrão do anel compartilhado (modo mmap)
+static int QUEUE_BYTES[INSTANCES_LIMITE] = { 16384 }; // Bytes padrão do anel de cada fila (potência de 2)
+static int n_queue_bytes = 1;
+static int QUEUE_BYTES_MAX[INSTANCES_LIMITE] = { 1 << 20 }; // Maior fila que um endpoint pode pedir (MQ_IOC_SET_QUEUE)
+static int n_queue_bytes_max = 1;
 static int CMD_BUF_SIZE = 256;
+static int OVERFLOW_POLICY[INSTANCES_LIMITE] = { MQ_OVERFLOW_OVERWRITE }; // Política padrão de fila cheia (MQ_OVERFLOW_*)
+static int n_overflow_policy = 1;
+static int BUSY_POLL_US = 0;       // Espera ativa padrão das leituras, em µs (MQ_IOC_SET_BUSY_POLL)
 static struct class* charClass = NULL;
-static struct device* charDevice = NULL;
+static mq_instancia_t *instancias; // Uma por minor, com registro e tópicos próprios
 
-module_param(MAX_DEVICES, int, 0);
+module_param(INSTANCES, int, 0);
+module_param_array(MAX_DEVICES, int, &n_max_devices, 0);
 module_param(QUEUE_LEN, int, 0);
+module_param_array(QUEUE_BYTES, int, &n_queue_bytes, 0);
+module_param_array(QUEUE_BYTES_MAX, int, &n_queue_bytes_max, 0);
 module_param(CMD_BUF_SIZE, int, 0);
+module_param_array(OVERFLOW_POLICY, int, &n_overflow_policy, 0);
+module_param(BUSY_POLL_US, int, 0);
 //=================================================================================================
-typedef enum { EMPTY, FULL, LIMBO } state_t;
-
+// Mensagem montada no kernel antes de ser copiada para as filas (/all, lotes, modo mmap).
+// Payloads de até MSG_INLINE_SIZE bytes ficam na própria estrutura (buf == NULL); os até
+// CMD_BUF_SIZE bytes vêm de cache_payload e os maiores de kvmalloc, num
+// payload_compartilhado_t que as filas referenciam em vez de copiar. Acesse com payload().
 typedef struct message {
     size_t size;
-    char *data;    // alocado dinamicamente com a mensagem
-    char *sender;  // idem (se desejar guardar sender individualmente)
+    char *buf;                         // payload alocado, ou NULL se o payload é inline
+    char sender[NAME_SIZE];            // nome do remetente, copiado inline
+    int prio;                          // Faixa de destino (0 a MQ_PRIO_LEVELS - 1)
+    u32 corr;                          // Id de correlação de uma chamada, senão 0
+    char inline_data[MSG_INLINE_SIZE]; // payload de mensagens pequenas
 } message_t;
 
-static char empty_sender[] = "";
-static message_t mensagem_null = {
-    .size = 0,
-    .data = NULL,
-    .sender = empty_sender
-};
+static struct kmem_cache *cache_payload; // Buffers de CMD_BUF_SIZE bytes para message_t
+
+// Payload de mais de CMD_BUF_SIZE bytes: cada fila que o recebe guarda um registro
+// REGISTRO_REFERENCIA com uma referência, solta ao ler ou descartar a mensagem, e message_t.buf
+// aponta para dados. A última referência pode cair num remetente sob rcu_read_lock(), onde
+// kvfree não pode dormir: a liberação espera um grace period.
+typedef struct payload_compartilhado {
+    struct kref ref;
+    struct rcu_head rcu;
+    char dados[];
+} payload_compartilhado_t;
+
+#define MSG_MAX(inst) ((size_t)READ_ONCE((inst)->fila_bytes_max) - sizeof(registro_t)) // Maior payload que cabe na maior fila vazia (faixa 0) de inst
+
+// Anel compartilhado com o espaço do usuário (modo mmap, ver mq_ioctl.h)
+typedef struct mq_anel {
+    struct mq_ring_hdr *hdr;  // Região vmalloc_user mapeada pelo consumidor
+    size_t tamanho;           // Bytes mapeáveis (múltiplo de PAGE_SIZE)
+    u32 slots;                // Potência de 2
+    u32 slot_size;
+    u32 head;                 // Cópia do kernel de hdr->head (a região é gravável pelo usuário)
+    struct kref ref;          // Uma referência da fila e uma por vma que mapeia o anel
+} mq_anel_t;
+
+// Comando de MQ_IOC_SEND_BATCH já copiado do usuário, aguardando entrega
+typedef struct comando_lote {
+    char destino[NAME_SIZE];         // Vazio: destino dado por destino_id
+    u32 destino_id;
+    message_t msg;
+    struct control_block *cb_dest;   // Destino resolvido (válido sob rcu_read_lock)
+    bool feito;
+    bool esperar;                    // Destino cheio sob MQ_OVERFLOW_BLOCK (com referência a cb_dest)
+} comando_lote_t;
+
+// Contadores globais, um conjunto por CPU: o caminho quente só incrementa o da CPU atual, e
+// o debugfs soma todos na leitura (mq/stats e mq/latencia)
+typedef struct mq_stats {
+    u64 enfileiradas;
+    u64 retiradas;
+    u64 sobrescritas;         // Descartadas para abrir espaço (MQ_OVERFLOW_OVERWRITE)
+    u64 recusadas;            // Fila ou anel cheio: -ENOSPC ao remetente
+    u64 bloqueios;            // Remetentes que encontraram a fila cheia sob MQ_OVERFLOW_BLOCK
+    u64 bytes_enfileirados;
+    u64 bytes_retirados;
+    u64 falhas_alocacao;
+    u64 esperas_ativas;       // Leituras que giraram antes de dormir
+    u64 esperas_ativas_sucesso; // Das quais a mensagem chegou durante a espera
+    u64 espera_ativa_ns;      // Tempo total gasto girando
+    u64 latencia[LATENCIA_FAIXAS]; // Faixa i: latência em [2^(i-1), 2^i) ns
+} mq_stats_t;
+
+static DEFINE_PER_CPU(mq_stats_t, mq_stats);
+static struct dentry *dir_debugfs;
+
+
+// Destinatário de /all ou /pub com a fila cheia sob MQ_OVERFLOW_BLOCK: a entrega é feita
+// depois do percurso RCU, segurando uma referência ao control_block
+typedef struct envio_pendente {
+    struct list_head no;
+    control_block_t *cb;
+} envio_pendente_t;
+
+// Chamada (MQ_IOC_CALL) de um descritor à espera da resposta. Vive na pilha do chamador e é
+// publicada em cb->chamada sob cb->lock. Quem responde a toma (CHAMADA_RESPONDENDO) sob o lock
+// e copia a resposta fora dele; o chamador não retorna enquanto a cópia não termina.
+typedef struct chamada {
+    u32 corr;                          // Id de correlação da requisição
+    int estado;                        // CHAMADA_*, escrito sob cb->lock
+    message_t resposta;                // Buffer da resposta, com a capacidade pedida pelo chamador
+    char *buf;                         // Payload de resposta (inline ou alocado)
+    size_t size;                       // Tamanho real da resposta
+} chamada_t;
+
+// MQ_IOC_RECV do io_uring que encontrou a fila vazia, guardado na área pdu do io_uring_cmd
+// até o próximo enfileiramento (ou /unr, ou close) completá-lo
+typedef struct recebimento {
+    struct list_head no;                 // Nó em cb->recebimentos, sob cb->lock
+    struct io_uring_cmd *ioucmd;
+    struct mq_recv_args __user *args;    // Lido do SQE na submissão: o usuário pode reutilizá-lo
+} recebimento_t;
+
+#define CHAMADA_ESPERANDO   0
+#define CHAMADA_RESPONDENDO 1 // Resposta sendo copiada para buf
+#define CHAMADA_RESPONDIDA  2
 
-typedef struct message_queue {
-    int wp;
-    int rp;
-    //int capacity;
-    state_t state;
-    message_t *messages; // vetor contíguo de structs message_t
-} message_queue_t;
-//=================================================================================================
-typedef struct control_block {
-    pid_t pid;                         // PID do processo
-    char *nome;                   // Nome do processo ou identificador
-    message_queue_t *queue;           // Ponteiro para a fila de mensagens do processo
-    spinlock_t lock;                  // Proteção para acesso concorrente
-    struct control_block *next;       // Próximo na lista
-    struct control_block *prev;       // Anterior na lista
-} control_block_t;
-
-// Estrutura que representa a lista de control_blocks
-typedef struct control_block_list {
-    control_block_t *head;  // Ponteiro para o primeiro control_block
-    int count;              // Número total de elementos na lista
-    spinlock_t lock;        // Exclusão mútua para inserção/remoção de control_blocks
-} control_block_list_t;
-
-// Instância global da lista de processos
-static control_block_list_t tabela_control_blocks = {
-    .head = NULL,
-    .count = 0,
-    .lock = __SPIN_LOCK_UNLOCKED(tabela_control_blocks.lock)
-};
-//static DEFINE_SPINLOCK(tabela_control_blocks_lock);
 //=================================================================================================
 // Prototipos das operações do driver
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static int dev_uring_cmd(struct io_uring_cmd *, unsigned int);
 // Protótipos das funções de utilidade
-static int registrar_processo(pid_t pid, const char *nome);
-static int remover_processo(pid_t pid);
-static control_block_t* buscar_control_block(pid_t pid);
-static control_block_t* buscar_control_block_por_nome(const char *nome);
-static void inserir_control_block(control_block_t *novo);
-static void remover_control_block(control_block_t *cb);
-static void atualizar_estado_fila(message_queue_t *q);
+static int registrar_processo(control_block_t *cb, pid_t pid, const char *nome, u32 bytes);
+static int remover_processo(control_block_t *cb);
+static void liberar_control_block(struct kref *ref);
+static void liberar_fila(struct kref *ref);
+static int faixa_de_iter(faixa_t *f, u32 pos, struct iov_iter *de, size_t n);
+static int faixa_para_iter(faixa_t *f, u32 pos, struct iov_iter *para, size_t n);
+static message_queue_t* obter_fila(control_block_t *cb);
+static bool mensagem_disponivel(control_block_t *cb, message_queue_t *q);
+static bool fila_em_anel(control_block_t *cb, message_queue_t *q);
+static bool fila_com_espaco(control_block_t *cb, int prio, size_t size, u32 extra);
+static void acordar_leitores(control_block_t *cb);
+static void acordar_recebimentos(control_block_t *cb, bool cancelar);
+static int reservar_registro(control_block_t *cb_dest, message_queue_t *q, int prio, size_t size, u32 extra, const char *sender, u32 corr, u32 *pos);
+static int enfileirar_na_fila(control_block_t *cb_dest, message_queue_t *q, const message_t *msg);
+static int enfileirar_mensagem(control_block_t *cb_dest, const message_t *msg);
+static int enfileirar_esperando(control_block_t *cb_dest, const message_t *msg);
+static int enfileirar_do_iter(control_block_t *cb_dest, const char *sender, struct iov_iter *dados, int prio, u32 corr, bool terminador, bool nonblock);
+static char* alocar_payload(message_t *msg, size_t size, gfp_t gfp);
+static void liberar_payload(message_t *msg);
+static const char* payload(const message_t *msg);
+static bool por_referencia(const message_t *msg);
+static void soltar_compartilhado(void *dados);
+static void soltar_referencias(message_queue_t *q);
+static int enviar_mensagem(control_block_t *cb_origem, const char *destino, u32 destino_id, struct iov_iter *dados, int prio, u32 corr, bool terminador, bool nonblock);
+static int enviar_para_todos(control_block_t *cb_origem, message_t *msg, bool nonblock);
+static int fazer_chamada(control_block_t *cb_origem, const char *destino, u32 destino_id, struct iov_iter *dados, int prio, long timeout, bool nonblock, chamada_t *ch);
+static int responder_chamada(control_block_t *cb_origem, const char *destino, u32 destino_id, u32 corr, struct iov_iter *dados);
+static int publicar_topico(control_block_t *cb_origem, const char *nome, message_t *msg, bool nonblock);
+static int entregar_no_percurso(control_block_t *cb_dest, const message_t *msg, bool nonblock, struct list_head *pendentes);
+static int entregar_pendentes(struct list_head *pendentes, const message_t *msg);
+static int enviar_lote(control_block_t *cb_origem, struct comando_lote *lote, int n, bool nonblock, int *falha);
+static ssize_t ler_fila(control_block_t *cb, bool nonblock, struct iov_iter *para, bool quadros, size_t *size, char *sender, u8 *prio, u32 *corr);
+static ssize_t receber_mensagem(control_block_t *cb, bool nonblock, struct iov_iter *para, size_t *size, char *sender, u8 *prio, u32 *corr);
+static ssize_t receber_lote(control_block_t *cb, bool nonblock, struct iov_iter *para);
+static ssize_t completar_quadro(struct iov_iter *para, size_t len);
+static ssize_t retirar_do_anel(control_block_t *cb, bool nonblock, struct iov_iter *para, bool quadro, size_t *size, char *sender, u8 *prio, u32 *corr);
+static long comando_anel(control_block_t *cb);
+static mq_anel_t* criar_anel(u32 slots);
+static void liberar_anel(struct kref *ref);
+static u32 anel_pendentes(mq_anel_t *anel);
+static struct mq_ring_slot* anel_reservar_slot(mq_anel_t *anel, size_t size);
+static void anel_publicar(mq_anel_t *anel);
+static int escrever_no_anel(mq_anel_t *anel, u32 seq, const message_t *msg);
+static void contar_enfileirada(control_block_t *cb, message_queue_t *q, size_t size);
+static void contar_recusada(control_block_t *cb, int erro);
+static void rastrear_enfileirada(control_block_t *cb, faixa_t *f, u32 pos, size_t size, u32 ocupado);
+static void contar_sobrescrita(control_block_t *cb, message_queue_t *q, const registro_t *reg, const registro_referencia_t *ref);
+static void aplicar_descartes(control_block_t *cb, message_queue_t *q);
+static void pagar_descartes(control_block_t *cb, message_queue_t *q);
+static int redimensionar_fila(control_block_t *cb, u32 bytes);
+static int definir_fila(control_block_t *cb, u32 bytes, u32 slots);
+static int comando_registrar(control_block_t *cb, const char *nome, u32 bytes);
+static int comando_remover(control_block_t *cb);
+static ssize_t escrever_comando(control_block_t *cb_origem, struct iov_iter *de, bool nonblock);
 static int mq_init_driver(void);
 static void mq_exit_driver(void);
 //=================================================================================================
@@ -99,30 +256,378 @@ static void mq_exit_driver(void);
 static struct file_operations fops = {
     .owner = THIS_MODULE, // ...
     .open = dev_open,
-    .read = dev_read,
-    .write = dev_write,
+    .read_iter = dev_read_iter,
+    .write_iter = dev_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = dev_poll,
+    .mmap = dev_mmap,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .uring_cmd = dev_uring_cmd,
     .release = dev_release,
 };
 
+//=================================================================================================
+// Estatísticas em /sys/kernel/debug/mq: stats (contadores globais), latencia (histograma do
+// tempo entre enfileirar e ler), endpoints (contadores e ocupação de cada fila registrada) e
+// topicos (assinantes de cada tópico)
+
+// Soma em total os contadores de todas as CPUs. Sem sincronização: os valores são aproximados.
+static void somar_stats(mq_stats_t *total) {
+    int cpu, i;
+
+    memset(total, 0, sizeof(*total));
+    for_each_possible_cpu(cpu) {
+        mq_stats_t *s = per_cpu_ptr(&mq_stats, cpu);
+
+        total->enfileiradas += s->enfileiradas;
+        total->retiradas += s->retiradas;
+        total->sobrescritas += s->sobrescritas;
+        total->recusadas += s->recusadas;
+        total->bloqueios += s->bloqueios;
+        total->bytes_enfileirados += s->bytes_enfileirados;
+        total->bytes_retirados += s->bytes_retirados;
+        total->falhas_alocacao += s->falhas_alocacao;
+        total->esperas_ativas += s->esperas_ativas;
+        total->esperas_ativas_sucesso += s->esperas_ativas_sucesso;
+        total->espera_ativa_ns += s->espera_ativa_ns;
+        for (i = 0; i < LATENCIA_FAIXAS; i++)
+            total->latencia[i] += s->latencia[i];
+    }
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+    int registrados = 0, topicos = 0, i;
+    mq_stats_t total;
+
+    somar_stats(&total);
+    for (i = 0; i < INSTANCES; i++) {
+        registrados += READ_ONCE(instancias[i].control_blocks.count);
+        topicos += READ_ONCE(instancias[i].topicos.count);
+    }
+    seq_printf(m, "registrados %d\n", registrados);
+    seq_printf(m, "topicos %d\n", topicos);
+    seq_printf(m, "enfileiradas %llu\n", total.enfileiradas);
+    seq_printf(m, "retiradas %llu\n", total.retiradas);
+    seq_printf(m, "sobrescritas %llu\n", total.sobrescritas);
+    seq_printf(m, "recusadas %llu\n", total.recusadas);
+    seq_printf(m, "bloqueios %llu\n", total.bloqueios);
+    seq_printf(m, "bytes_enfileirados %llu\n", total.bytes_enfileirados);
+    seq_printf(m, "bytes_retirados %llu\n", total.bytes_retirados);
+    seq_printf(m, "falhas_alocacao %llu\n", total.falhas_alocacao);
+    seq_printf(m, "esperas_ativas %llu\n", total.esperas_ativas);
+    seq_printf(m, "esperas_ativas_sucesso %llu\n", total.esperas_ativas_sucesso);
+    seq_printf(m, "espera_ativa_ns %llu\n", total.espera_ativa_ns);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+// Uma linha por faixa: limite superior (exclusivo) em ns e mensagens lidas com essa latência
+static int latencia_show(struct seq_file *m, void *v) {
+    mq_stats_t total;
+    int i;
+
+    somar_stats(&total);
+    seq_puts(m, "ns_abaixo_de mensagens\n");
+    for (i = 0; i < LATENCIA_FAIXAS - 1; i++)
+        seq_printf(m, "%llu %llu\n", 1ULL << i, total.latencia[i]);
+    seq_printf(m, "inf %llu\n", total.latencia[LATENCIA_FAIXAS - 1]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latencia);
+
+static int endpoints_show(struct seq_file *m, void *v) {
+    mq_instancia_t *inst = m->private;
+    control_block_t *cb;
+    stats_endpoint_t *st;
+    char nome[NAME_SIZE];
+    pid_t pid;
+    u32 id, limite, ocupado;
+
+    seq_puts(m, "id nome pid fila ocupado pico enfileiradas retiradas sobrescritas recusadas bloqueios bytes_enfileirados bytes_retirados esperas_ativas esperas_ativas_sucesso\n");
+    rcu_read_lock();
+    list_for_each_entry_rcu(cb, &inst->control_blocks.lista, no_lista) {
+        spin_lock(&cb->lock);
+        if (!cb->queue) {
+            spin_unlock(&cb->lock);
+            continue;
+        }
+        limite = cb->queue->limite;
+        ocupado = fila_ocupado(cb->queue);
+        memcpy(nome, cb->nome, NAME_SIZE);
+        pid = cb->pid;
+        id = cb->id;
+        spin_unlock(&cb->lock);
+
+        // Contadores atualizados sem lock: cada um é lido atomicamente, o conjunto não
+        st = &cb->stats;
+        seq_printf(m, "%u %s %d %u %u %d %lld %lld %lld %lld %lld %lld %lld %lld %lld\n", id, nome, pid,
+                   limite, ocupado, atomic_read(&st->pico), atomic64_read(&st->enfileiradas),
+                   atomic64_read(&st->retiradas), atomic64_read(&st->sobrescritas),
+                   atomic64_read(&st->recusadas), atomic64_read(&st->bloqueios),
+                   atomic64_read(&st->bytes_enfileirados), atomic64_read(&st->bytes_retirados),
+                   atomic64_read(&st->esperas_ativas), atomic64_read(&st->esperas_ativas_sucesso));
+    }
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(endpoints);
+
+// Uma linha por tópico com assinantes: nome e número de assinantes
+static int topicos_show(struct seq_file *m, void *v) {
+    mq_instancia_t *inst = m->private;
+    topico_t *t;
+
+    seq_puts(m, "topico assinantes\n");
+    rcu_read_lock();
+    list_for_each_entry_rcu(t, &inst->topicos.lista, no_lista)
+        seq_printf(m, "%s %d\n", t->nome, READ_ONCE(t->count));
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(topicos);
+//=================================================================================================
+// Tamanhos de fila de cada endpoint: padrões e tetos por instância, no sysfs do dispositivo
+
+// Valida o tamanho de fila bytes pedido até teto (potência de 2), arredondando-o para a
+// potência de 2 seguinte
+static int ajustar_fila_bytes(u32 *bytes, u32 teto) {
+    if (*bytes < FILA_BYTES_MIN || *bytes > teto)
+        return -EINVAL;
+    *bytes = roundup_pow_of_two(*bytes);
+    return 0;
+}
+
+// Como ajustar_fila_bytes, para os slots do anel compartilhado
+static int ajustar_anel_slots(u32 *slots, u32 teto) {
+    if (*slots < ANEL_SLOTS_MIN || *slots > teto)
+        return -EINVAL;
+    *slots = roundup_pow_of_two(*slots);
+    return 0;
+}
+
+// Serializa as escritas nos atributos abaixo, para que um padrão nunca passe do seu teto.
+// Os leitores (registro, MQ_IOC_SET_QUEUE) usam READ_ONCE.
+static DEFINE_MUTEX(mutex_limites);
+
+// /sys/class/mq_class/<dispositivo>/fila_bytes: tamanho das filas registradas sem pedido
+static ssize_t fila_bytes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(inst->fila_bytes));
+}
+
+static ssize_t fila_bytes_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+    u32 bytes;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &bytes);
+    if (ret)
+        return ret;
+    mutex_lock(&mutex_limites);
+    ret = ajustar_fila_bytes(&bytes, inst->fila_bytes_max);
+    if (ret == 0)
+        WRITE_ONCE(inst->fila_bytes, bytes);
+    mutex_unlock(&mutex_limites);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(fila_bytes);
+
+// fila_bytes_max: maior fila que um endpoint pode pedir; filas já maiores não mudam
+static ssize_t fila_bytes_max_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(inst->fila_bytes_max));
+}
+
+static ssize_t fila_bytes_max_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+    u32 bytes;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &bytes);
+    if (ret)
+        return ret;
+    mutex_lock(&mutex_limites);
+    ret = ajustar_fila_bytes(&bytes, QUEUE_BYTES_LIMITE);
+    if (ret == 0 && bytes < inst->fila_bytes)
+        ret = -EINVAL;
+    if (ret == 0)
+        WRITE_ONCE(inst->fila_bytes_max, bytes);
+    mutex_unlock(&mutex_limites);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(fila_bytes_max);
+
+// anel_slots: slots do anel compartilhado (modo mmap) sem pedido
+static ssize_t anel_slots_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(inst->anel_slots));
+}
+
+static ssize_t anel_slots_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+    u32 slots;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &slots);
+    if (ret)
+        return ret;
+    mutex_lock(&mutex_limites);
+    ret = ajustar_anel_slots(&slots, inst->anel_slots_max);
+    if (ret == 0)
+        WRITE_ONCE(inst->anel_slots, slots);
+    mutex_unlock(&mutex_limites);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(anel_slots);
+
+// anel_slots_max: maior anel que um endpoint pode pedir
+static ssize_t anel_slots_max_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(inst->anel_slots_max));
+}
+
+static ssize_t anel_slots_max_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    mq_instancia_t *inst = dev_get_drvdata(dev);
+    u32 slots;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &slots);
+    if (ret)
+        return ret;
+    mutex_lock(&mutex_limites);
+    ret = ajustar_anel_slots(&slots, ANEL_SLOTS_LIMITE);
+    if (ret == 0 && slots < inst->anel_slots)
+        ret = -EINVAL;
+    if (ret == 0)
+        WRITE_ONCE(inst->anel_slots_max, slots);
+    mutex_unlock(&mutex_limites);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(anel_slots_max);
+
+static struct attribute *mq_attrs[] = {
+    &dev_attr_fila_bytes.attr,
+    &dev_attr_fila_bytes_max.attr,
+    &dev_attr_anel_slots.attr,
+    &dev_attr_anel_slots_max.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(mq);
+
+//=================================================================================================
+
+// Valor de um parâmetro por instância (MAX_DEVICES, QUEUE_BYTES, QUEUE_BYTES_MAX, OVERFLOW_POLICY) para a
+// instância i: o i-ésimo dado, ou o último se foram dados menos valores que instâncias
+static int parametro_instancia(const int *valores, int n, int i) {
+    return valores[min(i, n - 1)];
+}
+
+// Nome do dispositivo e do diretório de debugfs da instância i: "mq" se ela é a única
+static void nome_instancia(int i, char *nome, size_t tamanho) {
+    if (INSTANCES == 1)
+        snprintf(nome, tamanho, "%s", DEVICE_NAME);
+    else
+        snprintf(nome, tamanho, "%s%d", DEVICE_NAME, i);
+}
+
+// Libera as n primeiras instâncias (já sem registrados) e o vetor delas
+static void liberar_instancias(int n) {
+    while (n-- > 0)
+        destruir_instancia(&instancias[n]);
+    kfree(instancias);
+}
+
+// Remove os dispositivos das n primeiras instâncias
+static void destruir_dispositivos(int n) {
+    while (n-- > 0)
+        device_destroy(charClass, MKDEV(majorNumber, n));
+}
+
 static int mq_init_driver(){
+    struct device *dispositivo;
+    struct dentry *dir;
+    char nome[16];
+    int ret, i;
 
     // Validação dos parâmetros passados via module_param
-    if (QUEUE_LEN <= 2 || QUEUE_LEN > 20) {
-        printk(KERN_ERR "QUEUE_LEN inválido (%d). Intervalo permitido: 2–20\n", QUEUE_LEN);
+    if (INSTANCES < 1 || INSTANCES > INSTANCES_LIMITE) {
+        printk(KERN_ERR "INSTANCES inválido (%d). Intervalo permitido: 1–%d\n", INSTANCES, INSTANCES_LIMITE);
+        return -EINVAL;
+    }
+    if (QUEUE_LEN < ANEL_SLOTS_MIN || QUEUE_LEN > ANEL_SLOTS_LIMITE) {
+        printk(KERN_ERR "QUEUE_LEN inválido (%d). Intervalo permitido: %d–%d\n", QUEUE_LEN, ANEL_SLOTS_MIN, ANEL_SLOTS_LIMITE);
         return -EINVAL;
     }
     if (CMD_BUF_SIZE < 16 || CMD_BUF_SIZE > 4096) {
         printk(KERN_ERR "CMD_BUF_SIZE fora do intervalo (%d). Permitido: 16–4096\n", CMD_BUF_SIZE);
         return -EINVAL;
     }
-    if (MAX_DEVICES < 1 || MAX_DEVICES > 20) {
-        printk(KERN_ERR "MAX_DEVICES inválido (%d). Intervalo permitido: 1–20\n", MAX_DEVICES);
+    if (BUSY_POLL_US < 0 || BUSY_POLL_US > MQ_BUSY_POLL_MAX_US) {
+        printk(KERN_ERR "BUSY_POLL_US inválido (%d). Intervalo permitido: 0–%d\n", BUSY_POLL_US, MQ_BUSY_POLL_MAX_US);
         return -EINVAL;
     }
+    for (i = 0; i < INSTANCES; i++) {
+        int bytes = parametro_instancia(QUEUE_BYTES, n_queue_bytes, i);
+        int teto = parametro_instancia(QUEUE_BYTES_MAX, n_queue_bytes_max, i);
+        int max = parametro_instancia(MAX_DEVICES, n_max_devices, i);
+        int politica = parametro_instancia(OVERFLOW_POLICY, n_overflow_policy, i);
+
+        if (bytes < FILA_BYTES_MIN || bytes > QUEUE_BYTES_LIMITE || !is_power_of_2(bytes)) {
+            printk(KERN_ERR "QUEUE_BYTES inválido (%d) na instância %d. Potência de 2 entre %d e %d\n", bytes, i, FILA_BYTES_MIN, QUEUE_BYTES_LIMITE);
+            return -EINVAL;
+        }
+        if (teto < FILA_BYTES_MIN || teto > QUEUE_BYTES_LIMITE || !is_power_of_2(teto)) {
+            printk(KERN_ERR "QUEUE_BYTES_MAX inválido (%d) na instância %d. Potência de 2 entre %d e %d\n", teto, i, FILA_BYTES_MIN, QUEUE_BYTES_LIMITE);
+            return -EINVAL;
+        }
+        if (max < 1 || max > MAX_DEVICES_LIMITE) {
+            printk(KERN_ERR "MAX_DEVICES inválido (%d) na instância %d. Intervalo permitido: 1–%d\n", max, i, MAX_DEVICES_LIMITE);
+            return -EINVAL;
+        }
+        if (politica < MQ_OVERFLOW_OVERWRITE || politica > MQ_OVERFLOW_BLOCK) {
+            printk(KERN_ERR "OVERFLOW_POLICY inválido (%d) na instância %d. Permitido: 0 (sobrescrever), 1 (recusar), 2 (bloquear)\n", politica, i);
+            return -EINVAL;
+        }
+    }
 
     printk(KERN_INFO "Carregando o módulo");
+    cache_payload = kmem_cache_create("mq_payload", CMD_BUF_SIZE, 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!cache_payload) {
+        printk(KERN_ALERT "Simple Driver: failed to create the payload cache\n");
+        return -ENOMEM;
+    }
+    instancias = kcalloc(INSTANCES, sizeof(mq_instancia_t), GFP_KERNEL);
+    if (!instancias) {
+        kmem_cache_destroy(cache_payload);
+        return -ENOMEM;
+    }
+    for (i = 0; i < INSTANCES; i++) {
+        ret = iniciar_instancia(&instancias[i], parametro_instancia(MAX_DEVICES, n_max_devices, i),
+                                parametro_instancia(QUEUE_BYTES, n_queue_bytes, i),
+                                parametro_instancia(OVERFLOW_POLICY, n_overflow_policy, i));
+        if (ret) {
+            liberar_instancias(i);
+            kmem_cache_destroy(cache_payload);
+            printk(KERN_ALERT "Simple Driver: failed to create the name and topic indexes\n");
+            return ret;
+        }
+        // O teto nunca fica abaixo do padrão, mesmo que QUEUE_BYTES_MAX tenha sido omitido
+        instancias[i].fila_bytes_max = max_t(u32, instancias[i].fila_bytes,
+                                             parametro_instancia(QUEUE_BYTES_MAX, n_queue_bytes_max, i));
+        instancias[i].anel_slots = roundup_pow_of_two(QUEUE_LEN);
+        instancias[i].anel_slots_max = ANEL_SLOTS_LIMITE;
+    }
+
     majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
 	if (majorNumber < 0) {
+		liberar_instancias(INSTANCES);
+		kmem_cache_destroy(cache_payload);
 		printk(KERN_ALERT "Simple Driver failed to register a major number\n");
 		return majorNumber;
 	}
@@ -131,458 +636,2660 @@ static int mq_init_driver(){
 	charClass = class_create(THIS_MODULE, CLASS_NAME);
 	if (IS_ERR(charClass)) {		// Check for error and clean up if there is
 		unregister_chrdev(majorNumber, DEVICE_NAME);
+		liberar_instancias(INSTANCES);
+		kmem_cache_destroy(cache_payload);
 		printk(KERN_ALERT "Simple Driver: failed to register device class\n");
 		return PTR_ERR(charClass);	// Correct way to return an error on a pointer
 	}
 
-    // Register the device driver
-	charDevice = device_create(charClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-	if (IS_ERR(charDevice)) {		// Clean up if there is an error
-		class_destroy(charClass);
-		unregister_chrdev(majorNumber, DEVICE_NAME);
-		printk(KERN_ALERT "Simple Driver: failed to create the device\n");
-		return PTR_ERR(charDevice);
-	}
+    // Um dispositivo por instância, no minor de mesmo número, com os padrões e tetos das filas
+    // dela no sysfs
+    for (i = 0; i < INSTANCES; i++) {
+        nome_instancia(i, nome, sizeof(nome));
+        dispositivo = device_create_with_groups(charClass, NULL, MKDEV(majorNumber, i), &instancias[i],
+                                                mq_groups, "%s", nome);
+        if (IS_ERR(dispositivo)) {		// Clean up if there is an error
+            destruir_dispositivos(i);
+            class_destroy(charClass);
+            unregister_chrdev(majorNumber, DEVICE_NAME);
+            liberar_instancias(INSTANCES);
+            kmem_cache_destroy(cache_payload);
+            printk(KERN_ALERT "Simple Driver: failed to create the device\n");
+            return PTR_ERR(dispositivo);
+        }
+    }
+
+    // Estatísticas em /sys/kernel/debug/mq; uma falha aqui não impede o uso do driver.
+    // endpoints e topicos são por instância: num subdiretório de cada uma, se há mais de uma.
+    dir_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("stats", 0444, dir_debugfs, NULL, &stats_fops);
+    debugfs_create_file("latencia", 0444, dir_debugfs, NULL, &latencia_fops);
+    for (i = 0; i < INSTANCES; i++) {
+        dir = dir_debugfs;
+        if (INSTANCES > 1) {
+            nome_instancia(i, nome, sizeof(nome));
+            dir = debugfs_create_dir(nome, dir_debugfs);
+        }
+        debugfs_create_file("endpoints", 0444, dir, &instancias[i], &endpoints_fops);
+        debugfs_create_file("topicos", 0444, dir, &instancias[i], &topicos_fops);
+    }
 
-    // spin_lock_init(&tabela_control_blocks_lock);
-    //spin_lock_init(&tabela_control_blocks.lock);
-	//init_driver(MAX_DEVICES, CMD_BUF_SIZE, QUEUE_LEN);
     printk(KERN_INFO "Módulo carregado");
     return 0;
 }
 
 static void mq_exit_driver(void){
-    spin_lock(&tabela_control_blocks.lock);
-    while (tabela_control_blocks.count > 0) {
-        control_block_t *cb = tabela_control_blocks.head;
-        spin_unlock(&tabela_control_blocks.lock);
-        remover_processo(cb->pid); // isso já libera tudo
-        spin_lock(&tabela_control_blocks.lock);
-    }
-    spin_unlock(&tabela_control_blocks.lock);
-    device_destroy(charClass, MKDEV(majorNumber, 0));
+    // Os registros pertencem aos descritores abertos, e o módulo só pode ser descarregado
+    // depois que todos forem fechados: dev_release já removeu cada control_block.
+    // Espera os kfree_rcu e call_rcu pendentes antes de o código do módulo sumir.
+    debugfs_remove_recursive(dir_debugfs);
+    rcu_barrier();
+    destruir_dispositivos(INSTANCES);
     class_destroy(charClass);
     unregister_chrdev(majorNumber, DEVICE_NAME);
+    liberar_instancias(INSTANCES);
+    kmem_cache_destroy(cache_payload);
     printk(KERN_INFO "Módulo descarregado\n");
     return;
 }
 
 //=================================================================================================
 
-// Função para buscar um control_block por PID
-static control_block_t* buscar_control_block(pid_t pid) {
-    control_block_t *curr= tabela_control_blocks.head;
-    if (!curr) return NULL;
-
-    do {
-        if (curr->pid == pid)
-            return curr;
-        curr = curr->next;
-    } while (curr != tabela_control_blocks.head);
-
-    return NULL; // Não encontrado
-}
-
-// Função para buscar um control_block por nome
-static control_block_t* buscar_control_block_por_nome(const char *nome) {
-    control_block_t *curr = tabela_control_blocks.head;
-    if (!curr) return NULL;
-
-    do {
-        if (strncmp(curr->nome, nome, NAME_SIZE) == 0) 
-            return curr;
-        curr = curr->next;
-    } while (curr != tabela_control_blocks.head);
-
-    return NULL; // Não encontrado
-}
-
-// Função para registrar um processo na lista de control_blocks
-static int registrar_processo(pid_t pid, const char *nome) {
+// Função para registrar o endpoint cb (um descritor aberto) sob "nome", com uma fila de bytes
+// (/reg nome bytes; 0: a pedida antes por MQ_IOC_SET_QUEUE ou a padrão da instância). O
+// tamanho pedido só fica gravado em cb se o registro der certo. Sob cb->configuracao.
+static int registrar_processo(control_block_t *cb, pid_t pid, const char *nome, u32 bytes) {
     
-    control_block_t *novo_cb;
     message_queue_t *fila;
-    int i;
-
-    // Start control_block_t ====================================
-    novo_cb = kmalloc(sizeof(control_block_t), GFP_KERNEL);
-    novo_cb->pid = pid;
-    novo_cb->nome = kmalloc_array(NAME_SIZE, sizeof(char), GFP_KERNEL);
-    if(tabela_control_blocks.count == MAX_DEVICES -1){
-        printk(KERN_WARNING "MAX_DEVICES atingido. Processo PID %d não registrado\n", pid);
-        return -ENOENT;
-    }
-    
-    if (!novo_cb) {
-        kfree(novo_cb->name);
-        return -ENOMEM;
-    }
-    // Add name ================================================
-    
-    if (!novo_cb->nome) {
-        kfree(novo_cb);
-        return -ENOMEM;
-    }
-    strncpy(novo_cb->nome, nome, NAME_SIZE - 1);
-    novo_cb->nome[NAME_SIZE - 1] = '\0';
+    int ret;
 
     // Start message_queue_t ====================================
-    // message_queue_t *fila = kmalloc(sizeof(message_queue_t), GFP_KERNEL);
     fila = kmalloc(sizeof(message_queue_t), GFP_KERNEL);
-    if (!fila) {
-        kfree(novo_cb);
+    if (!fila || fila_iniciar(fila, bytes ?: READ_ONCE(cb->fila_bytes) ?: READ_ONCE(cb->inst->fila_bytes))) {
+        this_cpu_inc(mq_stats.falhas_alocacao);
+        kfree(fila);
         return -ENOMEM;
     }
 
-    fila->wp = 0;
-    fila->rp = 0;
-    fila->state = EMPTY;
-
-    // Start message_t ========================================
-    fila->messages = kmalloc_array(QUEUE_LEN, sizeof(message_t), GFP_KERNEL);
-    if (!fila->messages) {
+    ret = inserir_control_block(cb, pid, nome, fila);
+    if (ret) {
+        fila_destruir(fila);
         kfree(fila);
-        kfree(novo_cb->nome);
-        kfree(novo_cb);
-        return -ENOMEM;
+        return ret;
     }
-    // Empty the elements ========================================
-    for (i = 0; i < QUEUE_LEN; i++) {
-        fila->messages[i].data = NULL;
-        fila->messages[i].sender = NULL;
-        fila->messages[i].size = 0;
-    }
-    
-    novo_cb->queue = fila;
-    novo_cb->next = NULL;
-    novo_cb->prev = NULL;
-    spin_lock_init(&novo_cb->lock);
-    inserir_control_block(novo_cb);
+    if (bytes)
+        WRITE_ONCE(cb->fila_bytes, bytes);
+    trace_mq_register(cb->nome, cb->id, pid);
     return 0;
 }
 
-// Função para inserir um control_block na tabela_control_blocks
-static void inserir_control_block(control_block_t *novo) {
-    control_block_t *curr, *prev;
-    spin_lock(&tabela_control_blocks.lock);
-    if(tabela_control_blocks.count == 0){
-        tabela_control_blocks.head = novo;
-        novo->next = novo;
-        novo->prev = novo;
-        tabela_control_blocks.count++;
-        spin_unlock(&tabela_control_blocks.lock);
-        return;
-    }
-    curr = tabela_control_blocks.head;
-    prev = curr->prev;
-    prev->next= novo;
-    novo->prev = prev;
-    novo->next = curr;
-    curr->prev = novo;
-    tabela_control_blocks.count++;
-    spin_unlock(&tabela_control_blocks.lock);
-}
-
-// Função para remover de control_blocks por PID
-static int remover_processo(pid_t pid) {
-    control_block_t *cb = buscar_control_block(pid);
-    if (!cb) {
-        printk(KERN_WARNING "REMOVE: Processo PID %d não encontrado\n", pid);
+// Função para desregistrar cb: retira da tabela, cancela suas assinaturas de tópicos e solta a
+// fila e as mensagens pendentes. O control_block em si continua pertencendo ao descritor
+// (liberado em dev_release).
+// Leitores RCU que ainda o enxergam encontram queue == NULL e desistem; remetentes que já
+// tinham a fila terminam de escrever nela antes de ela ser liberada.
+static int remover_processo(control_block_t *cb) {
+    spinlock_t *lock = &cb->inst->control_blocks.lock;
+    message_queue_t *fila;
+    u32 ocupado;
+
+    spin_lock(lock);
+    if (!cb->queue) {
+        spin_unlock(lock);
         return -ENOENT;
     }
-    // Libera a fila de mensagens
-    if (cb->queue) {
-        int i;
-        for (i = QUEUE_LEN-1; i >= 0; i++) {
-            kfree(cb->queue->messages[i].data);
-            kfree(cb->queue->messages[i].sender); // se for alocado dinamicamente
-            kfree(cb->queue->messages[i]);
-        }
-        kfree(cb->queue);
-        //cb->queue = NULL;
-    }
     remover_control_block(cb);
-    kfree(cb->nome);
-    kfree(cb);
 
-    printk(KERN_INFO "REMOVE: Processo PID %d removido com sucesso\n", pid);
+    spin_lock(&cb->lock);
+    fila = cb->queue;
+    RCU_INIT_POINTER(cb->queue, NULL);
+    WRITE_ONCE(cb->modo_anel, false);
+    ocupado = fila_ocupado(fila);
+    spin_unlock(&cb->lock);
+    spin_unlock(lock);
+    trace_mq_unregister(cb->nome, cb->id, cb->pid, ocupado);
+
+    // Com queue já NULL, nenhuma assinatura nova pode ser criada
+    cancelar_assinaturas(cb);
+
+    // Leitores, remetentes e chamadas bloqueados acordam e veem o descritor desregistrado
+    wake_up_interruptible(&cb->leitores);
+    wake_up_interruptible(&cb->escritores);
+    wake_up_interruptible(&cb->respostas);
+    acordar_recebimentos(cb, true);
+
+    // Libera a fila de mensagens (ao fim das cópias que ainda a usam)
+    kref_put(&fila->ref, liberar_fila);
+
+    printk(KERN_INFO "REMOVE: Processo PID %d (\"%s\") removido com sucesso\n", cb->pid, cb->nome);
     return 0;
 }
 
-// Função para remover um control_block da tabela_control_blocks
-static void remover_control_block(control_block_t *cb) {
-    spin_lock(&tabela_control_blocks.lock);
+// Libera o control_block quando o descritor e os remetentes em espera o soltaram
+static void liberar_control_block(struct kref *ref) {
+    control_block_t *cb = container_of(ref, control_block_t, ref);
 
-    if (tabela_control_blocks.count == 1) {
-        tabela_control_blocks.head = NULL;
-    } else {
-        cb->prev->next = cb->next;
-        cb->next->prev = cb->prev;
-        if (tabela_control_blocks.head == cb) {
-            tabela_control_blocks.head = cb->next;
-        }
-    }
+    // Remetentes podem ter obtido cb por RCU antes da remoção
+    kfree_rcu(cb, rcu);
+}
 
-    tabela_control_blocks.count--;
+static void liberar_fila_rcu(struct rcu_head *rcu) {
+    message_queue_t *q = container_of(rcu, message_queue_t, rcu);
 
-    spin_unlock(&tabela_control_blocks.lock);
+    if (q->anel)
+        kref_put(&q->anel->ref, liberar_anel); // mapeamentos ainda abertos seguram o anel
+    soltar_referencias(q);
+    fila_destruir(q);
+    kfree(q);
 }
 
-// Atualiza o estado da fila com base em wp e rp
-static void atualizar_estado_fila(message_queue_t *q) {
-    int count;
-    count = (q->wp >= q->rp) ? (q->wp - q->rp) : (QUEUE_LEN - q->rp + q->wp);
-    if (count == 0)
-        q->state = EMPTY;
-    else if (count == QUEUE_LEN)
-        q->state = FULL;
-    else
-        q->state = LIMBO;
+// Libera a fila quando o registro e as cópias em andamento a soltaram, depois dos
+// remetentes e de poll, que a usam sob rcu_read_lock() sem referência
+static void liberar_fila(struct kref *ref) {
+    message_queue_t *q = container_of(ref, message_queue_t, ref);
+
+    call_rcu(&q->rcu, liberar_fila_rcu);
 }
 
-//=================================================================================================
-static int dev_open(struct inode *inode, struct file *filp) { // Just to generate the descriptor
+// Como faixa_escrever e faixa_ler, mas de e para um iov_iter: memória do usuário (read,
+// write, ioctl) ou páginas de um pipe (splice), copiadas direto do e para o anel de bytes
+static int faixa_de_iter(faixa_t *f, u32 pos, struct iov_iter *de, size_t n) {
+    u32 ini = pos & f->mascara;
+    size_t parte = min_t(size_t, n, f->mascara + 1 - ini);
+
+    if (!copy_from_iter_full(f->dados + ini, parte, de) ||
+        !copy_from_iter_full(f->dados, n - parte, de))
+        return -EFAULT;
     return 0;
 }
-static int dev_release(struct inode *inode, struct file *filp) {
+
+static int faixa_para_iter(faixa_t *f, u32 pos, struct iov_iter *para, size_t n) {
+    u32 ini = pos & f->mascara;
+    size_t parte = min_t(size_t, n, f->mascara + 1 - ini);
+
+    if (copy_to_iter(f->dados + ini, parte, para) != parte ||
+        copy_to_iter(f->dados, n - parte, para) != n - parte)
+        return -EFAULT;
     return 0;
 }
-// Função open vazia para o driver
-static ssize_t dev_read(struct file *filp, char *buffer, size_t len, loff_t *offset) {
-    control_block_t *cb;
+
+// Devolve a fila de cb com uma referência, para uso fora de rcu_read_lock() (cópias que
+// podem dormir), ou NULL se o descritor não está registrado
+static message_queue_t* obter_fila(control_block_t *cb) {
     message_queue_t *q;
-    message_t *msg;
-    pid_t pid;
-    size_t to_copy;
-    pid = current->pid;
-    cb = buscar_control_block(pid);
-    if (!cb) {
-        printk(KERN_WARNING "READ: Processo PID %d não registrado\n", pid);
-        return -ENOENT;
-    }
-    //============================================================================
-    spin_lock(&cb->lock);
-    q = cb->queue;
-    msg = &q->messages[q->rp];
 
-    if (q->state == EMPTY || msg->data == NULL || msg->size == 0) {
-        spin_unlock(&cb->lock);
-        printk(KERN_INFO "READ: Fila vazia (underflow)\n");
-        return -EAGAIN;
-    }
+    rcu_read_lock();
+    q = rcu_dereference(cb->queue);
+    if (q && !kref_get_unless_zero(&q->ref))
+        q = NULL;
+    rcu_read_unlock();
+    return q;
+}
 
-    to_copy = (len < msg->size) ? len : msg->size;
-    if (copy_to_user(buffer, msg->data, to_copy) != 0) {
-        spin_unlock(&cb->lock);
-        printk(KERN_WARNING "READ: Falha ao copiar dados para espaço do usuário\n");
-        return -EFAULT;
-    }
+// Indica se um leitor esperando em q, fila de cb, deve acordar: há mensagem, a fila passou
+// para o modo mmap ou deixou de ser a fila de cb. Durante uma migração, só quando ela
+// termina. Usada como condição de wait_event; o estado é revalidado pelo chamador.
+static bool mensagem_disponivel(control_block_t *cb, message_queue_t *q) {
+    return READ_ONCE(cb->queue) != q ||
+           (!READ_ONCE(q->migrando) && (READ_ONCE(q->anel) || fila_tem_mensagem(q)));
+}
 
-    // Liberar conteúdo da mensagem
-    kfree(msg->data);
-    kfree(msg->sender); 
-    // Resolve Dangling
-    msg.data = NULL;
-    msg.sender = NULL;
-    msg.size = 0;
+// Indica se um remetente bloqueado em cb (MQ_OVERFLOW_BLOCK, ou esperando uma migração) pode
+// tentar de novo: a faixa prio tem espaço para size bytes (mais extra, ver fila_reservar), a
+// fila mudou de política ou de modo, ou o descritor foi desregistrado. Usada como condição de
+// wait_event; o estado é revalidado ao enfileirar.
+static bool fila_com_espaco(control_block_t *cb, int prio, size_t size, u32 extra) {
+    message_queue_t *q;
+    bool ret;
+
+    rcu_read_lock();
+    q = rcu_dereference(cb->queue);
+    ret = !q || (!READ_ONCE(q->migrando) &&
+                 (READ_ONCE(q->anel) || READ_ONCE(cb->politica) != MQ_OVERFLOW_BLOCK ||
+                  fila_cabe(q, prio, size, extra)));
+    rcu_read_unlock();
+    return ret;
+}
 
-    q->rp = (q->rp + 1) % QUEUE_LEN;
-    atualizar_estado_fila(q);
+// Acorda leitores e poll de cb depois de uma publicação. Sem ninguém esperando, o lock da
+// wait queue, que todos os remetentes disputariam, nem é tocado; a barreira de
+// wq_has_sleeper pareia com a de prepare_to_wait.
+static void acordar_leitores(control_block_t *cb) {
+    if (wq_has_sleeper(&cb->leitores))
+        wake_up_interruptible(&cb->leitores);
+    // A barreira de wq_has_sleeper() ordena a publicação antes de olhar recebimentos
+    acordar_recebimentos(cb, false);
+}
 
-    spin_unlock(&cb->lock);
-    return to_copy;
+// Reserva espaço para um payload de size bytes em msg: inline se couber, senão um buffer
+// de cache_payload (até CMD_BUF_SIZE) ou um payload_compartilhado_t de kvmalloc. Retorna onde
+// escrever o conteúdo, ou NULL.
+static char* alocar_payload(message_t *msg, size_t size, gfp_t gfp) {
+    payload_compartilhado_t *c;
+
+    msg->size = size;
+    msg->prio = 0;
+    msg->corr = 0;
+    if (size <= MSG_INLINE_SIZE) {
+        msg->buf = NULL;
+        return msg->inline_data;
+    }
+    if (size <= CMD_BUF_SIZE) {
+        msg->buf = kmem_cache_alloc(cache_payload, gfp);
+    } else {
+        c = kvmalloc(sizeof(*c) + size, gfp);
+        if (c)
+            kref_init(&c->ref);
+        msg->buf = c ? c->dados : NULL;
+    }
+    if (!msg->buf)
+        this_cpu_inc(mq_stats.falhas_alocacao);
+    return msg->buf;
 }
 
-static ssize_t dev_write(struct file *filp, const char *buffer, size_t len, loff_t *offset)
-{
-    const char *cmd_register, *cmd_unregister, *cmd_message, *cmd_all;
-    char buffer2[CMD_BUF_SIZE];
-    char cmd_buf[CMD_BUF_SIZE];
-    char remetente[NAME_SIZE];
-    char destino[NAME_SIZE];
-    char nome[NAME_SIZE];
-    char code[5];
-    control_block_t *cb_pid, *cb_dest, *cb_nome, *cb_origem, *curr;
-    message_queue_t *q;
-    message_t msg;
-    size_t to_copy, sender_len, header;
-    bool existe_pid, existe_nome;
-    int count, enviados, n;
-    pid_t pid;
+// Libera o payload de msg. Um payload compartilhado só é liberado quando a última fila que o
+// referencia também o soltar.
+static void liberar_payload(message_t *msg) {
+    if (msg->buf) {
+        if (msg->size <= CMD_BUF_SIZE)
+            kmem_cache_free(cache_payload, msg->buf);
+        else
+            soltar_compartilhado(msg->buf);
+    }
+    msg->buf = NULL;
+    msg->size = 0;
+}
 
-    memset(destino, 0, sizeof(destino));
-    memset(remetente, 0, sizeof(remetente));
-    memset(code, 0, sizeof(code));
-    memset(nome, 0, sizeof(nome));
-    memset(cmd_buf, 0, sizeof(cmd_buf));
-    memset(buffer2, 0, sizeof(buffer2));
+static const char* payload(const message_t *msg) {
+    return msg->buf ? msg->buf : msg->inline_data;
+}
 
-    to_copy = min(len, (size_t)CMD_BUF_SIZE - 1);//
+// Indica se msg vai para as filas por referência (REGISTRO_REFERENCIA), e não copiada
+static bool por_referencia(const message_t *msg) {
+    return msg->buf && msg->size > CMD_BUF_SIZE;
+}
 
-    if (copy_from_user(cmd_buf, buffer, to_copy) != 0) return -EFAULT;
+static void liberar_compartilhado(struct kref *ref) {
+    payload_compartilhado_t *c = container_of(ref, payload_compartilhado_t, ref);
 
-    cmd_buf[to_copy] = '\0';
+    kvfree_rcu(c, rcu);
+}
 
-    pid = current->pid;
-    cmd_register = "/reg ";
-    cmd_unregister = "/unr";
-    cmd_message = "/msg ";
-    cmd_all = "/all ";
+// Payload compartilhado cujo conteúdo começa em dados
+static payload_compartilhado_t* compartilhado(void *dados) {
+    return (void *)((char *)dados - offsetof(payload_compartilhado_t, dados));
+}
 
-    cb_pid = buscar_control_block(pid);
-    existe_pid  = (cb_pid != NULL);
+// Solta uma referência ao payload compartilhado que começa em dados
+static void soltar_compartilhado(void *dados) {
+    kref_put(&compartilhado(dados)->ref, liberar_compartilhado);
+}
 
-    if (strncmp(cmd_buf, cmd_register, strlen(cmd_register)) == 0) {
-        n = sscanf(cmd_buf, "%s %7s ", code, nome);
-        cb_nome =  buscar_control_block_por_nome(nome);
-        existe_nome = ( cb_nome != NULL);
-        
-        if (existe_pid && existe_nome) {
-            printk(KERN_WARNING "WRITE: PID %d e nome \"%s\" já registrados\n", cb_pid->pid, cb_pid->nome);
-            return -EEXIST;
-        }
-        if (existe_pid) {
-            printk(KERN_WARNING "WRITE: PID %d já registrado\n", current->pid);
-            return -EEXIST;
-        }
-        if (existe_nome) {
-            printk(KERN_WARNING "WRITE: nome \"%s\" já registrado\n", cb_nome->nome);
-            return -EEXIST;
+// Solta as referências dos registros ainda na fila q, que está sendo liberada
+static void soltar_referencias(message_queue_t *q) {
+    registro_referencia_t ref;
+    registro_t reg;
+    faixa_t *f;
+    u32 pos, cabeca;
+    int p;
+
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        f = &q->faixas[p];
+        cabeca = faixa_cabeca(f);
+        for (pos = f->cauda; pos != cabeca; pos += REGISTRO_TAMANHO(reg.size)) {
+            // Sem remetentes nem leitores, todo registro reservado foi publicado
+            faixa_ler(f, pos, &reg, sizeof(reg));
+            if (registro_referencia(f, pos, &reg, &ref))
+                soltar_compartilhado(ref.payload);
         }
+    }
+}
 
-        /* registra o novo processo */
-        if (registrar_processo(pid, nome) < 0) {
-            printk(KERN_ERR "WRITE: falha ao alocar control_block para PID %d\n", current->pid);
-            return -ENOMEM;
-        }
+// Descarta uma mensagem de q, fila de cb, para abrir espaço a uma de prioridade prio
+// (MQ_OVERFLOW_OVERWRITE): a mais antiga da faixa menos prioritária que tiver uma, sem passar
+// de prio; com so_faixa (a faixa prio está cheia, não a fila), a mais antiga da própria faixa.
+// Remetentes que descartam se revezam em cb->lock. Retorna 1 se descartou, 0 se as faixas
+// permitidas estão vazias, ou -EAGAIN se o consumidor está ocupado (um leitor copiando, uma
+// migração) ou o registro a descartar ainda não foi publicado: o remetente não espera, e o
+// descarte fica pendente (reservar_registro).
+static int descartar_mais_antigo(control_block_t *cb, message_queue_t *q, int prio, bool so_faixa) {
+    registro_referencia_t ref;
+    registro_t reg;
+    faixa_t *f;
+    int p, ret = 0;
 
-        printk(KERN_INFO "WRITE: Registrado PID=%d, nome=\"%s\"\n", current->pid, nome);
-        return len;
+    spin_lock(&cb->lock);
+    if (!fila_tentar_consumir(q)) {
+        spin_unlock(&cb->lock);
+        return -EAGAIN;
     }
-    // /msg ==================================================================
-    else if (strncmp(cmd_buf, cmd_message, strlen(cmd_message)) == 0) {
-        n = sscanf(cmd_buf, "%s %7s %[^\n]", code, destino, buffer2);
-        header = strlen(code) + 1 /*espaço*/ + strlen(destino) + 1 /*espaço*/;
-        strncpy(buffer2,cmd_buf + header,strlen(cmd_buf) - header);
-        buffer2[strlen(cmd_buf) - header] = '\0';
+    for (p = so_faixa ? prio : 0; p <= prio && ret <= 0; p++) {
+        f = &q->faixas[p];
+        if (f->cauda != faixa_cabeca(f))
+            ret = fila_descartar(q, p, &reg, &ref) ? 1 : -EAGAIN;
+    }
+    fila_soltar(q);
+    spin_unlock(&cb->lock);
+    // Outro remetente pode ter adiado um descarte enquanto este segurava o consumidor
+    pagar_descartes(cb, q);
+    if (ret <= 0)
+        return ret;
+    contar_sobrescrita(cb, q, &reg, &ref);
+    return 1;
+}
 
-        cb_origem = buscar_control_block(current->pid);
-        if (!cb_origem) {
-            printk(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
-            return -EACCES;
-        }
-        printk(KERN_WARNING "WRITE: Eu Nome -%s.....\n", cb_origem->nome);
+// Contabiliza o descarte do registro reg da fila q de cb e solta sua referência ref, se houver
+static void contar_sobrescrita(control_block_t *cb, message_queue_t *q, const registro_t *reg, const registro_referencia_t *ref) {
+    if (ref->payload)
+        soltar_compartilhado(ref->payload);
+    trace_mq_overwrite(cb->nome, cb->id, reg->sender, ref->payload ? ref->size : reg->size, reg->seq, fila_ocupado(q), reg->ts);
+    atomic64_inc(&cb->stats.sobrescritas);
+    this_cpu_inc(mq_stats.sobrescritas);
+}
 
-        if (strlen(destino) == 0 || strlen(buffer2) == 0) {
-            printk(KERN_WARNING "WRITE: comando /msg mal \"%d\"formatado\"%s\" buffer \"%s\"\n", n, destino, buffer2);
-            return -EINVAL;
+// Aplica os descartes que remetentes adiaram em q, fila de cb, enquanto o consumidor estava
+// ocupado: descarta as mensagens mais antigas, das faixas menos prioritárias primeiro e sem
+// passar da faixa de quem adiou, até a fila voltar ao limite. Um registro ainda não publicado
+// interrompe os descartes, e o excesso sai com as próximas leituras. Só pelo dono do
+// consumidor.
+static void aplicar_descartes(control_block_t *cb, message_queue_t *q) {
+    registro_referencia_t ref;
+    registro_t reg;
+    faixa_t *f;
+    int p, d;
+
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        if (!atomic_xchg(&q->descartes_pendentes[p], 0))
+            continue;
+        for (d = 0; d <= p && fila_ocupado(q) > q->limite; d++) {
+            f = &q->faixas[d];
+            while (fila_ocupado(q) > q->limite && f->cauda != faixa_cabeca(f) &&
+                   fila_descartar(q, d, &reg, &ref))
+                contar_sobrescrita(cb, q, &reg, &ref);
+            if (f->cauda != faixa_cabeca(f) && fila_ocupado(q) > q->limite)
+                return; // registro ainda não publicado
         }
+    }
+}
 
-        cb_dest = buscar_control_block_por_nome(destino);
-        if (!cb_dest) {
-            printk(KERN_WARNING "WRITE: destinatário \"%s\" não encontrado\n", destino);
-            return -ENOENT;
-        }
-        
-        msg.size = strlen(buffer2) + 1;
-        msg.data = kmalloc(msg.size, GFP_KERNEL);
-        if (!msg.data) return -ENOMEM;
+// Aplica os descartes pendentes de q, fila de cb, se o consumidor está livre. Chamada por quem
+// adia um descarte, depois de contá-lo, e por quem solta o consumidor, depois de soltá-lo:
+// com a barreira entre os dois passos, um deles sempre enxerga o outro.
+static void pagar_descartes(control_block_t *cb, message_queue_t *q) {
+    smp_mb__after_atomic();
+    while (fila_descartes_pendentes(q) && fila_tentar_consumir(q)) {
+        aplicar_descartes(cb, q);
+        fila_soltar(q);
+        smp_mb__after_atomic();
+        if (wq_has_sleeper(&cb->escritores))
+            wake_up_interruptible(&cb->escritores);
+    }
+}
 
-        sender_len = strlen(cb_origem->nome) + 1;
-        msg.sender = kmalloc(sender_len, GFP_KERNEL);
-        if (!msg.sender) {
-            kfree(msg.data);
-            return -ENOMEM;
+// Reserva na faixa prio de q, fila de cb_dest, um registro para size bytes de payload e grava
+// seu cabeçalho, sem lock, cobrando extra bytes a mais do limite (ver fila_reservar). Com a
+// fila (ou a faixa) cheia, aplica a política de cb_dest: descarta mensagens antigas, as menos
+// prioritárias primeiro, ou retorna -ENOSPC (MQ_OVERFLOW_REJECT) ou -EAGAIN
+// (MQ_OVERFLOW_BLOCK, o chamador decide se dorme). Sobrescrever nunca espera: se o consumidor
+// está ocupado (um leitor copiando), o registro passa do limite da fila e o descarte fica
+// pendente para quem soltar o consumidor (pagar_descartes); se nem a faixa tem espaço, a
+// mensagem descartada é a nova, e retorna ENFILEIRAR_DESCARTADA. Retorna ENFILEIRAR_ANEL se a
+// fila passou para o modo mmap durante a reserva, ou ENFILEIRAR_SUBSTITUIDA se ela está sendo
+// trocada por outra (redimensionar_fila): a mensagem deve ser enfileirada de novo depois da
+// troca. *pos recebe a posição do registro, que o chamador publica com faixa_publicar.
+static int reservar_registro(control_block_t *cb_dest, message_queue_t *q, int prio, size_t size, u32 extra, const char *sender, u32 corr, u32 *pos) {
+    bool adiado = false, so_faixa;
+    int politica, ret;
+
+    if ((extra ?: size) > fila_max(q, 0))
+        return -EMSGSIZE;
+
+    while ((ret = fila_reservar(q, prio, size, extra, false, sender, corr, pos)) != 0) {
+        if (ret == -EMSGSIZE)
+            return ret; // não cabe na faixa nem vazia
+        politica = READ_ONCE(cb_dest->politica);
+        if (politica == MQ_OVERFLOW_REJECT)
+            return -ENOSPC;
+        if (politica == MQ_OVERFLOW_BLOCK)
+            return -EAGAIN;
+        so_faixa = ret == -ENOBUFS;
+        ret = descartar_mais_antigo(cb_dest, q, prio, so_faixa);
+        if (ret == 0)
+            return -ENOSPC; // só mensagens mais prioritárias ocupam a fila
+        if (ret < 0) {
+            // Durante uma migração o consumidor é dela, e depois dela q fica vazia
+            if (READ_ONCE(q->substituta))
+                return ENFILEIRAR_SUBSTITUIDA;
+            if (READ_ONCE(q->anel))
+                return ENFILEIRAR_ANEL;
+            if (so_faixa || fila_reservar(q, prio, size, extra, true, sender, corr, pos) != 0) {
+                atomic64_inc(&cb_dest->stats.sobrescritas);
+                this_cpu_inc(mq_stats.sobrescritas);
+                return ENFILEIRAR_DESCARTADA;
+            }
+            adiado = true;
+            break;
         }
+        printk_ratelimited(KERN_WARNING "WRITE: fila cheia, sobrescrevendo mensagem mais antiga de \"%s\"\n", cb_dest->nome);
+    }
+
+    // O cmpxchg da reserva é totalmente ordenado: ou comando_anel (redimensionar_fila) enxerga
+    // este registro, ou este remetente enxerga o anel (a substituta) e desiste do registro
+    // (um registro descartado não segura referência: extra volta ao limite aqui)
+    if (unlikely(READ_ONCE(q->anel))) {
+        atomic_sub(extra, &q->ocupado);
+        faixa_publicar(&q->faixas[prio], *pos, REGISTRO_DESCARTADO);
+        return ENFILEIRAR_ANEL;
+    }
+    if (unlikely(READ_ONCE(q->substituta))) {
+        atomic_sub(extra, &q->ocupado);
+        faixa_publicar(&q->faixas[prio], *pos, REGISTRO_DESCARTADO);
+        return ENFILEIRAR_SUBSTITUIDA;
+    }
+    if (adiado) {
+        atomic_inc(&q->descartes_pendentes[prio]);
+        pagar_descartes(cb_dest, q);
+    }
+    return 0;
+}
 
-        strncpy(msg.data, buffer2, msg.size);
-        strncpy(msg.sender, cb_origem->nome, sender_len);
+// Contabiliza uma mensagem de size bytes enfileirada em q, fila de cb
+static void contar_enfileirada(control_block_t *cb, message_queue_t *q, size_t size) {
+    u32 ocupado = fila_ocupado(q);
+    int pico = atomic_read(&cb->stats.pico);
+
+    atomic64_inc(&cb->stats.enfileiradas);
+    atomic64_add(size, &cb->stats.bytes_enfileirados);
+    // O pico só é escrito quando cresce, para não disputar a linha de cache a cada envio
+    while (ocupado > (u32)pico && !atomic_try_cmpxchg(&cb->stats.pico, &pico, ocupado))
+        ;
+    this_cpu_inc(mq_stats.enfileiradas);
+    this_cpu_add(mq_stats.bytes_enfileirados, size);
+}
+
+// Emite mq_enqueue para o registro em pos da faixa f, com uma mensagem de size bytes, na fila
+// de cb com ocupado bytes. Chamada antes de publicar o registro, enquanto só o remetente o
+// toca; o cabeçalho só é relido com o tracepoint ativo.
+static void rastrear_enfileirada(control_block_t *cb, faixa_t *f, u32 pos, size_t size, u32 ocupado) {
+    registro_t reg;
+
+    if (!trace_mq_enqueue_enabled())
+        return;
+    faixa_ler(f, pos, &reg, sizeof(reg));
+    trace_mq_enqueue(cb->nome, cb->id, reg.sender, size, reg.seq, ocupado, reg.ts);
+}
 
-        spin_lock(&cb_dest->lock);
-        q = cb_dest->queue;
+// Contabiliza um envio a cb que falhou com erro por fila cheia
+static void contar_recusada(control_block_t *cb, int erro) {
+    if (erro == -ENOSPC) {
+        atomic64_inc(&cb->stats.recusadas);
+        this_cpu_inc(mq_stats.recusadas);
+    } else if (erro == -EAGAIN) {
+        atomic64_inc(&cb->stats.bloqueios);
+        this_cpu_inc(mq_stats.bloqueios);
+    }
+}
 
-        if (q->state == FULL) {
-            q->rp = (q->rp + 1) % QUEUE_LEN;
-            printk(KERN_WARNING "WRITE: fila cheia, sobrescrevendo mensagem mais antiga de \"%s\"\n", destino);
+// Copia msg para a fila q de cb_dest. Deve ser chamada dentro de rcu_read_lock(), com q lido
+// de cb_dest->queue; o chamador acorda os leitores e continua dono do payload de msg. Um
+// payload compartilhado (por_referencia) não é copiado: a fila guarda uma referência a ele.
+// No anel de bytes não usa lock; o anel compartilhado (modo mmap) é escrito sob cb_dest->lock.
+// Se q foi trocada por outra, enfileira na fila atual; se a migração (comando_anel,
+// redimensionar_fila) ainda copia as mensagens, retorna -EAGAIN, e o chamador espera como com
+// a fila cheia. Retorna os erros de fila cheia de reservar_registro. O anel compartilhado
+// nunca é sobrescrito: cheio, dá -ENOSPC.
+static int enfileirar_na_fila(control_block_t *cb_dest, message_queue_t *q, const message_t *msg) {
+    bool referencia = por_referencia(msg);
+    registro_referencia_t ref;
+    message_queue_t *atual;
+    u32 pos, seq;
+    int ret;
+
+    if (!READ_ONCE(q->anel)) {
+        if (referencia)
+            ret = reservar_registro(cb_dest, q, msg->prio, sizeof(ref), msg->size, msg->sender, msg->corr, &pos);
+        else
+            ret = reservar_registro(cb_dest, q, msg->prio, msg->size, 0, msg->sender, msg->corr, &pos);
+        if (ret == ENFILEIRAR_DESCARTADA)
+            return 0;
+        if (ret == 0) {
+            faixa_t *f = &q->faixas[msg->prio];
+
+            if (referencia) {
+                ref.payload = msg->buf;
+                ref.size = msg->size;
+                kref_get(&compartilhado(msg->buf)->ref);
+                faixa_escrever(f, pos + sizeof(registro_t), &ref, sizeof(ref));
+            } else {
+                faixa_escrever(f, pos + sizeof(registro_t), payload(msg), msg->size);
+            }
+            rastrear_enfileirada(cb_dest, f, pos, msg->size, fila_ocupado(q));
+            faixa_publicar(f, pos, referencia ? REGISTRO_REFERENCIA : 0);
+            contar_enfileirada(cb_dest, q, msg->size);
+            return 0;
         }
+        if (ret != ENFILEIRAR_ANEL && ret != ENFILEIRAR_SUBSTITUIDA) {
+            contar_recusada(cb_dest, ret);
+            return ret;
+        }
+    }
 
-        q->messages[q->wp] = msg;
-        q->wp = (q->wp + 1) % QUEUE_LEN;
-        atualizar_estado_fila(q);
+    spin_lock(&cb_dest->lock);
+    atual = cb_dest->queue;
+    if (atual != q) {
         spin_unlock(&cb_dest->lock);
-
-        printk(KERN_INFO "WRITE: mensagem de \"%s\" para \"%s\" enfileirada\n", remetente, destino);
-        return len;
+        // Desregistrado entretanto, ou a fila foi trocada: a nova também só é liberada depois
+        // do rcu_read_lock() do chamador
+        return atual ? enfileirar_na_fila(cb_dest, atual, msg) : -ENOENT;
     }
-    else if (strncmp(cmd_buf, cmd_unregister, strlen(cmd_unregister)) == 0) {
-        if (!existe_pid) return -ENOENT;
-        remover_processo(pid);
-        printk(KERN_INFO "WRITE: Processo PID %d removido\n", pid);
-        return len;
+    if (q->migrando) {
+        spin_unlock(&cb_dest->lock);
+        contar_recusada(cb_dest, -EAGAIN);
+        return -EAGAIN;
     }
+    if (!q->anel) {
+        // A migração para o anel ou para outra fila desistiu: a fila continua no anel de bytes
+        spin_unlock(&cb_dest->lock);
+        return enfileirar_na_fila(cb_dest, q, msg);
+    }
+    // Modo mmap: a sequência avança mesmo se a mensagem for descartada, e a lacuna indica
+    // a perda ao leitor
+    seq = fila_proxima_seq(q);
+    ret = escrever_no_anel(q->anel, seq, msg);
+    if (ret == 0 && trace_mq_enqueue_enabled())
+        trace_mq_enqueue(cb_dest->nome, cb_dest->id, msg->sender, msg->size, seq,
+                         anel_pendentes(q->anel) * q->anel->slot_size, ktime_get_ns());
+    spin_unlock(&cb_dest->lock);
+    if (ret) {
+        contar_recusada(cb_dest, ret);
+        return ret;
+    }
+    contar_enfileirada(cb_dest, q, msg->size);
+    return 0;
+}
 
-    else if (strncmp(cmd_buf, cmd_all, strlen(cmd_all)) == 0) {
-        n = sscanf(cmd_buf, "%s %[^\n]", code, buffer2);
-        header = strlen(code) + 1 /*espaço*/;
-        strncpy(buffer2,cmd_buf + header,strlen(cmd_buf) - header);
-        buffer2[strlen(cmd_buf) - header] = '\0';
-
-        cb_origem = buscar_control_block(current->pid);
-        if (!cb_origem) {
-            printk(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
-            return -EACCES;
-        }
-
-        // Percorre a lista de processos registrados
-        spin_lock(&tabela_control_blocks.lock);
-        curr = tabela_control_blocks.head;
-        count = tabela_control_blocks.count;
-        enviados = 0;
-
-        while (count-- > 0 && curr) {
-            if (curr->pid != current->pid) {
-                message_t m;
-                m.size = msg_len;
-                m.data = kmalloc(msg_len, GFP_ATOMIC);
-                m.sender = kmalloc(sender_len, GFP_ATOMIC);
-
-                if (!m.data || !m.sender) {
-                    kfree(m.data);
-                    kfree(m.sender);
-                    curr = curr->next;
-                    continue;
-                }
-
-                strncpy(m.data, buffer2, strlen(buffer2));
-                strncpy(m.sender, cb_origem->nome, sender_len);
-
-                spin_lock(&curr->lock);
-                q = curr->queue;
-
-                if (q->state == FULL) {
-                    q->rp = (q->rp + 1) % QUEUE_LEN;
-                    printk(KERN_INFO "WRITE: fila cheia, sobrescrevendo em \"%s\"\n", curr->nome);
-                }
+// Função para copiar msg para a fila de cb_dest e acordar seus leitores. Retorna -ENOENT
+// se cb_dest foi desregistrado entretanto, ou os erros de fila cheia de enfileirar_na_fila.
+// Não dorme.
+static int enfileirar_mensagem(control_block_t *cb_dest, const message_t *msg) {
+    message_queue_t *q;
+    int ret;
+
+    rcu_read_lock();
+    q = rcu_dereference(cb_dest->queue);
+    ret = q ? enfileirar_na_fila(cb_dest, q, msg) : -ENOENT;
+    rcu_read_unlock();
+    if (ret == 0)
+        acordar_leitores(cb_dest);
+    return ret;
+}
 
-                q->messages[q->wp] = m;
-                q->wp = (q->wp + 1) % QUEUE_LEN;
-                atualizar_estado_fila(q);
-                spin_unlock(&curr->lock);
+// Como enfileirar_mensagem, mas dorme enquanto a fila de cb_dest estiver cheia sob
+// MQ_OVERFLOW_BLOCK, até um leitor liberar espaço, ou sendo migrada. Sobrescrever nunca
+// espera (reservar_registro). Deve ser chamada fora de rcu_read_lock(), com uma referência a
+// cb_dest. Retorna -ERESTARTSYS se interrompida por sinal.
+static int enfileirar_esperando(control_block_t *cb_dest, const message_t *msg) {
+    int ret;
+
+    for (;;) {
+        ret = enfileirar_mensagem(cb_dest, msg);
+        if (ret != -EAGAIN)
+            return ret;
+        ret = wait_event_interruptible(cb_dest->escritores,
+                                       por_referencia(msg) ? fila_com_espaco(cb_dest, msg->prio, sizeof(registro_referencia_t), msg->size)
+                                                           : fila_com_espaco(cb_dest, msg->prio, msg->size, 0));
+        if (ret)
+            return ret;
+    }
+}
 
-                enviados++;
-            }
-            curr = curr->next;
+// Enfileira na faixa prio de cb_dest (com referência do chamador) o que resta em dados, seguido
+// de um '\0' se terminador, com o id de correlação corr. O registro é reservado sem lock e o
+// payload copiado direto para o anel de bytes: remetentes concorrentes copiam em paralelo,
+// cada um no seu registro. Só para iteradores do kernel, cuja cópia não para em falta de
+// página (enviar_mensagem). Sob MQ_OVERFLOW_BLOCK dorme enquanto a fila estiver cheia (ou
+// -EAGAIN, se nonblock); sobrescrever nunca espera. Retorna ENFILEIRAR_ANEL, sem consumir
+// dados, se a fila está em modo mmap.
+static int enfileirar_do_iter(control_block_t *cb_dest, const char *sender, struct iov_iter *dados, int prio, u32 corr, bool terminador, bool nonblock) {
+    message_queue_t *q;
+    faixa_t *f;
+    size_t size = iov_iter_count(dados);
+    size_t total = size + terminador;
+    u32 pos;
+    int ret;
+
+    for (;;) {
+        q = obter_fila(cb_dest);
+        if (!q)
+            ret = -ENOENT;
+        else if (READ_ONCE(q->anel))
+            ret = ENFILEIRAR_ANEL;
+        else
+            ret = reservar_registro(cb_dest, q, prio, total, 0, sender, corr, &pos);
+        if (ret == 0)
+            break;
+        if (q)
+            kref_put(&q->ref, liberar_fila);
+        if (ret == ENFILEIRAR_DESCARTADA)
+            return 0;
+        if (ret == ENFILEIRAR_SUBSTITUIDA) {
+            // Já trocada: tenta na fila atual. Senão redimensionar_fila ainda copia as
+            // mensagens, e a espera é a da fila cheia (fila_com_espaco)
+            if (READ_ONCE(cb_dest->queue) != q)
+                continue;
+            ret = -EAGAIN;
         }
-        spin_unlock(&tabela_control_blocks.lock);
+        contar_recusada(cb_dest, ret);
 
-        printk(KERN_INFO "WRITE: mensagem de \"%s\" enviada a %d processos com /all\n", cb_origem->nome, enviados);
-        return len;
+        if (ret != -EAGAIN || nonblock)
+            return ret;
+        ret = wait_event_interruptible(cb_dest->escritores, fila_com_espaco(cb_dest, prio, total, 0));
+        if (ret)
+            return ret;
     }
 
+    // O registro reservado só é tocado por este remetente até ser publicado
+    f = &q->faixas[prio];
+    ret = faixa_de_iter(f, pos + sizeof(registro_t), dados, size);
+    if (ret == 0 && terminador)
+        faixa_escrever(f, pos + sizeof(registro_t) + size, "", 1);
+
+    if (ret == 0) {
+        rastrear_enfileirada(cb_dest, f, pos, total, fila_ocupado(q));
+        faixa_publicar(f, pos, 0);
+        contar_enfileirada(cb_dest, q, total);
+        acordar_leitores(cb_dest);
+    } else {
+        faixa_publicar(f, pos, REGISTRO_DESCARTADO);
+        // Nenhum leitor acorda por um registro descartado: se ninguém lê agora, o espaço é
+        // devolvido aqui, para não prender remetentes sob MQ_OVERFLOW_BLOCK
+        if (fila_tentar_consumir(q)) {
+            fila_recolher(q);
+            fila_soltar(q);
+            pagar_descartes(cb_dest, q);
+            if (wq_has_sleeper(&cb_dest->escritores))
+                wake_up_interruptible(&cb_dest->escritores);
+        }
+    }
+    kref_put(&q->ref, liberar_fila);
+    return ret;
+}
+
+// Função para enviar o que resta em dados, mais um '\0' se terminador, de cb_origem ao
+// processo "destino", ou ao endpoint destino_id quando destino é NULL, na faixa de prioridade
+// prio, marcado com corr se for uma chamada. Se a fila de destino estiver cheia sob
+// MQ_OVERFLOW_BLOCK, dorme até haver espaço (ou retorna -EAGAIN, se nonblock).
+static int enviar_mensagem(control_block_t *cb_origem, const char *destino, u32 destino_id, struct iov_iter *dados, int prio, u32 corr, bool terminador, bool nonblock) {
+    size_t size = iov_iter_count(dados);
+    control_block_t *cb_dest;
+    message_t msg;
+    int ret;
+
+    if (!READ_ONCE(cb_origem->queue)) {
+        printk_ratelimited(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
+        return -EACCES;
+    }
+    if (size == 0)
+        return -EINVAL;
+    if (size + terminador > MSG_MAX(cb_origem->inst))
+        return -EMSGSIZE;
+
+    // Busca sem o lock global; a referência mantém cb_dest vivo durante a cópia (que pode
+    // dormir) mesmo que o descritor de destino seja fechado
+    rcu_read_lock();
+    cb_dest = destino ? buscar_control_block_por_nome(cb_origem->inst, destino)
+                      : buscar_control_block_por_id(cb_origem->inst, destino_id);
+    if (cb_dest && !kref_get_unless_zero(&cb_dest->ref))
+        cb_dest = NULL;
+    rcu_read_unlock();
+
+    if (!cb_dest) {
+        if (destino)
+            printk_ratelimited(KERN_WARNING "WRITE: destinatário \"%s\" não encontrado\n", destino);
+        else
+            printk_ratelimited(KERN_WARNING "WRITE: destinatário id %u não encontrado\n", destino_id);
+        return -ENOENT;
+    }
+
+    // Dados do usuário passam antes por um buffer do kernel: uma falta de página demorada
+    // durante a cópia deixaria o registro reservado, e ainda não publicado, parando a faixa
+    // para o leitor. Iteradores do kernel (splice) vão direto para o registro.
+    ret = user_backed_iter(dados) ? ENFILEIRAR_ANEL
+                                  : enfileirar_do_iter(cb_dest, cb_origem->nome, dados, prio, corr, terminador, nonblock);
+    if (ret == ENFILEIRAR_ANEL) {
+        // O anel compartilhado (e a fila, para dados do usuário) recebe uma cópia montada no kernel
+        char *buf = alocar_payload(&msg, size + terminador, GFP_KERNEL);
+
+        ret = -ENOMEM;
+        if (buf) {
+            ret = -EFAULT;
+            if (copy_from_iter_full(buf, size, dados)) {
+                if (terminador)
+                    buf[size] = '\0';
+                memcpy(msg.sender, cb_origem->nome, NAME_SIZE);
+                msg.prio = prio;
+                msg.corr = corr;
+                ret = nonblock ? enfileirar_mensagem(cb_dest, &msg) : enfileirar_esperando(cb_dest, &msg);
+            }
+            liberar_payload(&msg);
+        }
+    }
+    kref_put(&cb_dest->ref, liberar_control_block);
+
+    if (ret == 0) {
+        if (destino)
+            pr_debug("WRITE: mensagem de \"%s\" para \"%s\" enfileirada\n", cb_origem->nome, destino);
+        else
+            pr_debug("WRITE: mensagem de \"%s\" para id %u enfileirada\n", cb_origem->nome, destino_id);
+    } else if (ret == -ENOSPC || ret == -EAGAIN) {
+        printk_ratelimited(KERN_WARNING "WRITE: fila de destino cheia, mensagem de \"%s\" recusada\n", cb_origem->nome);
+    }
+    return ret;
+}
+
+// Função para fazer uma chamada de cb_origem ao processo "destino" (ou ao endpoint destino_id):
+// enfileira a requisição em dados, marcada com um id de correlação novo, e dorme até
+// responder_chamada copiar a resposta para ch ou até timeout jiffies. Retorna 0 com a resposta
+// em ch, -EBUSY se o descritor já tem uma chamada pendente, -ETIMEDOUT, -EINTR (a requisição
+// já foi enviada, então a chamada não é reiniciada), -ENOENT se cb_origem foi desregistrado
+// durante a espera, ou os erros de enviar_mensagem.
+static int fazer_chamada(control_block_t *cb_origem, const char *destino, u32 destino_id, struct iov_iter *dados, int prio, long timeout, bool nonblock, chamada_t *ch) {
+    long ret;
+    int estado;
+
+    spin_lock(&cb_origem->lock);
+    if (cb_origem->chamada) {
+        spin_unlock(&cb_origem->lock);
+        return -EBUSY;
+    }
+    // Um id novo a cada chamada, nunca 0: a resposta atrasada de uma chamada que expirou não
+    // casa com a seguinte
+    ch->corr = ++cb_origem->ultima_corr;
+    if (ch->corr == 0)
+        ch->corr = ++cb_origem->ultima_corr;
+    ch->estado = CHAMADA_ESPERANDO;
+    ch->size = 0;
+    cb_origem->chamada = ch;
+    spin_unlock(&cb_origem->lock);
+
+    // A chamada é publicada antes do envio: a resposta pode chegar antes de enviar_mensagem retornar
+    ret = enviar_mensagem(cb_origem, destino, destino_id, dados, prio, ch->corr, false, nonblock);
+    if (ret == 0) {
+        ret = wait_event_interruptible_timeout(cb_origem->respostas,
+                  READ_ONCE(ch->estado) == CHAMADA_RESPONDIDA || !READ_ONCE(cb_origem->queue), timeout);
+        ret = ret > 0 ? 0 : (ret == 0 ? -ETIMEDOUT : -EINTR);
+    }
+
+    // Uma resposta já em cópia é entregue mesmo depois do prazo ou de um sinal
+    spin_lock(&cb_origem->lock);
+    while (ch->estado == CHAMADA_RESPONDENDO) {
+        spin_unlock(&cb_origem->lock);
+        wait_event(cb_origem->respostas, READ_ONCE(ch->estado) != CHAMADA_RESPONDENDO);
+        spin_lock(&cb_origem->lock);
+    }
+    cb_origem->chamada = NULL;
+    estado = ch->estado;
+    spin_unlock(&cb_origem->lock);
+
+    if (estado == CHAMADA_RESPONDIDA)
+        return 0;
+    return ret ? ret : -ENOENT;
+}
+
+// Função para responder, com o que resta em dados, à chamada corr pendente no processo
+// "destino" (ou no endpoint destino_id). A resposta é copiada direto para o buffer da chamada,
+// truncada à capacidade dele, sem passar pela fila do chamador. Retorna -ENOENT se o destino
+// não existe ou não tem a chamada corr à espera (expirou, foi interrompida ou já respondida).
+static int responder_chamada(control_block_t *cb_origem, const char *destino, u32 destino_id, u32 corr, struct iov_iter *dados) {
+    size_t size = iov_iter_count(dados);
+    control_block_t *cb_dest;
+    chamada_t *ch;
+    int ret;
+
+    if (!READ_ONCE(cb_origem->queue)) {
+        printk_ratelimited(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
+        return -EACCES;
+    }
+    if (size > MSG_MAX(cb_origem->inst))
+        return -EMSGSIZE;
+
+    rcu_read_lock();
+    cb_dest = destino ? buscar_control_block_por_nome(cb_origem->inst, destino)
+                      : buscar_control_block_por_id(cb_origem->inst, destino_id);
+    if (cb_dest && !kref_get_unless_zero(&cb_dest->ref))
+        cb_dest = NULL;
+    rcu_read_unlock();
+    if (!cb_dest)
+        return -ENOENT;
+
+    spin_lock(&cb_dest->lock);
+    ch = cb_dest->chamada;
+    if (!ch || ch->corr != corr || ch->estado != CHAMADA_ESPERANDO) {
+        spin_unlock(&cb_dest->lock);
+        kref_put(&cb_dest->ref, liberar_control_block);
+        return -ENOENT;
+    }
+    ch->estado = CHAMADA_RESPONDENDO;
+    spin_unlock(&cb_dest->lock);
+
+    // Em CHAMADA_RESPONDENDO o chamador espera: ch continua válida fora do lock
+    ret = 0;
+    if (!copy_from_iter_full(ch->buf, min(size, ch->resposta.size), dados))
+        ret = -EFAULT;
+
+    // Uma cópia que falhou devolve a chamada à espera de outra resposta
+    spin_lock(&cb_dest->lock);
+    ch->size = size;
+    ch->estado = ret ? CHAMADA_ESPERANDO : CHAMADA_RESPONDIDA;
+    spin_unlock(&cb_dest->lock);
+    wake_up(&cb_dest->respostas);
+    kref_put(&cb_dest->ref, liberar_control_block);
+
+    if (ret == 0)
+        pr_debug("WRITE: resposta %u de \"%s\" entregue a \"%s\"\n", corr, cb_origem->nome, cb_dest->nome);
+    return ret;
+}
+
+// Função para enviar msg a todos os processos registrados, exceto cb_origem. O payload é
+// montado uma vez no kernel, sem alocação por destinatário: copiado para cada fila ou, acima
+// de CMD_BUF_SIZE bytes, compartilhado por referência entre elas (enfileirar_na_fila).
+// O chamador continua dono de msg. Retorna o número de destinatários.
+// Destinatários cheios sob MQ_OVERFLOW_BLOCK são esperados depois do percurso (exceto com nonblock).
+static int enviar_para_todos(control_block_t *cb_origem, message_t *msg, bool nonblock) {
+    LIST_HEAD(pendentes);
+    control_block_t *curr;
+    int enviados;
+
+    if (!READ_ONCE(cb_origem->queue)) {
+        printk_ratelimited(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
+        return -EACCES;
+    }
+    memcpy(msg->sender, cb_origem->nome, NAME_SIZE);
+    enviados = 0;
+
+    // Percorre a lista de processos registrados sob RCU: registros e remoções concorrentes
+    // não bloqueiam o /all, e o /all não bloqueia os demais remetentes
+    rcu_read_lock();
+    list_for_each_entry_rcu(curr, &cb_origem->inst->control_blocks.lista, no_lista) {
+        if (curr != cb_origem)
+            enviados += entregar_no_percurso(curr, msg, nonblock, &pendentes);
+    }
+    rcu_read_unlock();
+
+    // Só então dorme pelos destinatários cheios
+    enviados += entregar_pendentes(&pendentes, msg);
+
+    trace_mq_broadcast(cb_origem->nome, msg->size, enviados);
+    pr_debug("WRITE: mensagem de \"%s\" enviada a %d processos com /all\n", cb_origem->nome, enviados);
+    return enviados;
+}
+
+// Função para publicar msg no tópico nome: só os assinantes do tópico (exceto cb_origem) são
+// visitados, percorrendo sob RCU a lista de assinaturas do tópico, então o custo cresce com o
+// número de interessados e não com o de registrados. O chamador continua dono de msg.
+// Retorna o número de destinatários (0 se o tópico não tem assinantes).
+static int publicar_topico(control_block_t *cb_origem, const char *nome, message_t *msg, bool nonblock) {
+    LIST_HEAD(pendentes);
+    assinatura_t *a;
+    topico_t *t;
+    int enviados;
+
+    if (!READ_ONCE(cb_origem->queue)) {
+        printk_ratelimited(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
+        return -EACCES;
+    }
+    memcpy(msg->sender, cb_origem->nome, NAME_SIZE);
+    enviados = 0;
+
+    rcu_read_lock();
+    t = buscar_topico(cb_origem->inst, nome);
+    if (t) {
+        list_for_each_entry_rcu(a, &t->assinantes, no_topico)
+            if (a->cb != cb_origem)
+                enviados += entregar_no_percurso(a->cb, msg, nonblock, &pendentes);
+    }
+    rcu_read_unlock();
+
+    enviados += entregar_pendentes(&pendentes, msg);
+
+    trace_mq_publish(nome, cb_origem->nome, msg->size, enviados);
+    pr_debug("WRITE: mensagem de \"%s\" publicada em \"%s\" para %d processos\n", cb_origem->nome, nome, enviados);
+    return enviados;
+}
+
+// Entrega msg a cb_dest durante um percurso RCU (/all, /pub). Com a fila cheia sob
+// MQ_OVERFLOW_BLOCK (e sem nonblock), guarda cb_dest em pendentes, com uma referência, para
+// entregar_pendentes. Retorna 1 se a mensagem foi entregue agora, 0 caso contrário.
+static int entregar_no_percurso(control_block_t *cb_dest, const message_t *msg, bool nonblock, struct list_head *pendentes) {
+    envio_pendente_t *p;
+    int ret;
+
+    ret = enfileirar_mensagem(cb_dest, msg);
+    if (ret == -EAGAIN && !nonblock) {
+        p = kmalloc(sizeof(envio_pendente_t), GFP_ATOMIC);
+        if (!p)
+            this_cpu_inc(mq_stats.falhas_alocacao);
+        if (p && kref_get_unless_zero(&cb_dest->ref)) {
+            p->cb = cb_dest;
+            list_add_tail(&p->no, pendentes);
+            return 0;
+        }
+        kfree(p);
+    }
+    return ret == 0;
+}
+
+// Entrega msg aos destinatários guardados em pendentes, dormindo até haver espaço em cada um,
+// e os solta. Deve ser chamada fora de rcu_read_lock(); um sinal cancela as entregas restantes.
+// Retorna o número de destinatários que receberam a mensagem.
+static int entregar_pendentes(struct list_head *pendentes, const message_t *msg) {
+    envio_pendente_t *p, *tmp;
+    bool interrompido = false;
+    int enviados = 0, ret;
+
+    list_for_each_entry_safe(p, tmp, pendentes, no) {
+        ret = interrompido ? -ERESTARTSYS : enfileirar_esperando(p->cb, msg);
+        if (ret == -ERESTARTSYS)
+            interrompido = true;
+        if (ret == 0)
+            enviados++;
+        kref_put(&p->cb->ref, liberar_control_block);
+        list_del(&p->no);
+        kfree(p);
+    }
+    return enviados;
+}
+
+// Função para entregar os n comandos de lote (MQ_IOC_SEND_BATCH) agrupados por destino: cada
+// fila é buscada uma única vez e seus leitores acordados uma vez, preservando a ordem entre as
+// mensagens para o mesmo destino. O chamador continua dono dos payloads. Destinos cheios
+// sob MQ_OVERFLOW_BLOCK recebem o restante do seu grupo depois, fora da seção RCU.
+// Retorna o número de mensagens entregues; *falha recebe o primeiro erro, se houver.
+static int enviar_lote(control_block_t *cb_origem, comando_lote_t *lote, int n, bool nonblock, int *falha) {
+    control_block_t *cb_dest;
+    message_queue_t *q;
+    int i, j, ret, entregues, no_grupo;
+    bool bloqueado, interrompido;
+
+    entregues = 0;
+    rcu_read_lock();
+    for (i = 0; i < n; i++)
+        lote[i].cb_dest = lote[i].destino[0] ? buscar_control_block_por_nome(cb_origem->inst, lote[i].destino)
+                                             : buscar_control_block_por_id(cb_origem->inst, lote[i].destino_id);
+
+    for (i = 0; i < n; i++) {
+        if (lote[i].feito)
+            continue; // entregue junto com o grupo de um comando anterior
+        cb_dest = lote[i].cb_dest;
+        if (!cb_dest) {
+            lote[i].feito = true;
+            if (!*falha)
+                *falha = -ENOENT;
+            continue;
+        }
+
+        no_grupo = 0;
+        bloqueado = false;
+        q = rcu_dereference(cb_dest->queue);
+        for (j = i; j < n; j++) {
+            if (lote[j].feito || lote[j].cb_dest != cb_dest)
+                continue;
+            lote[j].feito = true;
+            // Depois da primeira mensagem que esperaria, as seguintes esperam também (ordem)
+            ret = bloqueado ? -EAGAIN : q ? enfileirar_na_fila(cb_dest, q, &lote[j].msg) : -ENOENT;
+            if (ret == -EAGAIN && !nonblock) {
+                bloqueado = true;
+                if (kref_get_unless_zero(&cb_dest->ref)) {
+                    lote[j].esperar = true;
+                    continue;
+                }
+                ret = -ENOENT;
+            }
+            if (ret) {
+                if (!*falha)
+                    *falha = ret;
+                continue;
+            }
+            no_grupo++;
+        }
+        if (no_grupo)
+            acordar_leitores(cb_dest);
+        entregues += no_grupo;
+    }
+    rcu_read_unlock();
+
+    interrompido = false;
+    for (i = 0; i < n; i++) {
+        if (!lote[i].esperar)
+            continue;
+        ret = interrompido ? -ERESTARTSYS : enfileirar_esperando(lote[i].cb_dest, &lote[i].msg);
+        if (ret == -ERESTARTSYS)
+            interrompido = true;
+        if (ret) {
+            if (!*falha)
+                *falha = ret;
+        } else {
+            entregues++;
+        }
+        kref_put(&lote[i].cb_dest->ref, liberar_control_block);
+    }
+
+    pr_debug("WRITE: lote de \"%s\": %d de %d mensagens entregues\n", cb_origem->nome, entregues, n);
+    return entregues;
+}
+
+// Indica se q, fila de cb, está em modo mmap. Sem lock, q->anel pode ser o de uma migração
+// que ainda vai desistir (comando_anel); sob cb->lock fora de uma migração, ou para o dono do
+// consumidor, é definitivo.
+static bool fila_em_anel(control_block_t *cb, message_queue_t *q) {
+    bool ret;
+
+    if (!READ_ONCE(q->anel))
+        return false;
+    spin_lock(&cb->lock);
+    ret = q->anel && !q->migrando;
+    spin_unlock(&cb->lock);
+    return ret;
+}
+
+// Pega o consumidor de q, fila de cb, para uma leitura. Uma migração (comando_anel,
+// redimensionar_fila) o segura enquanto copia as mensagens, o que pode demorar: o leitor
+// dorme até ela terminar em vez de girar. Retorna 0 com o consumidor, RETIRAR_SUBSTITUIDA
+// depois de esperar uma migração (o chamador revalida a fila) ou um erro.
+static int consumir_para_leitura(control_block_t *cb, message_queue_t *q, bool nonblock) {
+    int ret;
+
+    while (!fila_tentar_consumir(q)) {
+        if (READ_ONCE(q->migrando)) {
+            if (nonblock)
+                return -EAGAIN;
+            ret = wait_event_interruptible(cb->leitores, !READ_ONCE(q->migrando) || READ_ONCE(cb->queue) != q);
+            return ret ? ret : RETIRAR_SUBSTITUIDA;
+        }
+        cpu_relax();
+    }
+    return 0;
+}
+
+// Espera ativa de uma leitura de cb (MQ_IOC_SET_BUSY_POLL): gira sobre q até haver mensagem ou
+// acabar o orçamento, sem dormir. O orçamento se adapta ao intervalo médio entre chegadas:
+// gira até o dobro dele, e nem gira se a média passa do dobro do orçamento (a próxima mensagem
+// provavelmente chega depois). Cede antes do fim se outra tarefa precisa da CPU ou chega um
+// sinal. Chamada com cb->leitura. Retorna true se mensagem_disponivel ficou verdadeira.
+static bool espera_ativa(control_block_t *cb, message_queue_t *q) {
+    u64 orcamento = (u64)READ_ONCE(cb->espera_ativa_us) * NSEC_PER_USEC;
+    u64 media = cb->intervalo_medio;
+    u64 inicio, agora;
+    bool ret = false;
+
+    if (orcamento == 0 || media > 2 * orcamento)
+        return false;
+    if (media)
+        orcamento = min(orcamento, 2 * media);
+
+    inicio = agora = ktime_get_ns();
+    while (agora - inicio < orcamento) {
+        if (mensagem_disponivel(cb, q)) {
+            ret = true;
+            break;
+        }
+        if (need_resched() || signal_pending(current))
+            break;
+        cpu_relax();
+        agora = ktime_get_ns();
+    }
+
+    atomic64_inc(&cb->stats.esperas_ativas);
+    this_cpu_inc(mq_stats.esperas_ativas);
+    this_cpu_add(mq_stats.espera_ativa_ns, ktime_get_ns() - inicio);
+    if (ret) {
+        atomic64_inc(&cb->stats.esperas_ativas_sucesso);
+        this_cpu_inc(mq_stats.esperas_ativas_sucesso);
+    }
+    return ret;
+}
+
+// Atualiza a média móvel (peso 1/8) do intervalo entre chegadas com ts, instante de
+// enfileiramento de um registro recém-lido. Registros fora de ordem (de faixas mais
+// prioritárias) só avançam a referência. Chamada com cb->leitura.
+static void registrar_chegada(control_block_t *cb, u64 ts) {
+    u64 intervalo;
+
+    if (ts <= cb->ultima_chegada)
+        return;
+    if (cb->ultima_chegada) {
+        intervalo = ts - cb->ultima_chegada;
+        cb->intervalo_medio = cb->intervalo_medio ?
+            cb->intervalo_medio - (cb->intervalo_medio >> 3) + (intervalo >> 3) : intervalo;
+    }
+    cb->ultima_chegada = ts;
+}
+
+// Espera haver mensagem em q, fila de cb, dormindo enquanto estiver vazia (a menos que
+// nonblock), depois de uma espera ativa se o descritor tem orçamento para ela. Retorna 0,
+// RETIRAR_ANEL se a fila está em modo mmap (a mensagem deve vir do anel), RETIRAR_SUBSTITUIDA
+// se ela foi trocada por outra (as mensagens pendentes foram para a nova) ou um erro.
+static int esperar_fila(control_block_t *cb, message_queue_t *q, bool nonblock) {
+    message_queue_t *atual;
+    bool girou = false;
+    int ret;
+
+    while (!fila_tem_mensagem(q)) {
+        if (fila_em_anel(cb, q))
+            return RETIRAR_ANEL;
+        atual = READ_ONCE(cb->queue);
+        if (atual != q)
+            return atual ? RETIRAR_SUBSTITUIDA : -ENOENT;
+        if (nonblock)
+            return -EAGAIN;
+        if (!girou) {
+            girou = true;
+            if (espera_ativa(cb, q))
+                continue;
+        }
+        // Dorme até um remetente enfileirar algo (/msg, /all ou /pub); -ERESTARTSYS se receber sinal
+        ret = wait_event_interruptible(cb->leitores, mensagem_disponivel(cb, q));
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+// Completa com zeros o quadro com len bytes de payload recém-copiado para para, até o início
+// do próximo (MQ_FRAME_NEXT) ou o fim do buffer. Retorna os bytes ocupados pelo quadro.
+static ssize_t completar_quadro(struct iov_iter *para, size_t len) {
+    static const char zeros[MQ_FRAME_ALIGN];
+    size_t resto = min_t(size_t, MQ_FRAME_NEXT(len) - sizeof(struct mq_frame) - len, iov_iter_count(para));
+
+    if (copy_to_iter(zeros, resto, para) != resto)
+        return -EFAULT;
+    return sizeof(struct mq_frame) + len + resto;
+}
+
+// Copia n bytes do payload do registro em pos na faixa f para para: do anel ou, se ref não é
+// NULL, do payload compartilhado que o registro referencia
+static int payload_para_iter(faixa_t *f, u32 pos, const registro_referencia_t *ref, struct iov_iter *para, size_t n) {
+    if (ref)
+        return copy_to_iter(ref->payload, n, para) != n ? -EFAULT : 0;
+    return faixa_para_iter(f, pos + sizeof(registro_t), para, n);
+}
+
+// Copia o registro reg, em pos na faixa prio de q, para para (até o espaço que resta nele):
+// só o payload ou, com quadro, um struct mq_frame seguido do payload. ref é a referência de
+// um registro REGISTRO_REFERENCIA, senão NULL. Retorna os bytes ocupados.
+static ssize_t copiar_registro(message_queue_t *q, int prio, u32 pos, const registro_t *reg, const registro_referencia_t *ref, struct iov_iter *para, bool quadro) {
+    faixa_t *f = &q->faixas[prio];
+    size_t espaco = iov_iter_count(para);
+    size_t size = ref ? ref->size : reg->size;
+    struct mq_frame cab;
+    size_t n;
+
+    if (!quadro) {
+        n = min_t(size_t, espaco, size);
+        return payload_para_iter(f, pos, ref, para, n) ? -EFAULT : n;
+    }
+
+    memset(&cab, 0, sizeof(cab));
+    cab.size = size;
+    cab.len = min_t(size_t, size, espaco - sizeof(cab));
+    cab.seq = reg->seq;
+    memcpy(cab.sender, reg->sender, NAME_SIZE);
+    cab.prio = prio;
+    cab.corr = reg->corr;
+    if (copy_to_iter(&cab, sizeof(cab), para) != sizeof(cab) ||
+        payload_para_iter(f, pos, ref, para, cab.len) != 0)
+        return -EFAULT;
+    return completar_quadro(para, cab.len);
+}
+
+// Função para receber da fila de cb, em para, a próxima mensagem (truncada ao espaço de para)
+// ou, com quadros (MQ_MODE_BATCH), quantas couberem, sempre da faixa mais prioritária
+// com mensagem. Não usa cb->lock: cb->leitura serializa os leitores do descritor, que
+// reservam, copiam e liberam os registros como dono do lado do consumidor da fila. Sem
+// quadros, *size, sender, *prio e *corr (se não NULL) recebem o tamanho real, o remetente, a
+// faixa e o id de correlação.
+// Retorna o número de bytes escritos em para.
+static ssize_t ler_fila(control_block_t *cb, bool nonblock, struct iov_iter *para, bool quadros, size_t *size, char *sender, u8 *prio, u32 *corr) {
+    size_t len = iov_iter_count(para);
+    message_queue_t *q;
+    faixa_t *f;
+    registro_referencia_t ref;
+    registro_t reg;
+    size_t usado, bytes;
+    ssize_t ret;
+    u32 pos, fim, retiradas, ocupado, cobrado, tamanho;
+    bool referencia;
+    u64 agora;
+    int p;
+
+    if (nonblock ? !mutex_trylock(&cb->leitura) : mutex_lock_interruptible(&cb->leitura))
+        return nonblock ? -EAGAIN : -ERESTARTSYS;
+
+    q = obter_fila(cb);
+    ret = q ? 0 : -ENOENT;
+    while (ret == 0) {
+        ret = esperar_fila(cb, q, nonblock);
+        if (ret == 0)
+            ret = consumir_para_leitura(cb, q, nonblock);
+        if (ret == RETIRAR_SUBSTITUIDA) {
+            kref_put(&q->ref, liberar_fila);
+            q = obter_fila(cb);
+            ret = q ? 0 : -ENOENT;
+            continue;
+        }
+        if (ret)
+            break;
+        if (READ_ONCE(q->anel)) {
+            fila_soltar(q);
+            ret = RETIRAR_ANEL;
+            break;
+        }
+        p = fila_escolher(q);
+        if (p >= 0) {
+            pos = q->faixas[p].cauda;
+            if (reservar_leitura(q, p, len, quadros, &fim) > 0)
+                break;
+            // Um remetente sobrescreveu a mensagem entretanto e só sobraram registros descartados
+            fila_liberar(q, p, fim);
+        }
+        fila_soltar(q);
+        pagar_descartes(cb, q);
+    }
+    if (ret) {
+        if (q)
+            kref_put(&q->ref, liberar_fila);
+        mutex_unlock(&cb->leitura);
+        if (ret != RETIRAR_ANEL)
+            return ret;
+        return retirar_do_anel(cb, nonblock, para, quadros, size, sender, prio, corr);
+    }
+    ocupado = fila_ocupado(q);
+    f = &q->faixas[p];
+
+    // [pos, fim) só é tocado por este leitor, e remetentes não o descartam enquanto ele é
+    // dono do consumidor: copy_to_user pode dormir
+    usado = bytes = 0;
+    retiradas = cobrado = 0;
+    agora = ktime_get_ns();
+    for (; pos != fim; pos += REGISTRO_TAMANHO(reg.size)) {
+        faixa_ler(f, pos, &reg, sizeof(reg));
+        if (reg.flags & REGISTRO_DESCARTADO)
+            continue;
+        referencia = registro_referencia(f, pos, &reg, &ref);
+        ret = copiar_registro(q, p, pos, &reg, referencia ? &ref : NULL, para, quadros);
+        if (ret < 0) {
+            printk_ratelimited(KERN_WARNING "READ: Falha ao copiar dados para espaço do usuário\n");
+            break;
+        }
+        tamanho = reg.size;
+        if (referencia) {
+            soltar_compartilhado(ref.payload);
+            tamanho = ref.size;
+            cobrado += ref.size;
+        }
+        usado += ret;
+        ret = 0;
+        retiradas++;
+        bytes += tamanho;
+        this_cpu_inc(mq_stats.latencia[min(fls64(agora - reg.ts), LATENCIA_FAIXAS - 1)]);
+        registrar_chegada(cb, reg.ts);
+        trace_mq_dequeue(cb->nome, cb->id, reg.sender, tamanho, reg.seq, ocupado, reg.ts, agora - reg.ts);
+        if (size)
+            *size = tamanho;
+        if (sender)
+            memcpy(sender, reg.sender, NAME_SIZE);
+        if (prio)
+            *prio = p;
+        if (corr)
+            *corr = reg.corr;
+    }
+
+    // Só sai da fila o que foi copiado (e os descartados entre as mensagens): depois de uma
+    // cópia que falhou, a mensagem e as seguintes continuam na fila para a próxima leitura
+    fila_liberar(q, p, pos);
+    atomic_sub(cobrado, &q->ocupado);
+    fila_soltar(q);
+    // Descartes que remetentes adiaram durante a cópia
+    pagar_descartes(cb, q);
+    atomic64_add(retiradas, &cb->stats.retiradas);
+    atomic64_add(bytes, &cb->stats.bytes_retirados);
+    this_cpu_add(mq_stats.retiradas, retiradas);
+    this_cpu_add(mq_stats.bytes_retirados, bytes);
+    if (wq_has_sleeper(&cb->escritores))
+        wake_up_interruptible(&cb->escritores);
+    kref_put(&q->ref, liberar_fila);
+    mutex_unlock(&cb->leitura);
+
+    // Um erro depois do primeiro quadro encerra o lote sem anulá-lo
+    return (ret < 0 && usado == 0) ? ret : usado;
+}
+
+// Função para receber a próxima mensagem de cb em para, da fila ou do anel.
+// Retorna o número de bytes copiados; *size recebe o tamanho real e sender, *prio e *corr (se
+// não NULL) o remetente, a prioridade e o id de correlação.
+static ssize_t receber_mensagem(control_block_t *cb, bool nonblock, struct iov_iter *para, size_t *size, char *sender, u8 *prio, u32 *corr) {
+    if (READ_ONCE(cb->modo_anel))
+        return retirar_do_anel(cb, nonblock, para, false, size, sender, prio, corr);
+    return ler_fila(cb, nonblock, para, false, size, sender, prio, corr);
+}
+
+// Leitura em modo lote (MQ_MODE_BATCH): preenche para com quantos quadros couberem, todos
+// reservados numa única aquisição do lock. Bloqueia (a menos que nonblock) só até a primeira
+// mensagem. No modo mmap o lote já está no próprio anel: cada leitura devolve um único quadro.
+// Retorna o número de bytes ocupados.
+static ssize_t receber_lote(control_block_t *cb, bool nonblock, struct iov_iter *para) {
+    if (iov_iter_count(para) < sizeof(struct mq_frame))
+        return -EINVAL;
+    if (READ_ONCE(cb->modo_anel))
+        return retirar_do_anel(cb, nonblock, para, true, NULL, NULL, NULL, NULL);
+    return ler_fila(cb, nonblock, para, true, NULL, NULL, NULL, NULL);
+}
+
+//=================================================================================================
+// Anel compartilhado (modo mmap): ver o protocolo em mq_ioctl.h
+
+// Cria um anel vazio com espaço para slots mensagens de até CMD_BUF_SIZE bytes
+static mq_anel_t* criar_anel(u32 slots) {
+    mq_anel_t *anel;
+    u32 slot_size;
+
+    anel = kzalloc(sizeof(mq_anel_t), GFP_KERNEL);
+    if (!anel)
+        return NULL;
+
+    slots = roundup_pow_of_two(slots);
+    slot_size = ALIGN(sizeof(struct mq_ring_slot) + CMD_BUF_SIZE, 64);
+    anel->tamanho = PAGE_ALIGN(sizeof(struct mq_ring_hdr) + (size_t)slots * slot_size);
+    anel->hdr = vmalloc_user(anel->tamanho); // zerado e mapeável no espaço do usuário
+    if (!anel->hdr) {
+        kfree(anel);
+        return NULL;
+    }
+    anel->slots = slots;
+    anel->slot_size = slot_size;
+    anel->hdr->slots = slots;
+    anel->hdr->slot_size = slot_size;
+    anel->hdr->data_offset = sizeof(struct mq_ring_hdr);
+    kref_init(&anel->ref);
+    return anel;
+}
+
+static void liberar_anel(struct kref *ref) {
+    mq_anel_t *anel = container_of(ref, mq_anel_t, ref);
+
+    vfree(anel->hdr);
+    kfree(anel);
+}
+
+static struct mq_ring_slot* anel_slot(mq_anel_t *anel, u32 pos) {
+    return (void *)anel->hdr + sizeof(struct mq_ring_hdr) + (size_t)(pos & (anel->slots - 1)) * anel->slot_size;
+}
+
+// Mensagens publicadas e ainda não consumidas. O tail é escrito pelo usuário e não é
+// confiável: um valor inconsistente faz o anel parecer cheio, nunca acessar fora dele.
+static u32 anel_pendentes(mq_anel_t *anel) {
+    u32 usados = READ_ONCE(anel->head) - READ_ONCE(anel->hdr->tail);
+    return min(usados, anel->slots);
+}
+
+// Devolve o próximo slot livre para um payload de size bytes, ou NULL (contando a mensagem
+// em hdr->dropped) se o anel está cheio ou o payload não cabe num slot.
+// Deve ser chamada com cb->lock adquirido; o slot é publicado com anel_publicar.
+static struct mq_ring_slot* anel_reservar_slot(mq_anel_t *anel, size_t size) {
+    if (anel_pendentes(anel) >= anel->slots || size > anel->slot_size - sizeof(struct mq_ring_slot)) {
+        anel->hdr->dropped++;
+        return NULL;
+    }
+    return anel_slot(anel, anel->head);
+}
+
+static void anel_publicar(mq_anel_t *anel) {
+    // O consumidor lê head com acquire: o conteúdo do slot fica visível antes do índice
+    anel->head++;
+    smp_store_release(&anel->hdr->head, anel->head);
+}
+
+// Copia msg para o próximo slot livre e o publica. Deve ser chamada com cb->lock adquirido.
+static int escrever_no_anel(mq_anel_t *anel, u32 seq, const message_t *msg) {
+    struct mq_ring_slot *slot;
+
+    slot = anel_reservar_slot(anel, msg->size);
+    if (!slot)
+        return anel_pendentes(anel) >= anel->slots ? -ENOSPC : -EMSGSIZE;
+
+    slot->size = msg->size;
+    slot->seq = seq;
+    slot->prio = msg->prio;
+    slot->corr = msg->corr;
+    memset(slot->sender, 0, sizeof(slot->sender));
+    strncpy(slot->sender, msg->sender, NAME_SIZE - 1);
+    memcpy(slot->data, payload(msg), msg->size);
+    anel_publicar(anel);
+    return 0;
+}
+
+// Retira a próxima mensagem do anel de cb copiando-a para para (read/MQ_IOC_RECV em modo mmap),
+// precedida de um struct mq_frame se quadro. O kernel nunca sobrescreve um slot não consumido,
+// então a cópia é feita fora do spinlock; cb->leitura serializa os leitores do próprio descritor.
+static ssize_t retirar_do_anel(control_block_t *cb, bool nonblock, struct iov_iter *para, bool quadro, size_t *size, char *sender, u8 *prio, u32 *corr) {
+    struct mq_ring_slot *slot;
+    struct mq_frame cab;
+    mq_anel_t *anel;
+    size_t tamanho, to_copy;
+    ssize_t ret;
+    u32 tail;
+
+    if (nonblock ? !mutex_trylock(&cb->leitura) : mutex_lock_interruptible(&cb->leitura))
+        return nonblock ? -EAGAIN : -ERESTARTSYS;
+
+    spin_lock(&cb->lock);
+    anel = cb->queue ? cb->queue->anel : NULL;
+    if (anel)
+        kref_get(&anel->ref);
+    spin_unlock(&cb->lock);
+    if (!anel) {
+        mutex_unlock(&cb->leitura);
+        return -ENOENT;
+    }
+
+    while (anel_pendentes(anel) == 0) {
+        ret = -ENOENT;
+        if (!READ_ONCE(cb->queue))
+            goto out;
+        ret = -EAGAIN;
+        if (nonblock)
+            goto out;
+        ret = wait_event_interruptible(cb->leitores, anel_pendentes(anel) != 0 || !READ_ONCE(cb->queue));
+        if (ret)
+            goto out;
+    }
+
+    tail = READ_ONCE(anel->hdr->tail);
+    slot = anel_slot(anel, tail);
+    tamanho = min_t(size_t, READ_ONCE(slot->size), anel->slot_size - sizeof(struct mq_ring_slot));
+    to_copy = min(iov_iter_count(para) - (quadro ? sizeof(cab) : 0), tamanho);
+
+    ret = -EFAULT;
+    if (quadro) {
+        memset(&cab, 0, sizeof(cab));
+        cab.size = tamanho;
+        cab.len = to_copy;
+        cab.seq = READ_ONCE(slot->seq);
+        memcpy(cab.sender, slot->sender, NAME_SIZE);
+        cab.sender[NAME_SIZE - 1] = '\0';
+        cab.prio = READ_ONCE(slot->prio) & MQ_PRIO_MASK;
+        cab.corr = READ_ONCE(slot->corr);
+        if (copy_to_iter(&cab, sizeof(cab), para) != sizeof(cab))
+            goto out;
+    }
+    if (copy_to_iter(slot->data, to_copy, para) != to_copy)
+        goto out;
+    ret = quadro ? completar_quadro(para, to_copy) : to_copy;
+    if (ret < 0)
+        goto out;
+    if (sender) {
+        memcpy(sender, slot->sender, NAME_SIZE);
+        sender[NAME_SIZE - 1] = '\0';
+    }
+    if (size)
+        *size = tamanho;
+    if (prio)
+        *prio = READ_ONCE(slot->prio) & MQ_PRIO_MASK;
+    if (corr)
+        *corr = READ_ONCE(slot->corr);
+    if (trace_mq_dequeue_enabled()) {
+        // O slot é gravável pelo usuário: o nome é copiado e terminado antes do evento
+        char remetente[NAME_SIZE];
+
+        memcpy(remetente, slot->sender, NAME_SIZE);
+        remetente[NAME_SIZE - 1] = '\0';
+        trace_mq_dequeue(cb->nome, cb->id, remetente, tamanho, READ_ONCE(slot->seq),
+                         anel_pendentes(anel) * anel->slot_size, 0, 0);
+    }
+    smp_store_release(&anel->hdr->tail, tail + 1);
+    this_cpu_inc(mq_stats.retiradas);
+    this_cpu_add(mq_stats.bytes_retirados, tamanho);
+out:
+    kref_put(&anel->ref, liberar_anel);
+    mutex_unlock(&cb->leitura);
+    return ret;
+}
+
+// Função para ativar o modo mmap de cb: cria o anel e migra para ele as mensagens pendentes,
+// das faixas mais prioritárias para as menos (o anel é FIFO). A cópia é feita fora de
+// cb->lock, como dono do consumidor e com q->migrando: remetentes e leitores esperam por ela
+// (enfileirar_na_fila, consumir_para_leitura), e o lock só anuncia e conclui a migração.
+// Retorna o tamanho a mapear.
+static long comando_anel(control_block_t *cb) {
+    struct mq_ring_slot *slot;
+    message_queue_t *q;
+    mq_anel_t *anel;
+    faixa_t *f;
+    registro_referencia_t ref;
+    registro_t reg;
+    long ret;
+    u32 pos, cabeca[FILA_FAIXAS], cobrado, tamanho;
+    bool referencia;
+    int p;
+
+    anel = criar_anel(READ_ONCE(cb->anel_slots) ?: READ_ONCE(cb->inst->anel_slots));
+    if (!anel)
+        return -ENOMEM;
+
+    // Uma migração por vez (MQ_IOC_SET_QUEUE também migra)
+    if (mutex_lock_interruptible(&cb->configuracao)) {
+        kref_put(&anel->ref, liberar_anel);
+        return -ERESTARTSYS;
+    }
+    spin_lock(&cb->lock);
+    q = cb->queue;
+    ret = !q ? -ENOENT : q->anel ? q->anel->tamanho : 0;
+    if (ret) {
+        spin_unlock(&cb->lock);
+        goto out;
+    }
+
+    // Uma leitura ou um remetente copiando para a fila impedem a migração por enquanto.
+    // Remetentes reservam sem lock: o anel é anunciado antes de ler cabeca, e quem reservar
+    // depois disso o enxerga, desiste do registro e espera a migração sob o lock
+    // (reservar_registro, enfileirar_na_fila). Se ela desiste, voltam ao anel de bytes.
+    if (!fila_tentar_consumir(q)) {
+        spin_unlock(&cb->lock);
+        ret = -EBUSY;
+        goto out;
+    }
+    kref_get(&q->ref); // um /unr durante a cópia não libera q
+    WRITE_ONCE(q->migrando, true);
+    WRITE_ONCE(q->anel, anel);
+    smp_mb();
+    spin_unlock(&cb->lock);
+
+    for (p = 0; p < FILA_FAIXAS; p++) {
+        f = &q->faixas[p];
+        cabeca[p] = faixa_cabeca(f);
+        for (pos = f->cauda; pos != cabeca[p]; pos += REGISTRO_TAMANHO(reg.size)) {
+            if (!faixa_ler_registro(f, pos, &reg)) {
+                spin_lock(&cb->lock);
+                WRITE_ONCE(q->anel, NULL);
+                WRITE_ONCE(q->migrando, false);
+                fila_soltar(q);
+                spin_unlock(&cb->lock);
+                wake_up_interruptible(&cb->leitores);
+                wake_up_interruptible(&cb->escritores);
+                acordar_recebimentos(cb, false);
+                kref_put(&q->ref, liberar_fila);
+                synchronize_rcu(); // dev_poll pode ter lido o anel anunciado
+                ret = -EBUSY;
+                goto out;
+            }
+        }
+    }
+
+    // Mensagens que não cabem no anel (slots ou tamanho) são contadas em hdr->dropped. Só
+    // esta cópia escreve no anel até o fim da migração.
+    for (p = FILA_FAIXAS - 1; p >= 0; p--) {
+        f = &q->faixas[p];
+        cobrado = 0;
+        for (pos = f->cauda; pos != cabeca[p]; pos += REGISTRO_TAMANHO(reg.size)) {
+            faixa_ler(f, pos, &reg, sizeof(reg));
+            if (reg.flags & REGISTRO_DESCARTADO)
+                continue;
+            referencia = registro_referencia(f, pos, &reg, &ref);
+            tamanho = referencia ? ref.size : reg.size;
+            slot = anel_reservar_slot(anel, tamanho);
+            if (slot) {
+                slot->size = tamanho;
+                slot->seq = reg.seq;
+                slot->prio = p;
+                slot->corr = reg.corr;
+                memcpy(slot->sender, reg.sender, NAME_SIZE);
+                if (referencia)
+                    memcpy(slot->data, ref.payload, tamanho);
+                else
+                    faixa_ler(f, pos + sizeof(registro_t), slot->data, tamanho);
+                anel_publicar(anel);
+            }
+            if (referencia) {
+                soltar_compartilhado(ref.payload);
+                cobrado += ref.size;
+            }
+        }
+        fila_liberar(q, p, cabeca[p]);
+        atomic_sub(cobrado, &q->ocupado);
+        cond_resched();
+    }
+    ret = anel->tamanho;
+
+    spin_lock(&cb->lock);
+    WRITE_ONCE(q->migrando, false);
+    if (cb->queue == q)
+        WRITE_ONCE(cb->modo_anel, true);
+    fila_soltar(q);
+    spin_unlock(&cb->lock);
+    mutex_unlock(&cb->configuracao);
+
+    // Leitores dormindo na fila comum passam a consumir do anel, e remetentes esperando
+    // espaço nela (ou a migração) passam a escrever no anel
+    wake_up_interruptible(&cb->leitores);
+    wake_up_interruptible(&cb->escritores);
+    acordar_recebimentos(cb, false);
+    kref_put(&q->ref, liberar_fila);
+    return ret;
+
+out:
+    mutex_unlock(&cb->configuracao);
+    kref_put(&anel->ref, liberar_anel);
+    return ret;
+}
+
+static void anel_vm_open(struct vm_area_struct *vma) {
+    mq_anel_t *anel = vma->vm_private_data;
+    kref_get(&anel->ref);
+}
+
+static void anel_vm_close(struct vm_area_struct *vma) {
+    mq_anel_t *anel = vma->vm_private_data;
+    kref_put(&anel->ref, liberar_anel);
+}
+
+// Cada mapeamento segura uma referência: o anel sobrevive ao /unr enquanto estiver mapeado
+static const struct vm_operations_struct anel_vm_ops = {
+    .open = anel_vm_open,
+    .close = anel_vm_close,
+};
+
+//=================================================================================================
+// Troca a fila registrada de cb por uma de bytes bytes, migrando para ela as mensagens
+// pendentes (MQ_IOC_SET_QUEUE). Remetentes reservam sem lock: a substituta é anunciada antes de
+// ler as cabeças, e quem reservar depois disso desiste do registro e espera a troca
+// (reservar_registro, fila_com_espaco). A cópia é feita fora de cb->lock, como dono do
+// consumidor e com q->migrando; o lock só a anuncia e troca o ponteiro. Uma leitura ou uma
+// cópia em andamento impedem a migração por enquanto: tenta de novo algumas vezes antes de
+// desistir com -EBUSY. Retorna -ENOSPC se as mensagens pendentes não cabem na nova fila, e
+// -EBUSY em modo mmap. Sob cb->configuracao.
+static int redimensionar_fila(control_block_t *cb, u32 bytes) {
+    message_queue_t *q, *nova;
+    bool trocada = false;
+    int ret, tentativa;
+
+    nova = kmalloc(sizeof(message_queue_t), GFP_KERNEL);
+    if (!nova || fila_iniciar(nova, bytes)) {
+        this_cpu_inc(mq_stats.falhas_alocacao);
+        kfree(nova);
+        return -ENOMEM;
+    }
+
+    for (tentativa = 0; tentativa < REDIMENSIONAR_TENTATIVAS; tentativa++) {
+        if (tentativa)
+            usleep_range(100, 200);
+        spin_lock(&cb->lock);
+        q = cb->queue;
+        if (!q || q->anel || q->limite == bytes) {
+            ret = !q ? -ENOENT : q->anel ? -EBUSY : 0;
+            spin_unlock(&cb->lock);
+            break;
+        }
+        if (!fila_tentar_consumir(q)) {
+            spin_unlock(&cb->lock);
+            ret = -EAGAIN;
+            continue;
+        }
+        kref_get(&q->ref); // um /unr durante a cópia não libera q
+        WRITE_ONCE(q->migrando, true);
+        WRITE_ONCE(q->substituta, nova);
+        smp_mb();
+        spin_unlock(&cb->lock);
+
+        aplicar_descartes(cb, q); // o excesso sobre o limite não vai para a nova fila
+        ret = fila_migrar(q, nova);
+
+        spin_lock(&cb->lock);
+        if (ret == 0 && cb->queue == q) {
+            rcu_assign_pointer(cb->queue, nova);
+            trocada = true;
+        } else {
+            if (ret == 0)
+                ret = -ENOENT; // desregistrado durante a cópia
+            WRITE_ONCE(q->substituta, NULL);
+        }
+        WRITE_ONCE(q->migrando, false);
+        fila_soltar(q);
+        spin_unlock(&cb->lock);
+
+        // Leitores e remetentes que esperavam a migração passam para a nova fila (ou
+        // voltam à antiga), e os que esperavam espaço reavaliam com o novo tamanho
+        wake_up_interruptible(&cb->leitores);
+        wake_up_interruptible(&cb->escritores);
+        acordar_recebimentos(cb, false);
+        kref_put(&q->ref, liberar_fila);
+        if (ret != -EAGAIN)
+            break;
+    }
+    if (!trocada) {
+        fila_destruir(nova);
+        kfree(nova);
+        return ret == -EAGAIN ? -EBUSY : ret;
+    }
+    printk(KERN_INFO "QUEUE: fila de \"%s\" trocada de %u para %u bytes\n", cb->nome, q->limite, bytes);
+
+    // A referência do registro passa à nova fila; a antiga é liberada ao fim das cópias que
+    // ainda a usam
+    kref_put(&q->ref, liberar_fila);
+    return 0;
+}
+
+// Define o tamanho da fila e os slots do anel compartilhado de cb (MQ_IOC_SET_QUEUE); 0 mantém
+// o valor atual. Antes do registro valem para o próximo /reg; depois, a fila registrada é
+// trocada sem perder mensagens. Os slots só valem para um anel ainda não criado. Sob
+// cb->configuracao, como o registro: o tamanho pedido só é gravado depois da troca, e um
+// registro concorrente vê o tamanho antigo ou a fila já trocada.
+static int definir_fila(control_block_t *cb, u32 bytes, u32 slots) {
+    mq_instancia_t *inst = cb->inst;
+    int ret;
+
+    if (bytes) {
+        ret = ajustar_fila_bytes(&bytes, READ_ONCE(inst->fila_bytes_max));
+        if (ret)
+            return ret;
+    }
+    if (slots) {
+        ret = ajustar_anel_slots(&slots, READ_ONCE(inst->anel_slots_max));
+        if (ret)
+            return ret;
+    }
+    if (mutex_lock_interruptible(&cb->configuracao))
+        return -ERESTARTSYS;
+    if (slots) {
+        spin_lock(&cb->lock);
+        ret = cb->queue && cb->queue->anel ? -EBUSY : 0;
+        if (ret == 0)
+            WRITE_ONCE(cb->anel_slots, slots);
+        spin_unlock(&cb->lock);
+        if (ret)
+            goto out;
+    }
+    ret = 0;
+    if (bytes) {
+        ret = READ_ONCE(cb->queue) ? redimensionar_fila(cb, bytes) : 0;
+        // Desregistrado entretanto: o tamanho fica para o próximo /reg
+        if (ret == -ENOENT)
+            ret = 0;
+        if (ret == 0)
+            WRITE_ONCE(cb->fila_bytes, bytes);
+    }
+out:
+    mutex_unlock(&cb->configuracao);
+    return ret;
+}
+
+// Função para registrar o descritor de cb, em nome do processo atual, sob "nome"
+static int comando_registrar(control_block_t *cb, const char *nome, u32 bytes) {
+    pid_t pid = current->pid;
+    int ret;
+
+    mutex_lock(&cb->configuracao);
+    ret = registrar_processo(cb, pid, nome, bytes);
+    mutex_unlock(&cb->configuracao);
+    if (ret < 0) {
+        printk(KERN_ERR "WRITE: falha ao registrar PID %d como \"%s\" (%d)\n", pid, nome, ret);
+        return ret;
+    }
+
+    printk(KERN_INFO "WRITE: Registrado PID=%d, nome=\"%s\", id=%u\n", pid, nome, cb->id);
+    return 0;
+}
+
+// Função para desregistrar o descritor de cb
+static int comando_remover(control_block_t *cb) {
+    int ret;
+
+    ret = remover_processo(cb);
+    // Um novo /reg reaproveita o mesmo control_block (nós da lista e da tabela hash):
+    // espera que nenhum leitor RCU ainda o esteja percorrendo pela posição antiga
+    if (ret == 0)
+        synchronize_rcu();
+    return ret;
+}
+
+// Função para assinar o tópico nome pelo endpoint cb. Tópico e assinatura são alocados antes
+// de entrar no lock do índice; o que não for usado é liberado aqui.
+static int comando_assinar(control_block_t *cb, const char *nome) {
+    topico_t *topico;
+    assinatura_t *a;
+    int ret;
+
+    topico = kmalloc(sizeof(topico_t), GFP_KERNEL);
+    a = kmalloc(sizeof(assinatura_t), GFP_KERNEL);
+    if (!topico || !a) {
+        this_cpu_inc(mq_stats.falhas_alocacao);
+        kfree(topico);
+        kfree(a);
+        return -ENOMEM;
+    }
+
+    ret = assinar_topico(cb, nome, &topico, &a);
+    kfree(topico);
+    kfree(a);
+    if (ret == -ENOENT)
+        printk_ratelimited(KERN_WARNING "WRITE: PID %d não registrado não pode assinar \"%s\"\n", current->pid, nome);
+    return ret;
+}
+
+//=================================================================================================
+// Cada descritor aberto é um endpoint: o control_block vive em filp->private_data
+// e o registro (/reg) associa a ele um nome e uma fila.
+static int dev_open(struct inode *inode, struct file *filp) {
+    control_block_t *cb;
+
+    if (iminor(inode) >= INSTANCES)
+        return -ENODEV;
+    cb = kzalloc(sizeof(control_block_t), GFP_KERNEL);
+    if (!cb)
+        return -ENOMEM;
+    spin_lock_init(&cb->lock);
+    init_waitqueue_head(&cb->leitores);
+    init_waitqueue_head(&cb->escritores);
+    init_waitqueue_head(&cb->respostas);
+    mutex_init(&cb->leitura);
+    mutex_init(&cb->configuracao);
+    kref_init(&cb->ref);
+    INIT_LIST_HEAD(&cb->assinaturas);
+    INIT_LIST_HEAD(&cb->recebimentos);
+    cb->inst = &instancias[iminor(inode)];
+    cb->politica = cb->inst->politica;
+    cb->espera_ativa_us = BUSY_POLL_US;
+    filp->private_data = cb;
+    // read_iter e write_iter respeitam IOCB_NOWAIT: o io_uring tenta sem dormir e, com a fila
+    // vazia, espera por poll em vez de ocupar um worker
+    filp->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+// Fechar o descritor (inclusive na morte do processo) desregistra o endpoint
+static int dev_release(struct inode *inode, struct file *filp) {
+    control_block_t *cb = filp->private_data;
+
+    remover_processo(cb);
+    kref_put(&cb->ref, liberar_control_block);
+    return 0;
+}
+// Indica se a operação não pode dormir: descritor com O_NONBLOCK ou requisição IOCB_NOWAIT
+static bool iocb_nonblock(struct kiocb *iocb) {
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// Lê (e remove) a próxima mensagem da fila do processo, ou um lote delas em MQ_MODE_BATCH.
+// Bloqueia até chegar uma mensagem, a menos que o descritor tenha sido aberto com O_NONBLOCK.
+// Serve read, readv e splice (o payload é copiado do anel de bytes direto para as páginas
+// do pipe).
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *para) {
+    control_block_t *cb = iocb->ki_filp->private_data;
 
-    printk(KERN_WARNING "WRITE: comando inválido (aguardando /reg, /unr ou /msg)\n");
+    if (READ_ONCE(cb->modo) & MQ_MODE_BATCH)
+        return receber_lote(cb, iocb_nonblock(iocb), para);
+    return receber_mensagem(cb, iocb_nonblock(iocb), para, NULL, NULL, NULL, NULL);
+}
+
+// Suporte a poll/select/epoll: legível quando há mensagem na fila (ou no anel) do descritor
+static __poll_t dev_poll(struct file *filp, poll_table *wait) {
+    control_block_t *cb = filp->private_data;
+    message_queue_t *q;
+    mq_anel_t *anel;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &cb->leitores, wait);
+
+    rcu_read_lock();
+    q = rcu_dereference(cb->queue);
+    anel = q ? READ_ONCE(q->anel) : NULL;
+    if (!q)
+        mask |= EPOLLERR;
+    else if (anel ? anel_pendentes(anel) != 0 : fila_tem_mensagem(q))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    rcu_read_unlock();
+    return mask;
+}
+
+// Mapeia o anel compartilhado do descritor (criado antes com MQ_IOC_RING)
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma) {
+    control_block_t *cb = filp->private_data;
+    mq_anel_t *anel;
+    int ret;
+
+    // Um anel ainda em migração (MQ_IOC_RING em andamento) pode ser desfeito
+    spin_lock(&cb->lock);
+    anel = cb->queue && !cb->queue->migrando ? cb->queue->anel : NULL;
+    if (anel)
+        kref_get(&anel->ref);
+    spin_unlock(&cb->lock);
+    if (!anel)
+        return -ENODEV;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != anel->tamanho) {
+        kref_put(&anel->ref, liberar_anel);
+        return -EINVAL;
+    }
+    ret = remap_vmalloc_range(vma, anel->hdr, 0);
+    if (ret) {
+        kref_put(&anel->ref, liberar_anel);
+        return ret;
+    }
+    // A referência obtida acima passa a ser do mapeamento (liberada em anel_vm_close)
+    vma->vm_private_data = anel;
+    vma->vm_ops = &anel_vm_ops;
+    return 0;
+}
+
+// Executa o comando texto em de (um write, um iovec de writev ou um splice), consumindo o
+// payload direto de de. Retorna o tamanho do comando ou um erro.
+static ssize_t escrever_comando(control_block_t *cb_origem, struct iov_iter *de, bool nonblock)
+{
+    const char *cmd_register, *cmd_unregister, *cmd_message, *cmd_all;
+    const char *cmd_subscribe, *cmd_unsubscribe, *cmd_publish;
+    char cmd_buf[CMD_CABECALHO];
+    char destino[NAME_SIZE];
+    char topico[TOPICO_SIZE];
+    char nome[NAME_SIZE];
+    char code[5];
+    size_t len = iov_iter_count(de);
+    struct iov_iter cabecalho;
+    size_t to_copy, header;
+    message_t msg;
+    char *dados;
+    u32 bytes;
+    int n, ret;
+
+    memset(destino, 0, sizeof(destino));
+    memset(code, 0, sizeof(code));
+    memset(nome, 0, sizeof(nome));
+    memset(topico, 0, sizeof(topico));
+
+    // Só o início do comando passa pela pilha (lido de uma cópia do iterador); o payload é
+    // lido direto de de
+    to_copy = min(len, sizeof(cmd_buf) - 1);
+    cabecalho = *de;
+
+    if (copy_from_iter(cmd_buf, to_copy, &cabecalho) != to_copy) return -EFAULT;
+
+    cmd_buf[to_copy] = '\0';
+
+    cmd_register = "/reg ";
+    cmd_unregister = "/unr";
+    cmd_message = "/msg ";
+    cmd_all = "/all ";
+    cmd_subscribe = "/sub ";
+    cmd_unsubscribe = "/uns ";
+    cmd_publish = "/pub ";
+
+    if (strncmp(cmd_buf, cmd_register, strlen(cmd_register)) == 0) {
+        // /reg nome bytes pede uma fila de bytes bytes em vez da padrão da instância
+        n = sscanf(cmd_buf, "%4s %7s %u", code, nome, &bytes);
+        if (n == 3) {
+            ret = ajustar_fila_bytes(&bytes, READ_ONCE(cb_origem->inst->fila_bytes_max));
+            if (ret)
+                return ret;
+        } else {
+            bytes = 0;
+        }
+        ret = comando_registrar(cb_origem, nome, bytes);
+        return ret < 0 ? ret : len;
+    }
+    // /msg ==================================================================
+    else if (strncmp(cmd_buf, cmd_message, strlen(cmd_message)) == 0) {
+        n = sscanf(cmd_buf, "%4s %7s", code, destino);
+        header = strlen(code) + 1 /*espaço*/ + strlen(destino) + 1 /*espaço*/;
+
+        // Como em /pub: um nome longo demais seria cortado pelo sscanf e o resto viraria payload
+        if (n != 2 || len <= header || cmd_buf[header - 1] != ' ') {
+            printk(KERN_WARNING "WRITE: comando /msg mal \"%d\"formatado\"%s\"\n", n, destino);
+            return -EINVAL;
+        }
+
+        iov_iter_advance(de, header);
+        ret = enviar_mensagem(cb_origem, destino, 0, de, READ_ONCE(cb_origem->prioridade), 0, true, nonblock);
+        return ret < 0 ? ret : len;
+    }
+    else if (strncmp(cmd_buf, cmd_unregister, strlen(cmd_unregister)) == 0) {
+        ret = comando_remover(cb_origem);
+        return ret < 0 ? ret : len;
+    }
+
+    else if (strncmp(cmd_buf, cmd_all, strlen(cmd_all)) == 0) {
+        header = strlen(cmd_all);
+        if (len - header + 1 > MSG_MAX(cb_origem->inst))
+            return -EMSGSIZE;
+
+        // Montado uma vez no kernel e copiado (ou referenciado) em cada fila
+        dados = alocar_payload(&msg, len - header + 1, GFP_KERNEL);
+        if (!dados) return -ENOMEM;
+        iov_iter_advance(de, header);
+        if (!copy_from_iter_full(dados, len - header, de)) {
+            liberar_payload(&msg);
+            return -EFAULT;
+        }
+        dados[len - header] = '\0';
+        msg.prio = READ_ONCE(cb_origem->prioridade);
+
+        ret = enviar_para_todos(cb_origem, &msg, nonblock);
+        liberar_payload(&msg);
+        return ret < 0 ? ret : len;
+    }
+    // /sub e /uns ===========================================================
+    else if (strncmp(cmd_buf, cmd_subscribe, strlen(cmd_subscribe)) == 0 ||
+             strncmp(cmd_buf, cmd_unsubscribe, strlen(cmd_unsubscribe)) == 0) {
+        n = sscanf(cmd_buf, "%4s %31s", code, topico);
+        if (n != 2) {
+            printk(KERN_WARNING "WRITE: comando %s sem tópico\n", code);
+            return -EINVAL;
+        }
+        if (strcmp(code, "/sub") == 0)
+            ret = comando_assinar(cb_origem, topico);
+        else
+            ret = cancelar_assinatura(cb_origem, topico);
+        return ret < 0 ? ret : len;
+    }
+    // /pub ==================================================================
+    else if (strncmp(cmd_buf, cmd_publish, strlen(cmd_publish)) == 0) {
+        n = sscanf(cmd_buf, "%4s %31s", code, topico);
+        header = strlen(code) + 1 /*espaço*/ + strlen(topico) + 1 /*espaço*/;
+
+        // Um tópico longo demais seria cortado pelo sscanf e o resto viraria payload
+        if (n != 2 || len <= header || cmd_buf[header - 1] != ' ') {
+            printk(KERN_WARNING "WRITE: comando /pub mal formatado\n");
+            return -EINVAL;
+        }
+        if (len - header + 1 > MSG_MAX(cb_origem->inst))
+            return -EMSGSIZE;
+
+        dados = alocar_payload(&msg, len - header + 1, GFP_KERNEL);
+        if (!dados) return -ENOMEM;
+        iov_iter_advance(de, header);
+        if (!copy_from_iter_full(dados, len - header, de)) {
+            liberar_payload(&msg);
+            return -EFAULT;
+        }
+        dados[len - header] = '\0';
+        msg.prio = READ_ONCE(cb_origem->prioridade);
+
+        ret = publicar_topico(cb_origem, topico, &msg, nonblock);
+        liberar_payload(&msg);
+        return ret < 0 ? ret : len;
+    }
+
+
+    printk(KERN_WARNING "WRITE: comando inválido (aguardando /reg, /unr, /msg, /all, /sub, /uns ou /pub)\n");
     return -EINVAL;
 }
+
+// Escreve comandos do protocolo texto. Cada iovec de um writev é um comando, como cada write;
+// um iterador de páginas (splice de um pipe) é um único comando, cujo payload vai das páginas
+// do pipe direto para a fila de destino.
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *de) {
+    control_block_t *cb = iocb->ki_filp->private_data;
+    struct iov_iter comando;
+    size_t len, escritos = 0;
+    ssize_t ret = 0;
+
+    while (iov_iter_count(de)) {
+        len = iter_is_iovec(de) ? iov_iter_single_seg_count(de) : iov_iter_count(de);
+        comando = *de;
+        iov_iter_truncate(&comando, len);
+        ret = escrever_comando(cb, &comando, iocb_nonblock(iocb));
+        if (ret < 0)
+            break;
+        iov_iter_advance(de, len);
+        escritos += len;
+    }
+    return escritos ? escritos : ret;
+}
+
+//======================================================================================
+// Interface binária (ioctl): mesmos comandos do protocolo texto, sem parsing
+
+// Copia um nome do espaço do usuário (ptr + len, sem '\0') para nome[tamanho]
+static int copiar_nome_usuario(char *nome, size_t tamanho, __u64 ptr, __u32 len) {
+    if (len == 0 || len > tamanho - 1)
+        return -EINVAL;
+    if (copy_from_user(nome, u64_to_user_ptr(ptr), len) != 0)
+        return -EFAULT;
+    nome[len] = '\0';
+    if (strlen(nome) != len) // '\0' embutido no nome
+        return -EINVAL;
+    return 0;
+}
+
+// Copia o payload do usuário direto para msg (inline ou buffer alocado), sem passar pela pilha
+static int copiar_dados_usuario(mq_instancia_t *inst, message_t *msg, __u64 ptr, __u32 len) {
+    char *buf;
+
+    if (len == 0)
+        return -EINVAL;
+    if (len > MSG_MAX(inst))
+        return -EMSGSIZE;
+    buf = alocar_payload(msg, len, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    if (copy_from_user(buf, u64_to_user_ptr(ptr), len) != 0) {
+        liberar_payload(msg);
+        return -EFAULT;
+    }
+    return 0;
+}
+
+static long ioctl_registrar(struct file *filp, struct mq_reg_args __user *uargs) {
+    control_block_t *cb = filp->private_data;
+    struct mq_reg_args args;
+    char nome[NAME_SIZE];
+    int ret;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags)
+        return -EINVAL;
+    ret = copiar_nome_usuario(nome, NAME_SIZE, args.nome, args.nome_len);
+    if (ret)
+        return ret;
+    ret = comando_registrar(cb, nome, 0);
+    return ret ? ret : cb->id;
+}
+
+static long ioctl_enviar(struct file *filp, struct mq_send_args __user *uargs, bool nonblock) {
+    struct mq_send_args args;
+    struct iov_iter dados;
+    struct iovec iov;
+    char destino[NAME_SIZE];
+    int ret;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags & ~MQ_PRIO_MASK)
+        return -EINVAL;
+
+    // Sem nome (dest_len == 0), o destino é dado pelo id do endpoint
+    if (args.dest_len) {
+        ret = copiar_nome_usuario(destino, NAME_SIZE, args.dest, args.dest_len);
+        if (ret)
+            return ret;
+    }
+    // O payload vai direto do buffer do usuário para a fila de destino
+    ret = import_single_range(WRITE, u64_to_user_ptr(args.buf), args.len, &iov, &dados);
+    if (ret)
+        return ret;
+    return enviar_mensagem(filp->private_data, args.dest_len ? destino : NULL, args.dest_id,
+                           &dados, args.flags & MQ_PRIO_MASK, 0, false, nonblock);
+}
+
+static long ioctl_enviar_todos(struct file *filp, struct mq_all_args __user *uargs, bool nonblock) {
+    control_block_t *cb = filp->private_data;
+    struct mq_all_args args;
+    message_t msg;
+    int enviados;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags & ~MQ_PRIO_MASK)
+        return -EINVAL;
+
+    enviados = copiar_dados_usuario(cb->inst, &msg, args.buf, args.len);
+    if (enviados)
+        return enviados;
+    msg.prio = args.flags & MQ_PRIO_MASK;
+
+    enviados = enviar_para_todos(cb, &msg, nonblock);
+    liberar_payload(&msg);
+    return enviados;
+}
+
+// MQ_IOC_SUB e MQ_IOC_UNSUB
+static long ioctl_assinatura(struct file *filp, struct mq_topic_args __user *uargs, bool assinar) {
+    struct mq_topic_args args;
+    char topico[TOPICO_SIZE];
+    int ret;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags)
+        return -EINVAL;
+    ret = copiar_nome_usuario(topico, TOPICO_SIZE, args.nome, args.nome_len);
+    if (ret)
+        return ret;
+    return assinar ? comando_assinar(filp->private_data, topico)
+                   : cancelar_assinatura(filp->private_data, topico);
+}
+
+static long ioctl_publicar(struct file *filp, struct mq_pub_args __user *uargs, bool nonblock) {
+    control_block_t *cb = filp->private_data;
+    struct mq_pub_args args;
+    char topico[TOPICO_SIZE];
+    message_t msg;
+    int enviados;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if ((args.flags & ~MQ_PRIO_MASK) || args.reserved)
+        return -EINVAL;
+    enviados = copiar_nome_usuario(topico, TOPICO_SIZE, args.topico, args.topico_len);
+    if (enviados)
+        return enviados;
+
+    enviados = copiar_dados_usuario(cb->inst, &msg, args.buf, args.len);
+    if (enviados)
+        return enviados;
+    msg.prio = args.flags & MQ_PRIO_MASK;
+
+    enviados = publicar_topico(cb, topico, &msg, nonblock);
+    liberar_payload(&msg);
+    return enviados;
+}
+
+// Copia o comando ucmd de um lote para cmd, pronto para enviar_lote
+static int preparar_comando_lote(control_block_t *cb_origem, comando_lote_t *cmd, struct mq_send_args __user *ucmd) {
+    struct mq_send_args args;
+    int ret;
+
+    if (copy_from_user(&args, ucmd, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags & ~MQ_PRIO_MASK)
+        return -EINVAL;
+
+    cmd->destino[0] = '\0';
+    if (args.dest_len) {
+        ret = copiar_nome_usuario(cmd->destino, NAME_SIZE, args.dest, args.dest_len);
+        if (ret)
+            return ret;
+    }
+    cmd->destino_id = args.dest_id;
+    ret = copiar_dados_usuario(cb_origem->inst, &cmd->msg, args.buf, args.len);
+    if (ret)
+        return ret;
+    memcpy(cmd->msg.sender, cb_origem->nome, NAME_SIZE);
+    cmd->msg.prio = args.flags & MQ_PRIO_MASK;
+    cmd->cb_dest = NULL;
+    cmd->feito = false;
+    cmd->esperar = false;
+    return 0;
+}
+
+// Envia um vetor de comandos em trechos de LOTE_MAX: cada trecho é copiado do usuário
+// (o que pode dormir) antes de qualquer lock e então entregue por enviar_lote.
+// Um comando inválido encerra o lote; destinos inexistentes só descartam suas mensagens.
+static long ioctl_enviar_lote(struct file *filp, struct mq_batch_args __user *uargs, bool nonblock) {
+    control_block_t *cb = filp->private_data;
+    struct mq_send_args __user *ucmds;
+    struct mq_batch_args args;
+    comando_lote_t *lote;
+    int erro, falha, n, i;
+    long entregues;
+    u32 base;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags)
+        return -EINVAL;
+    if (!READ_ONCE(cb->queue)) {
+        printk_ratelimited(KERN_WARNING "WRITE: remetente PID %d não registrado\n", current->pid);
+        return -EACCES;
+    }
+
+    lote = kmalloc_array(LOTE_MAX, sizeof(comando_lote_t), GFP_KERNEL);
+    if (!lote)
+        return -ENOMEM;
+
+    ucmds = u64_to_user_ptr(args.cmds);
+    entregues = 0;
+    erro = 0;
+    falha = 0;
+    for (base = 0; base < args.count && !erro; base += n) {
+        for (n = 0; n < LOTE_MAX && base + n < args.count; n++) {
+            erro = preparar_comando_lote(cb, &lote[n], &ucmds[base + n]);
+            if (erro)
+                break;
+        }
+        entregues += enviar_lote(cb, lote, n, nonblock, &falha);
+        for (i = 0; i < n; i++)
+            liberar_payload(&lote[i].msg);
+    }
+    kfree(lote);
+
+    if (entregues)
+        return entregues;
+    return erro ? erro : falha;
+}
+
+// Define os bits MQ_MODE_* do descritor
+static long ioctl_definir_modo(struct file *filp, unsigned long modo) {
+    control_block_t *cb = filp->private_data;
+
+    if (modo & ~(unsigned long)MQ_MODE_BATCH)
+        return -EINVAL;
+    WRITE_ONCE(cb->modo, modo);
+    return 0;
+}
+
+// Define a política de fila cheia do descritor (MQ_OVERFLOW_*)
+static long ioctl_definir_politica(struct file *filp, unsigned long politica) {
+    control_block_t *cb = filp->private_data;
+
+    if (politica > MQ_OVERFLOW_BLOCK)
+        return -EINVAL;
+    spin_lock(&cb->lock);
+    WRITE_ONCE(cb->politica, politica);
+    spin_unlock(&cb->lock);
+    // Remetentes esperando espaço reavaliam a nova política
+    wake_up_interruptible(&cb->escritores);
+    return 0;
+}
+
+// Define a prioridade das mensagens enviadas pelo protocolo texto do descritor
+static long ioctl_definir_prioridade(struct file *filp, unsigned long prio) {
+    control_block_t *cb = filp->private_data;
+
+    if (prio >= MQ_PRIO_LEVELS)
+        return -EINVAL;
+    WRITE_ONCE(cb->prioridade, prio);
+    return 0;
+}
+
+// Define o orçamento de espera ativa das leituras do descritor, em µs (0 desativa)
+static long ioctl_definir_espera_ativa(struct file *filp, unsigned long us) {
+    control_block_t *cb = filp->private_data;
+
+    if (us > MQ_BUSY_POLL_MAX_US)
+        return -EINVAL;
+    WRITE_ONCE(cb->espera_ativa_us, us);
+    return 0;
+}
+
+// MQ_IOC_SET_QUEUE
+static long ioctl_definir_fila(struct file *filp, struct mq_queue_args __user *uargs) {
+    struct mq_queue_args args;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags)
+        return -EINVAL;
+    return definir_fila(filp->private_data, args.bytes, args.slots);
+}
+
+// MQ_IOC_GET_QUEUE: tamanhos da fila registrada (ou dos que o próximo /reg usará) e ocupação
+static long ioctl_obter_fila(struct file *filp, struct mq_queue_args __user *uargs) {
+    control_block_t *cb = filp->private_data;
+    struct mq_queue_args args;
+    message_queue_t *q;
+
+    memset(&args, 0, sizeof(args));
+    spin_lock(&cb->lock);
+    q = cb->queue;
+    args.bytes = q ? q->limite : READ_ONCE(cb->fila_bytes) ?: READ_ONCE(cb->inst->fila_bytes);
+    if (q && q->anel) {
+        args.slots = q->anel->slots;
+        args.ocupado = anel_pendentes(q->anel);
+    } else {
+        args.slots = roundup_pow_of_two(READ_ONCE(cb->anel_slots) ?: READ_ONCE(cb->inst->anel_slots));
+        args.ocupado = q ? fila_ocupado(q) : 0;
+    }
+    spin_unlock(&cb->lock);
+
+    if (copy_to_user(uargs, &args, sizeof(args)) != 0)
+        return -EFAULT;
+    return 0;
+}
+
+static long ioctl_receber(struct file *filp, struct mq_recv_args __user *uargs, bool nonblock) {
+    struct mq_recv_args args;
+    control_block_t *cb = filp->private_data;
+    struct iov_iter para;
+    struct iovec iov;
+    size_t size;
+    long ret;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags || memchr_inv(args.reserved, 0, sizeof(args.reserved)))
+        return -EINVAL;
+    ret = import_single_range(READ, u64_to_user_ptr(args.buf), args.len, &iov, &para);
+    if (ret)
+        return ret;
+
+    ret = receber_mensagem(cb, nonblock, &para, &size, args.sender, &args.prio, &args.corr);
+    if (ret < 0)
+        return ret;
+
+    args.size = size;
+    if (copy_to_user(uargs, &args, sizeof(args)) != 0)
+        return -EFAULT;
+    return ret;
+}
+
+// Faz a chamada e copia a resposta para o buffer do usuário, que pode ser menor que ela
+static long ioctl_chamar(struct file *filp, struct mq_call_args __user *uargs) {
+    control_block_t *cb = filp->private_data;
+    struct mq_call_args args;
+    struct iov_iter dados;
+    struct iovec iov;
+    char destino[NAME_SIZE];
+    chamada_t ch;
+    size_t n;
+    long timeout;
+    int ret;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags & ~MQ_PRIO_MASK)
+        return -EINVAL;
+    if (args.dest_len) {
+        ret = copiar_nome_usuario(destino, NAME_SIZE, args.dest, args.dest_len);
+        if (ret)
+            return ret;
+    }
+    ret = import_single_range(WRITE, u64_to_user_ptr(args.buf), args.len, &iov, &dados);
+    if (ret)
+        return ret;
+
+    // Nenhuma resposta passa de MSG_MAX: o buffer da chamada não precisa ser maior
+    ch.buf = alocar_payload(&ch.resposta, min_t(size_t, args.reply_len, MSG_MAX(cb->inst)), GFP_KERNEL);
+    if (!ch.buf)
+        return -ENOMEM;
+    timeout = args.timeout_ms ? msecs_to_jiffies(args.timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+    ret = fazer_chamada(cb, args.dest_len ? destino : NULL, args.dest_id, &dados,
+                        args.flags & MQ_PRIO_MASK, timeout, filp->f_flags & O_NONBLOCK, &ch);
+    if (ret == 0) {
+        n = min(ch.size, ch.resposta.size);
+        if (copy_to_user(u64_to_user_ptr(args.reply), ch.buf, n) != 0)
+            ret = -EFAULT;
+    }
+    liberar_payload(&ch.resposta);
+    if (ret)
+        return ret;
+
+    args.reply_size = ch.size;
+    args.corr = ch.corr;
+    if (copy_to_user(uargs, &args, sizeof(args)) != 0)
+        return -EFAULT;
+    return n;
+}
+
+static long ioctl_responder(struct file *filp, struct mq_reply_args __user *uargs) {
+    struct mq_reply_args args;
+    struct iov_iter dados;
+    struct iovec iov;
+    char destino[NAME_SIZE];
+    int ret;
+
+    if (copy_from_user(&args, uargs, sizeof(args)) != 0)
+        return -EFAULT;
+    if (args.flags || args.reserved || args.corr == 0)
+        return -EINVAL;
+    if (args.dest_len) {
+        ret = copiar_nome_usuario(destino, NAME_SIZE, args.dest, args.dest_len);
+        if (ret)
+            return ret;
+    }
+    ret = import_single_range(WRITE, u64_to_user_ptr(args.buf), args.len, &iov, &dados);
+    if (ret)
+        return ret;
+    return responder_chamada(filp->private_data, args.dest_len ? destino : NULL, args.dest_id, args.corr, &dados);
+}
+
+static long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    void __user *argp = (void __user *)arg;
+    bool nonblock = filp->f_flags & O_NONBLOCK;
+
+    switch (cmd) {
+    case MQ_IOC_VERSION:
+        return MQ_ABI_VERSION;
+    case MQ_IOC_REG:
+        return ioctl_registrar(filp, argp);
+    case MQ_IOC_UNR:
+        return comando_remover(filp->private_data);
+    case MQ_IOC_SEND:
+        return ioctl_enviar(filp, argp, nonblock);
+    case MQ_IOC_ALL:
+        return ioctl_enviar_todos(filp, argp, nonblock);
+    case MQ_IOC_RECV:
+        return ioctl_receber(filp, argp, nonblock);
+    case MQ_IOC_RING:
+        return comando_anel(filp->private_data);
+    case MQ_IOC_SET_MODE:
+        return ioctl_definir_modo(filp, arg);
+    case MQ_IOC_SEND_BATCH:
+        return ioctl_enviar_lote(filp, argp, nonblock);
+    case MQ_IOC_SET_OVERFLOW:
+        return ioctl_definir_politica(filp, arg);
+    case MQ_IOC_SUB:
+        return ioctl_assinatura(filp, argp, true);
+    case MQ_IOC_UNSUB:
+        return ioctl_assinatura(filp, argp, false);
+    case MQ_IOC_PUB:
+        return ioctl_publicar(filp, argp, nonblock);
+    case MQ_IOC_SET_PRIO:
+        return ioctl_definir_prioridade(filp, arg);
+    case MQ_IOC_CALL:
+        return ioctl_chamar(filp, argp);
+    case MQ_IOC_REPLY:
+        return ioctl_responder(filp, argp);
+    case MQ_IOC_SET_BUSY_POLL:
+        return ioctl_definir_espera_ativa(filp, arg);
+    case MQ_IOC_SET_QUEUE:
+        return ioctl_definir_fila(filp, argp);
+    case MQ_IOC_GET_QUEUE:
+        return ioctl_obter_fila(filp, argp);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static recebimento_t* recebimento(struct io_uring_cmd *ioucmd) {
+    BUILD_BUG_ON(sizeof(recebimento_t) > sizeof_field(struct io_uring_cmd, pdu));
+    return (recebimento_t *)ioucmd->pdu;
+}
+
+// Estaciona em cb->recebimentos um MQ_IOC_RECV que encontrou a fila vazia. Retorna
+// -EIOCBQUEUED, ou -ENOENT se o descritor não está registrado.
+static int estacionar_recebimento(struct io_uring_cmd *ioucmd) {
+    control_block_t *cb = ioucmd->file->private_data;
+    message_queue_t *q;
+    mq_anel_t *anel;
+    bool chegou;
+
+    spin_lock(&cb->lock);
+    if (!cb->queue) {
+        spin_unlock(&cb->lock);
+        return -ENOENT;
+    }
+    list_add_tail(&recebimento(ioucmd)->no, &cb->recebimentos);
+    spin_unlock(&cb->lock);
+
+    // Um remetente que publicou antes do list_add_tail pode não ter visto o comando (par da
+    // barreira de acordar_leitores). Durante uma migração, quem a termina acorda os comandos.
+    smp_mb();
+    rcu_read_lock();
+    q = rcu_dereference(cb->queue);
+    anel = q ? READ_ONCE(q->anel) : NULL;
+    chegou = !q || (!READ_ONCE(q->migrando) &&
+                    (anel ? anel_pendentes(anel) != 0 : fila_tem_mensagem(q)));
+    rcu_read_unlock();
+    if (chegou)
+        acordar_recebimentos(cb, false);
+    return -EIOCBQUEUED;
+}
+
+// Roda na tarefa que submeteu o comando, com acesso à sua memória. Se outro leitor levou a
+// mensagem, o comando volta a esperar.
+static void concluir_recebimento(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    long ret = ioctl_receber(ioucmd->file, recebimento(ioucmd)->args, true);
+
+    if (ret == -EAGAIN)
+        ret = estacionar_recebimento(ioucmd);
+    if (ret != -EIOCBQUEUED)
+        io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+}
+
+static void cancelar_recebimento(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    io_uring_cmd_done(ioucmd, -ENOENT, 0, issue_flags);
+}
+
+// Passa os MQ_IOC_RECV estacionados em cb às tarefas que os submeteram, para lerem a
+// mensagem que chegou ou, com cancelar (/unr e close), completarem com -ENOENT
+static void acordar_recebimentos(control_block_t *cb, bool cancelar) {
+    recebimento_t *r, *tmp;
+    LIST_HEAD(acordados);
+
+    if (list_empty(&cb->recebimentos))
+        return;
+    spin_lock(&cb->lock);
+    list_splice_init(&cb->recebimentos, &acordados);
+    spin_unlock(&cb->lock);
+
+    list_for_each_entry_safe(r, tmp, &acordados, no) {
+        list_del(&r->no); // Entregue, o comando pode completar e reutilizar o pdu
+        io_uring_cmd_complete_in_task(r->ioucmd, cancelar ? cancelar_recebimento : concluir_recebimento);
+    }
+}
+
+// Comandos submetidos por io_uring (IORING_OP_URING_CMD, ver mq_ioctl.h): cmd_op é o número do
+// ioctl. Na submissão (IO_URING_F_NONBLOCK) o comando não dorme: -EAGAIN faz o io_uring
+// repeti-lo num worker, onde pode esperar. /all, /pub e lotes pulariam os destinatários
+// cheios em vez de esperá-los, e repeti-los entregaria de novo aos demais: sem O_NONBLOCK no
+// descritor, vão direto para o worker. MQ_IOC_RECV não ocupa worker (leituras paradas
+// ocupariam os workers de que esses envios dependem): com a fila vazia é estacionado no
+// control block, e o próximo enfileiramento o completa.
+static int dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    const struct mq_uring_cmd *cmd = ioucmd->cmd;
+    struct file *filp = ioucmd->file;
+    void __user *argp = u64_to_user_ptr(READ_ONCE(cmd->args));
+    bool nonblock = filp->f_flags & O_NONBLOCK;
+    bool submissao = issue_flags & IO_URING_F_NONBLOCK;
+    long ret;
+
+    if (READ_ONCE(cmd->reserved))
+        return -EINVAL;
+
+    switch (ioucmd->cmd_op) {
+    case MQ_IOC_SEND:
+        return ioctl_enviar(filp, argp, nonblock || submissao);
+    case MQ_IOC_RECV:
+        ret = ioctl_receber(filp, argp, true);
+        if (ret != -EAGAIN || nonblock)
+            return ret;
+        recebimento(ioucmd)->ioucmd = ioucmd;
+        recebimento(ioucmd)->args = argp;
+        return estacionar_recebimento(ioucmd);
+    case MQ_IOC_REPLY:
+        return ioctl_responder(filp, argp);
+    case MQ_IOC_ALL:
+    case MQ_IOC_PUB:
+    case MQ_IOC_SEND_BATCH:
+        if (submissao && !nonblock)
+            return -EAGAIN;
+        if (ioucmd->cmd_op == MQ_IOC_ALL)
+            return ioctl_enviar_todos(filp, argp, nonblock);
+        if (ioucmd->cmd_op == MQ_IOC_PUB)
+            return ioctl_publicar(filp, argp, nonblock);
+        return ioctl_enviar_lote(filp, argp, nonblock);
+    default:
+        return -ENOTTY;
+    }
+}
 //======================================================================================
 module_init(mq_init_driver);
 module_exit(mq_exit_driver);
@@ -0,0 +1,273 @@
+/*
+ * ABI binária do /dev/mq (ioctl), compartilhada entre o driver e o espaço de usuário.
+ *
+ * Alternativa ao protocolo texto (/reg, /unr, /msg, /all): os comandos são structs de
+ * layout fixo e destino/payload são passados como ponteiro + tamanho, sem parsing.
+ * Ponteiros são sempre __u64 para que o layout seja o mesmo em 32 e 64 bits.
+ * Bits desconhecidos em "flags" e campos "reserved" diferentes de zero retornam -EINVAL.
+ */
+#ifndef MQ_IOCTL_H
+#define MQ_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MQ_ABI_VERSION 10       // Incrementado a cada mudança da ABI (2: ids, 3: anel mmap, 4: lotes, 5: política, 6: tópicos, 7: prioridades, 8: chamadas, 9: espera ativa, 10: tamanho da fila)
+#define MQ_IOC_MAGIC   'q'
+#define MQ_NAME_SIZE   9        // Nome de até 8 caracteres + '\0'
+#define MQ_TOPIC_SIZE  32       // Tópico de até 31 caracteres + '\0'
+
+/*
+ * Prioridade de uma mensagem, de 0 (normal) a MQ_PRIO_LEVELS - 1 (mais urgente), nos bits
+ * MQ_PRIO_MASK de flags em mq_send_args, mq_all_args e mq_pub_args; o protocolo texto usa a
+ * prioridade do descritor (MQ_IOC_SET_PRIO). Cada endpoint tem uma faixa por prioridade, e a
+ * leitura sempre retira da faixa mais urgente com mensagem. As faixas acima da 0 têm um
+ * quarto do tamanho da fila, e com a fila cheia MQ_OVERFLOW_OVERWRITE descarta primeiro as
+ * mensagens menos urgentes. O número de sequência é contado por faixa.
+ */
+#define MQ_PRIO_LEVELS 4
+#define MQ_PRIO_MASK   0x3
+
+// MQ_IOC_REG: registra o descritor sob o nome dado (nome_len sem o '\0').
+// Retorna o id do endpoint, que pode ser usado como destino em MQ_IOC_SEND.
+struct mq_reg_args {
+    __u64 nome;
+    __u32 nome_len;
+    __u32 flags;
+};
+
+// MQ_IOC_SEND: envia len bytes de buf para o processo dest.
+// Com dest_len == 0 o destino é o endpoint dest_id (dispensa a busca por nome).
+struct mq_send_args {
+    __u64 dest;
+    __u64 buf;
+    __u32 dest_len;
+    __u32 len;
+    __u32 flags;
+    __u32 dest_id;
+};
+
+// MQ_IOC_ALL: envia len bytes de buf a todos os outros processos registrados
+struct mq_all_args {
+    __u64 buf;
+    __u32 len;
+    __u32 flags;
+};
+
+// MQ_IOC_RECV: retira a próxima mensagem, copiando até len bytes para buf.
+// Na volta, size traz o tamanho real da mensagem e sender o nome do remetente.
+struct mq_recv_args {
+    __u64 buf;
+    __u32 len;
+    __u32 size;
+    __u32 flags;
+    __u32 corr;         // Id de correlação se a mensagem é uma chamada (MQ_IOC_CALL), senão 0
+    char  sender[MQ_NAME_SIZE];
+    __u8  prio;         // Prioridade da mensagem
+    __u8  reserved[6];
+};
+
+/*
+ * Anel compartilhado (modo mmap). MQ_IOC_RING cria o anel do endpoint e retorna o tamanho
+ * a mapear com mmap(NULL, tamanho, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0). Daí em diante
+ * as mensagens destinadas ao endpoint são escritas direto no anel, e o consumidor as drena
+ * sem syscall:
+ *
+ *     while (hdr->tail != __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE)) {
+ *         slot = (void *)hdr + hdr->data_offset + (hdr->tail & (hdr->slots - 1)) * hdr->slot_size;
+ *         ... slot->size bytes em slot->data ...
+ *         __atomic_store_n(&hdr->tail, hdr->tail + 1, __ATOMIC_RELEASE);
+ *     }
+ *
+ * poll()/epoll só são necessários para dormir com o anel vazio. read()/MQ_IOC_RECV continuam
+ * funcionando (consomem do anel). Com o anel cheio a mensagem nova é descartada e contada
+ * em hdr->dropped: o kernel nunca sobrescreve slots ainda não consumidos.
+ */
+struct mq_ring_hdr {
+    __u32 head;         // Escrito pelo kernel: total de mensagens publicadas
+    __u32 slots;        // Número de slots (potência de 2)
+    __u32 slot_size;    // Bytes por slot, incluindo struct mq_ring_slot
+    __u32 data_offset;  // Deslocamento do primeiro slot a partir do início do mapeamento
+    __u32 dropped;      // Mensagens descartadas por anel cheio ou maiores que um slot
+    __u8  pad0[44];
+    __u32 tail;         // Escrito pelo consumidor: total de mensagens consumidas
+    __u8  pad1[60];     // head e tail em linhas de cache distintas
+};
+
+struct mq_ring_slot {
+    __u32 size;
+    __u32 seq;          // Número de sequência da mensagem na fila do destinatário
+    char  sender[MQ_NAME_SIZE];
+    __u8  prio;         // Prioridade da mensagem (o anel é FIFO)
+    __u8  reserved[2];
+    __u32 corr;         // Id de correlação de uma chamada (MQ_IOC_CALL), senão 0
+    char  data[];
+};
+
+/*
+ * Modo lote (MQ_IOC_SET_MODE com MQ_MODE_BATCH): cada read() drena de uma vez quantas
+ * mensagens couberem no buffer, cada uma precedida de um struct mq_frame. O próximo quadro
+ * começa em MQ_FRAME_NEXT(len). Uma mensagem maior que o buffer vem sozinha e truncada
+ * (len < size). O número de sequência é atribuído na faixa do destinatário: lacunas na
+ * mesma prioridade indicam mensagens perdidas. No modo mmap, cada read() devolve um único quadro.
+ */
+#define MQ_MODE_BATCH  0x1
+
+struct mq_frame {
+    __u32 size;         // Tamanho real da mensagem
+    __u32 len;          // Bytes de payload que seguem o cabeçalho
+    __u32 seq;          // Número de sequência na faixa do destinatário
+    char  sender[MQ_NAME_SIZE];
+    __u8  prio;         // Prioridade (faixa) da mensagem
+    __u8  reserved[2];
+    __u32 corr;         // Id de correlação de uma chamada (MQ_IOC_CALL), senão 0
+};
+
+#define MQ_FRAME_ALIGN 8
+#define MQ_FRAME_NEXT(len) \
+    (((sizeof(struct mq_frame) + (len)) + MQ_FRAME_ALIGN - 1) & ~(MQ_FRAME_ALIGN - 1))
+
+// MQ_IOC_SEND_BATCH: executa count comandos struct mq_send_args (vetor em cmds) numa syscall.
+// Mensagens para o mesmo destino são enfileiradas com uma única busca e um único despertar.
+// Retorna quantos comandos foram entregues (ou o erro, se nenhum foi).
+struct mq_batch_args {
+    __u64 cmds;
+    __u32 count;
+    __u32 flags;
+};
+
+/*
+ * Política de fila cheia do endpoint destinatário (MQ_IOC_SET_OVERFLOW; o padrão vem do
+ * parâmetro OVERFLOW_POLICY do módulo). No modo mmap o anel nunca é sobrescrito e o
+ * remetente sempre recebe ENOSPC quando ele está cheio.
+ */
+#define MQ_OVERFLOW_OVERWRITE 0 // Descarta a mensagem mais antiga
+#define MQ_OVERFLOW_REJECT    1 // O remetente recebe ENOSPC
+#define MQ_OVERFLOW_BLOCK     2 // O remetente dorme até haver espaço (EAGAIN com O_NONBLOCK)
+
+/*
+ * Tópicos (publish/subscribe). Um endpoint registrado assina até 64 tópicos; MQ_IOC_PUB
+ * entrega a mensagem só aos assinantes do tópico (exceto o próprio remetente), com a mesma
+ * política de fila cheia de MQ_IOC_ALL. Um tópico deixa de existir com o último assinante.
+ */
+
+// MQ_IOC_SUB / MQ_IOC_UNSUB: assina ou cancela o tópico nome (nome_len sem o '\0')
+struct mq_topic_args {
+    __u64 nome;
+    __u32 nome_len;
+    __u32 flags;
+};
+
+// MQ_IOC_PUB: publica len bytes de buf no tópico topico
+struct mq_pub_args {
+    __u64 topico;
+    __u64 buf;
+    __u32 topico_len;
+    __u32 len;
+    __u32 flags;
+    __u32 reserved;
+};
+
+/*
+ * Chamadas (request/reply). MQ_IOC_CALL enfileira a requisição no destino como uma mensagem
+ * comum, marcada com um id de correlação novo (nunca 0), e dorme até a resposta ou até
+ * timeout_ms (0: sem limite). O servidor vê o id em mq_recv_args.corr, mq_frame.corr ou
+ * mq_ring_slot.corr e responde com MQ_IOC_REPLY ao remetente: a resposta é copiada direto para
+ * o chamador, sem passar pela fila dele, e truncada a reply_len (reply_size traz o tamanho
+ * real). Cada descritor tem no máximo uma chamada pendente (EBUSY); a chamada expira com
+ * ETIMEDOUT, e uma resposta que chega depois disso (ou com id errado) recebe ENOENT.
+ */
+
+// MQ_IOC_CALL: envia len bytes de buf a dest (ou dest_id, com dest_len == 0) e espera a
+// resposta em reply. Retorna o número de bytes da resposta copiados.
+struct mq_call_args {
+    __u64 dest;
+    __u64 buf;
+    __u64 reply;
+    __u32 dest_len;
+    __u32 dest_id;
+    __u32 len;
+    __u32 reply_len;
+    __u32 reply_size;   // Na volta: tamanho real da resposta
+    __u32 timeout_ms;
+    __u32 flags;        // Prioridade da requisição (MQ_PRIO_MASK)
+    __u32 corr;         // Na volta: id de correlação usado
+};
+
+// MQ_IOC_REPLY: responde com len bytes de buf à chamada corr pendente em dest (ou dest_id)
+struct mq_reply_args {
+    __u64 dest;
+    __u64 buf;
+    __u32 dest_len;
+    __u32 dest_id;
+    __u32 len;
+    __u32 corr;
+    __u32 flags;
+    __u32 reserved;
+};
+
+/*
+ * Espera ativa (MQ_IOC_SET_BUSY_POLL; o padrão vem do parâmetro BUSY_POLL_US do módulo). Uma
+ * leitura bloqueante com a fila vazia gira no kernel por até o orçamento dado, em
+ * microssegundos, antes de dormir, trocando CPU por latência de acordar. O orçamento efetivo
+ * se adapta ao intervalo médio entre as chegadas: a leitura gira até o dobro dele (sem passar
+ * do orçamento) e nem gira se a próxima mensagem provavelmente chega depois. 0 desativa.
+ */
+#define MQ_BUSY_POLL_MAX_US 1000
+
+/*
+ * Tamanho da fila do endpoint (MQ_IOC_SET_QUEUE). bytes é o orçamento somado das faixas (a
+ * faixa 0 usa tudo, as demais um quarto), arredondado para potência de 2 entre 1024 e o teto
+ * da instância (QUEUE_BYTES_MAX, ou fila_bytes_max no sysfs do dispositivo); slots é o número
+ * de slots do anel do modo mmap, até anel_slots_max. 0 mantém o valor atual. Antes do registro
+ * os valores valem para o próximo MQ_IOC_REG; depois, a fila é trocada por uma nova sem perder
+ * mensagens: ENOSPC se as pendentes não cabem nela, EBUSY em modo mmap (ou, raramente, com
+ * leituras e envios ocupando a fila sem trégua). Os slots de um anel já criado não mudam.
+ * MQ_IOC_GET_QUEUE devolve os valores em uso e, em ocupado, os bytes na fila (ou as mensagens
+ * no anel, em modo mmap).
+ */
+struct mq_queue_args {
+    __u32 bytes;
+    __u32 slots;
+    __u32 ocupado;      // Só em MQ_IOC_GET_QUEUE
+    __u32 flags;        // 0
+};
+
+/*
+ * io_uring (IORING_OP_URING_CMD): sqe->cmd_op é um de MQ_IOC_SEND, MQ_IOC_ALL, MQ_IOC_PUB,
+ * MQ_IOC_SEND_BATCH, MQ_IOC_RECV ou MQ_IOC_REPLY, e a área de comando do SQE (sqe->cmd)
+ * traz struct mq_uring_cmd com o ponteiro para o struct de argumentos do ioctl. O resultado
+ * do CQE é o retorno do ioctl. Um envio que teria de esperar (destino cheio sob
+ * MQ_OVERFLOW_BLOCK) é repetido pelo io_uring num worker, onde pode dormir; com O_NONBLOCK
+ * ele completa com -EAGAIN. MQ_IOC_RECV com a fila vazia completa quando chega mensagem, sem
+ * ocupar um worker (com O_NONBLOCK, completa com -EAGAIN); /unr e close o completam com
+ * -ENOENT.
+ * IORING_OP_READ e IORING_OP_WRITE também funcionam no /dev/mq, e uma leitura com a fila
+ * vazia completa quando chega mensagem, sem ocupar um worker.
+ */
+struct mq_uring_cmd {
+    __u64 args;
+    __u64 reserved;
+};
+
+#define MQ_IOC_VERSION _IO(MQ_IOC_MAGIC, 0)                          // Retorna MQ_ABI_VERSION
+#define MQ_IOC_REG     _IOW(MQ_IOC_MAGIC, 1, struct mq_reg_args)     // Retorna o id do endpoint
+#define MQ_IOC_UNR     _IO(MQ_IOC_MAGIC, 2)
+#define MQ_IOC_SEND    _IOW(MQ_IOC_MAGIC, 3, struct mq_send_args)
+#define MQ_IOC_ALL     _IOW(MQ_IOC_MAGIC, 4, struct mq_all_args)     // Retorna nº de destinatários
+#define MQ_IOC_RECV    _IOWR(MQ_IOC_MAGIC, 5, struct mq_recv_args)   // Retorna nº de bytes copiados
+#define MQ_IOC_RING    _IO(MQ_IOC_MAGIC, 6)                          // Retorna o tamanho a mapear
+#define MQ_IOC_SET_MODE _IO(MQ_IOC_MAGIC, 7)                         // arg: bits MQ_MODE_*
+#define MQ_IOC_SEND_BATCH _IOW(MQ_IOC_MAGIC, 8, struct mq_batch_args)
+#define MQ_IOC_SET_OVERFLOW _IO(MQ_IOC_MAGIC, 9)                     // arg: MQ_OVERFLOW_*
+#define MQ_IOC_SUB     _IOW(MQ_IOC_MAGIC, 10, struct mq_topic_args)
+#define MQ_IOC_UNSUB   _IOW(MQ_IOC_MAGIC, 11, struct mq_topic_args)
+#define MQ_IOC_PUB     _IOW(MQ_IOC_MAGIC, 12, struct mq_pub_args)    // Retorna nº de destinatários
+#define MQ_IOC_SET_PRIO _IO(MQ_IOC_MAGIC, 13)                        // arg: prioridade dos write() texto
+#define MQ_IOC_CALL    _IOWR(MQ_IOC_MAGIC, 14, struct mq_call_args)  // Retorna nº de bytes da resposta copiados
+#define MQ_IOC_REPLY   _IOW(MQ_IOC_MAGIC, 15, struct mq_reply_args)
+#define MQ_IOC_SET_BUSY_POLL _IO(MQ_IOC_MAGIC, 16)                   // arg: orçamento de espera ativa em µs
+#define MQ_IOC_SET_QUEUE _IOW(MQ_IOC_MAGIC, 17, struct mq_queue_args)
+#define MQ_IOC_GET_QUEUE _IOR(MQ_IOC_MAGIC, 18, struct mq_queue_args)
+
+#endif // MQ_IOCTL_H
@@ -0,0 +1,459 @@
+/*
+ * Substitutos em espaço do usuário para as APIs do kernel usadas por mq_core.h.
+ *
+ * Locks, kref e barreiras têm a mesma semântica do kernel (spinlocks giram de verdade, para
+ * que a contenção medida seja comparável). RCU não existe aqui: leituras sem lock da lista e
+ * dos índices não podem correr junto com inserções e remoções. rhashtable e xarray são
+ * versões simples (hash com encadeamento e vetor crescente), suficientes para medir a busca.
+ */
+#ifndef MQ_SHIM_H
+#define MQ_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+#define container_of(p, t, campo) ((t *)((char *)(p) - offsetof(t, campo)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// Acessos relaxados de verdade, e não volatile: assim o ThreadSanitizer enxerga as leituras
+// e escritas sem lock do núcleo como atômicas (gcc/clang -fsanitize=thread)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#if defined(__SANITIZE_THREAD__)
+// O ThreadSanitizer não modela barreiras avulsas: um RMW seq_cst numa variável comum a todas
+// as threads faz o papel de smp_mb() para ele
+static int shim_barreira __attribute__((unused));
+#define smp_mb() ((void)__atomic_fetch_add(&shim_barreira, 0, __ATOMIC_SEQ_CST))
+#else
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+#define smp_mb__before_atomic() smp_mb()
+#define smp_mb__after_atomic() smp_mb()
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+// Mensagens do núcleo são descartadas fora do kernel
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_INFO ""
+#define printk(...) ((void)0)
+
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//=================================================================================================
+// Alocação
+
+// Alinhado à linha de cache, como os caches do slab, para estruturas ____cacheline_aligned_in_smp
+static inline void *shim_alocar(size_t n, bool zerar) {
+    void *p = aligned_alloc(64, ALIGN(n, (size_t)64));
+
+    if (p && zerar)
+        memset(p, 0, n);
+    return p;
+}
+
+#define kmalloc(n, gfp) shim_alocar(n, false)
+#define kzalloc(n, gfp) shim_alocar(n, true)
+#define kvmalloc(n, gfp) malloc(n)
+#define kvzalloc(n, gfp) calloc(1, n)
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+
+//=================================================================================================
+// Sincronização
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+typedef struct {
+    s64 counter;
+} atomic64_t;
+
+// Operações com retorno são totalmente ordenadas, como no kernel
+static inline int atomic_read(const atomic_t *a) {
+    return __atomic_load_n(&a->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_set(atomic_t *a, int v) {
+    __atomic_store_n(&a->counter, v, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_sub(int v, atomic_t *a) {
+    __atomic_fetch_sub(&a->counter, v, __ATOMIC_RELAXED);
+}
+
+static inline bool atomic_try_cmpxchg(atomic_t *a, int *antigo, int novo) {
+    return __atomic_compare_exchange_n(&a->counter, antigo, novo, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline s64 atomic64_read(const atomic64_t *a) {
+    return __atomic_load_n(&a->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_set(atomic64_t *a, s64 v) {
+    __atomic_store_n(&a->counter, v, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_fetch_add(s64 v, atomic64_t *a) {
+    return __atomic_fetch_add(&a->counter, v, __ATOMIC_SEQ_CST);
+}
+
+static inline s64 atomic64_cmpxchg(atomic64_t *a, s64 antigo, s64 novo) {
+    __atomic_compare_exchange_n(&a->counter, &antigo, novo, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return antigo;
+}
+
+static inline bool test_bit(long nr, const unsigned long *p) {
+    return (__atomic_load_n(p, __ATOMIC_RELAXED) >> nr) & 1;
+}
+
+static inline void set_bit(long nr, unsigned long *p) {
+    __atomic_fetch_or(p, 1UL << nr, __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(long nr, unsigned long *p) {
+    __atomic_fetch_and(p, ~(1UL << nr), __ATOMIC_RELAXED);
+}
+
+// Índice do bit mais significativo de x, que não pode ser 0
+static inline unsigned long __fls(unsigned long x) {
+    return sizeof(x) * 8 - 1 - __builtin_clzl(x);
+}
+
+static inline bool test_and_set_bit_lock(long nr, unsigned long *p) {
+    return __atomic_fetch_or(p, 1UL << nr, __ATOMIC_ACQUIRE) & (1UL << nr);
+}
+
+static inline void clear_bit_unlock(long nr, unsigned long *p) {
+    __atomic_fetch_and(p, ~(1UL << nr), __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    int travado;
+} spinlock_t;
+
+#define __SPIN_LOCK_UNLOCKED(nome) { 0 }
+
+static inline void spin_lock_init(spinlock_t *l) {
+    l->travado = 0;
+}
+
+static inline void spin_lock(spinlock_t *l) {
+    while (__atomic_exchange_n(&l->travado, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&l->travado, __ATOMIC_RELAXED))
+            cpu_relax();
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    __atomic_store_n(&l->travado, 0, __ATOMIC_RELEASE);
+}
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *m) {
+    pthread_mutex_init(&m->m, NULL);
+}
+
+// Ninguém dorme em filas de espera fora do kernel: quem espera gira
+typedef struct {
+    int nao_usado;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq) {
+    (void)wq;
+}
+
+struct kref {
+    int refcount;
+};
+
+static inline void kref_init(struct kref *k) {
+    __atomic_store_n(&k->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void kref_get(struct kref *k) {
+    __atomic_fetch_add(&k->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool kref_get_unless_zero(struct kref *k) {
+    int v = __atomic_load_n(&k->refcount, __ATOMIC_RELAXED);
+
+    while (v != 0)
+        if (__atomic_compare_exchange_n(&k->refcount, &v, v + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    return false;
+}
+
+static inline int kref_put(struct kref *k, void (*liberar)(struct kref *)) {
+    if (__atomic_sub_fetch(&k->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        liberar(k);
+        return 1;
+    }
+    return 0;
+}
+
+struct rcu_head {
+    void *nao_usado;
+};
+
+#define rcu_read_lock() ((void)0)
+#define rcu_read_unlock() ((void)0)
+#define synchronize_rcu() ((void)0)
+#define kfree_rcu(p, campo) free(p)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+//=================================================================================================
+// Listas
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(nome) { &(nome), &(nome) }
+
+static inline void INIT_LIST_HEAD(struct list_head *l) {
+    l->next = l->prev = l;
+}
+
+static inline void list_add_tail(struct list_head *novo, struct list_head *cabeca) {
+    novo->prev = cabeca->prev;
+    novo->next = cabeca;
+    cabeca->prev->next = novo;
+    cabeca->prev = novo;
+}
+
+static inline void list_del(struct list_head *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static inline int list_empty(const struct list_head *l) {
+    return l->next == l;
+}
+
+#define list_add_tail_rcu list_add_tail
+#define list_del_rcu list_del
+#define list_entry(p, t, campo) container_of(p, t, campo)
+#define list_first_entry(cabeca, t, campo) list_entry((cabeca)->next, t, campo)
+#define list_for_each_entry(e, cabeca, campo) \
+    for (e = list_entry((cabeca)->next, __typeof__(*e), campo); &e->campo != (cabeca); \
+         e = list_entry(e->campo.next, __typeof__(*e), campo))
+#define list_for_each_entry_rcu list_for_each_entry
+
+//=================================================================================================
+// rhashtable: hash com encadeamento que dobra de tamanho a 3/4 de ocupação
+
+struct rhash_head {
+    struct rhash_head *next;
+};
+
+struct rhashtable_params {
+    u16 key_len;
+    u16 key_offset;
+    u16 head_offset;
+    bool automatic_shrinking;
+};
+
+struct rhashtable {
+    struct rhash_head **baldes;
+    u32 mascara;
+    u32 elementos;
+    struct rhashtable_params p;
+};
+
+static inline u32 shim_hash(const void *chave, u16 len) {
+    const u8 *b = chave;
+    u32 h = 2166136261u; // FNV-1a
+
+    while (len--)
+        h = (h ^ *b++) * 16777619u;
+    return h;
+}
+
+static inline int rhashtable_init(struct rhashtable *ht, const struct rhashtable_params *p) {
+    ht->baldes = calloc(16, sizeof(*ht->baldes));
+    if (!ht->baldes)
+        return -ENOMEM;
+    ht->mascara = 15;
+    ht->elementos = 0;
+    ht->p = *p;
+    return 0;
+}
+
+static inline void rhashtable_destroy(struct rhashtable *ht) {
+    free(ht->baldes);
+    ht->baldes = NULL;
+}
+
+static inline void *shim_objeto(const struct rhashtable *ht, struct rhash_head *no) {
+    return (char *)no - ht->p.head_offset;
+}
+
+static inline void *rhashtable_lookup(struct rhashtable *ht, const void *chave, const struct rhashtable_params p) {
+    struct rhash_head *no;
+
+    for (no = ht->baldes[shim_hash(chave, p.key_len) & ht->mascara]; no; no = no->next)
+        if (memcmp((char *)shim_objeto(ht, no) + p.key_offset, chave, p.key_len) == 0)
+            return shim_objeto(ht, no);
+    return NULL;
+}
+
+static inline void shim_redimensionar(struct rhashtable *ht) {
+    u32 n = (ht->mascara + 1) * 2, i;
+    struct rhash_head **novos = calloc(n, sizeof(*novos));
+    struct rhash_head *no, *prox;
+
+    if (!novos)
+        return; // continua com os baldes atuais, só mais longos
+    for (i = 0; i <= ht->mascara; i++) {
+        for (no = ht->baldes[i]; no; no = prox) {
+            u32 b = shim_hash((char *)shim_objeto(ht, no) + ht->p.key_offset, ht->p.key_len) & (n - 1);
+            prox = no->next;
+            no->next = novos[b];
+            novos[b] = no;
+        }
+    }
+    free(ht->baldes);
+    ht->baldes = novos;
+    ht->mascara = n - 1;
+}
+
+static inline int rhashtable_lookup_insert_fast(struct rhashtable *ht, struct rhash_head *no, const struct rhashtable_params p) {
+    void *chave = (char *)shim_objeto(ht, no) + p.key_offset;
+    u32 b;
+
+    if (rhashtable_lookup(ht, chave, p))
+        return -EEXIST;
+    if (ht->elementos + 1 > (ht->mascara + 1) / 4 * 3)
+        shim_redimensionar(ht);
+    b = shim_hash(chave, p.key_len) & ht->mascara;
+    no->next = ht->baldes[b];
+    ht->baldes[b] = no;
+    ht->elementos++;
+    return 0;
+}
+
+static inline int rhashtable_remove_fast(struct rhashtable *ht, struct rhash_head *no, const struct rhashtable_params p) {
+    struct rhash_head **pp;
+    void *chave = (char *)shim_objeto(ht, no) + p.key_offset;
+
+    for (pp = &ht->baldes[shim_hash(chave, p.key_len) & ht->mascara]; *pp; pp = &(*pp)->next) {
+        if (*pp == no) {
+            *pp = no->next;
+            ht->elementos--;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+//=================================================================================================
+// xarray: vetor de ponteiros que cresce; ids alocados a partir da última posição livre
+
+#define XA_FLAGS_ALLOC1 1u
+
+struct xa_limit {
+    u32 min, max;
+};
+
+#define xa_limit_32b ((struct xa_limit){ .min = 0, .max = UINT32_MAX })
+
+struct xarray {
+    void **itens;
+    u32 tamanho;
+    u32 proximo;
+    u32 flags;
+};
+
+static inline void xa_init_flags(struct xarray *xa, u32 flags) {
+    xa->itens = NULL;
+    xa->tamanho = 0;
+    xa->proximo = (flags & XA_FLAGS_ALLOC1) ? 1 : 0;
+    xa->flags = flags;
+}
+
+static inline void xa_destroy(struct xarray *xa) {
+    free(xa->itens);
+    xa_init_flags(xa, xa->flags);
+}
+
+static inline void *xa_load(struct xarray *xa, u32 id) {
+    return id < xa->tamanho ? xa->itens[id] : NULL;
+}
+
+static inline void *xa_erase(struct xarray *xa, u32 id) {
+    void *p = xa_load(xa, id);
+
+    if (p) {
+        xa->itens[id] = NULL;
+        if (id < xa->proximo)
+            xa->proximo = id;
+    }
+    return p;
+}
+
+static inline int xa_alloc(struct xarray *xa, u32 *id, void *p, struct xa_limit lim, gfp_t gfp) {
+    u32 i = max(xa->proximo, lim.min);
+
+    (void)gfp;
+    if (i == 0 && (xa->flags & XA_FLAGS_ALLOC1))
+        i = 1;
+    while (i < xa->tamanho && xa->itens[i])
+        i++;
+    if (i > lim.max)
+        return -EBUSY;
+    if (i >= xa->tamanho) {
+        u32 n = xa->tamanho ? xa->tamanho * 2 : 64;
+        void **novos = realloc(xa->itens, n * sizeof(void *));
+
+        if (!novos)
+            return -ENOMEM;
+        memset(novos + xa->tamanho, 0, (n - xa->tamanho) * sizeof(void *));
+        xa->itens = novos;
+        xa->tamanho = n;
+    }
+    xa->itens[i] = p;
+    xa->proximo = i + 1;
+    *id = i;
+    return 0;
+}
+
+#endif // MQ_SHIM_H
@@ -0,0 +1,177 @@
+/*
+ * Tracepoints do /dev/mq (sistema "mq"): seguem uma mensagem do envio à leitura com
+ * perf, ftrace ou bpftrace, a custo praticamente nulo quando desativados.
+ *
+ * Uma mensagem é identificada por destino e seq. ts é o ktime_get_ns() em que ela foi
+ * enfileirada, e mq_dequeue traz também a latência até a leitura.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mq
+
+#if !defined(_MQ_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MQ_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "mq_ioctl.h"
+
+// Mensagem enfileirada (/msg, /all, lotes). ocupado: bytes na fila (ou no anel) depois dela.
+TRACE_EVENT(mq_enqueue,
+    TP_PROTO(const char *destino, u32 destino_id, const char *remetente, u32 size, u32 seq, u32 ocupado, u64 ts),
+    TP_ARGS(destino, destino_id, remetente, size, seq, ocupado, ts),
+    TP_STRUCT__entry(
+        __array(char, destino, MQ_NAME_SIZE)
+        __field(u32, destino_id)
+        __array(char, remetente, MQ_NAME_SIZE)
+        __field(u32, size)
+        __field(u32, seq)
+        __field(u32, ocupado)
+        __field(u64, ts)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->destino, destino, MQ_NAME_SIZE);
+        __entry->destino_id = destino_id;
+        memcpy(__entry->remetente, remetente, MQ_NAME_SIZE);
+        __entry->size = size;
+        __entry->seq = seq;
+        __entry->ocupado = ocupado;
+        __entry->ts = ts;
+    ),
+    TP_printk("%s -> %s(%u) size=%u seq=%u ocupado=%u ts=%llu", __entry->remetente, __entry->destino,
+              __entry->destino_id, __entry->size, __entry->seq, __entry->ocupado, __entry->ts)
+);
+
+// Mensagem lida. ocupado: bytes na fila quando a leitura começou. Em modo mmap o anel não
+// guarda o instante do envio: ts e latencia são 0.
+TRACE_EVENT(mq_dequeue,
+    TP_PROTO(const char *destino, u32 destino_id, const char *remetente, u32 size, u32 seq, u32 ocupado, u64 ts, u64 latencia),
+    TP_ARGS(destino, destino_id, remetente, size, seq, ocupado, ts, latencia),
+    TP_STRUCT__entry(
+        __array(char, destino, MQ_NAME_SIZE)
+        __field(u32, destino_id)
+        __array(char, remetente, MQ_NAME_SIZE)
+        __field(u32, size)
+        __field(u32, seq)
+        __field(u32, ocupado)
+        __field(u64, ts)
+        __field(u64, latencia)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->destino, destino, MQ_NAME_SIZE);
+        __entry->destino_id = destino_id;
+        memcpy(__entry->remetente, remetente, MQ_NAME_SIZE);
+        __entry->size = size;
+        __entry->seq = seq;
+        __entry->ocupado = ocupado;
+        __entry->ts = ts;
+        __entry->latencia = latencia;
+    ),
+    TP_printk("%s -> %s(%u) size=%u seq=%u ocupado=%u ts=%llu latencia=%llu", __entry->remetente,
+              __entry->destino, __entry->destino_id, __entry->size, __entry->seq, __entry->ocupado,
+              __entry->ts, __entry->latencia)
+);
+
+// Mensagem mais antiga descartada por fila cheia (MQ_OVERFLOW_OVERWRITE)
+TRACE_EVENT(mq_overwrite,
+    TP_PROTO(const char *destino, u32 destino_id, const char *remetente, u32 size, u32 seq, u32 ocupado, u64 ts),
+    TP_ARGS(destino, destino_id, remetente, size, seq, ocupado, ts),
+    TP_STRUCT__entry(
+        __array(char, destino, MQ_NAME_SIZE)
+        __field(u32, destino_id)
+        __array(char, remetente, MQ_NAME_SIZE)
+        __field(u32, size)
+        __field(u32, seq)
+        __field(u32, ocupado)
+        __field(u64, ts)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->destino, destino, MQ_NAME_SIZE);
+        __entry->destino_id = destino_id;
+        memcpy(__entry->remetente, remetente, MQ_NAME_SIZE);
+        __entry->size = size;
+        __entry->seq = seq;
+        __entry->ocupado = ocupado;
+        __entry->ts = ts;
+    ),
+    TP_printk("%s -> %s(%u) size=%u seq=%u ocupado=%u ts=%llu", __entry->remetente, __entry->destino,
+              __entry->destino_id, __entry->size, __entry->seq, __entry->ocupado, __entry->ts)
+);
+
+// Fim de um /all: para quantos destinatários a mensagem foi entregue
+TRACE_EVENT(mq_broadcast,
+    TP_PROTO(const char *remetente, u32 size, int destinatarios),
+    TP_ARGS(remetente, size, destinatarios),
+    TP_STRUCT__entry(
+        __array(char, remetente, MQ_NAME_SIZE)
+        __field(u32, size)
+        __field(int, destinatarios)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->remetente, remetente, MQ_NAME_SIZE);
+        __entry->size = size;
+        __entry->destinatarios = destinatarios;
+    ),
+    TP_printk("%s size=%u destinatarios=%d", __entry->remetente, __entry->size, __entry->destinatarios)
+);
+
+// Publicação em um tópico: quantos assinantes receberam a mensagem
+TRACE_EVENT(mq_publish,
+    TP_PROTO(const char *topico, const char *remetente, u32 size, int destinatarios),
+    TP_ARGS(topico, remetente, size, destinatarios),
+    TP_STRUCT__entry(
+        __array(char, topico, MQ_TOPIC_SIZE)
+        __array(char, remetente, MQ_NAME_SIZE)
+        __field(u32, size)
+        __field(int, destinatarios)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->topico, topico, MQ_TOPIC_SIZE);
+        memcpy(__entry->remetente, remetente, MQ_NAME_SIZE);
+        __entry->size = size;
+        __entry->destinatarios = destinatarios;
+    ),
+    TP_printk("%s de %s size=%u destinatarios=%d", __entry->topico, __entry->remetente,
+              __entry->size, __entry->destinatarios)
+);
+
+TRACE_EVENT(mq_register,
+    TP_PROTO(const char *nome, u32 id, pid_t pid),
+    TP_ARGS(nome, id, pid),
+    TP_STRUCT__entry(
+        __array(char, nome, MQ_NAME_SIZE)
+        __field(u32, id)
+        __field(pid_t, pid)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->nome, nome, MQ_NAME_SIZE);
+        __entry->id = id;
+        __entry->pid = pid;
+    ),
+    TP_printk("%s(%u) pid=%d", __entry->nome, __entry->id, __entry->pid)
+);
+
+// Endpoint desregistrado. ocupado: bytes de mensagens não lidas descartadas com a fila.
+TRACE_EVENT(mq_unregister,
+    TP_PROTO(const char *nome, u32 id, pid_t pid, u32 ocupado),
+    TP_ARGS(nome, id, pid, ocupado),
+    TP_STRUCT__entry(
+        __array(char, nome, MQ_NAME_SIZE)
+        __field(u32, id)
+        __field(pid_t, pid)
+        __field(u32, ocupado)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->nome, nome, MQ_NAME_SIZE);
+        __entry->id = id;
+        __entry->pid = pid;
+        __entry->ocupado = ocupado;
+    ),
+    TP_printk("%s(%u) pid=%d ocupado=%u", __entry->nome, __entry->id, __entry->pid, __entry->ocupado)
+);
+
+#endif /* _MQ_TRACE_H */
+
+// O cabeçalho fica no diretório do módulo, fora de include/trace (ver CFLAGS no Makefile)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE mq_trace
+#include <trace/define_trace.h>